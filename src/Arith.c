@@ -0,0 +1,347 @@
+/*
+  Integer arithmetic on the constants of the shell
+*/
+#include "Parser.h"
+#include "Arith.h"
+
+typedef enum
+{
+    OP_NONE, OP_OR, OP_AND, OP_BOR, OP_XOR, OP_BAND, OP_EQ, OP_NE, OP_LT, OP_LE, OP_GT, OP_GE,
+    OP_SHL, OP_SHR, OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD
+} Op;
+
+static const unsigned char prec[] = { 0, 1, 2, 3, 4, 5, 6, 6, 7, 7, 7, 7, 8, 8, 9, 9, 10, 10, 10 }; /* Binding of each Op, higher binds tighter */
+
+typedef struct
+{
+    const char *s; /* Next character to read */
+    const char *end;
+    const char *expr; /* Whole expression, for messages */
+    unsigned int skip; /* Number of enclosing operands that are parsed but not evaluated */
+    unsigned int depth;
+    bool ok;
+} Arith;
+
+static long long parseAssign(Arith*);
+
+static void fail(Arith *a, const char *msg)
+{
+    if (a->ok)
+        fprintf(stderr, "arith: %s in '%.*s'\n", msg, (int) (a->end - a->expr), a->expr);
+    a->ok = false;
+}
+
+/* Character i places ahead, '\0' past the end */
+static char peek(const Arith *a, size_t i)
+{ return a->s + i < a->end ? a->s[i] : '\0'; }
+
+static void skipSpace(Arith *a)
+{
+    while (a->s < a->end && isspace((unsigned char) *a->s))
+        ++a->s;
+}
+
+/* Recognize the binary operator at the next character, storing its length in len */
+static Op peekBinary(const Arith *a, size_t *len)
+{
+    char c = peek(a, 0);
+    char d = peek(a, 1);
+    *len = 2;
+    if (c == d && (c == '|' || c == '&'))
+        return c == '|' ? OP_OR : OP_AND;
+    if (d == '=' && (c == '=' || c == '!' || c == '<' || c == '>'))
+        return c == '=' ? OP_EQ : c == '!' ? OP_NE : c == '<' ? OP_LE : OP_GE;
+    if (c == d && (c == '<' || c == '>'))
+        return peek(a, 2) == '=' ? OP_NONE : c == '<' ? OP_SHL : OP_SHR; /* <<= and >>= assign */
+    *len = 1;
+    if (d == '=') /* Any other operator followed by = assigns */
+        return OP_NONE;
+    switch (c)
+    {
+    case '|': return OP_BOR;
+    case '^': return OP_XOR;
+    case '&': return OP_BAND;
+    case '<': return OP_LT;
+    case '>': return OP_GT;
+    case '+': return OP_ADD;
+    case '-': return OP_SUB;
+    case '*': return OP_MUL;
+    case '/': return OP_DIV;
+    case '%': return OP_MOD;
+    default: return OP_NONE;
+    }
+}
+
+/* Apply a binary operator other than && and ||, wrapping around on overflow */
+static long long apply(Arith *a, Op op, long long l, long long r)
+{
+    unsigned long long ul = (unsigned long long) l;
+    unsigned long long ur = (unsigned long long) r;
+    switch (op)
+    {
+    case OP_BOR: return l | r;
+    case OP_XOR: return l ^ r;
+    case OP_BAND: return l & r;
+    case OP_EQ: return l == r;
+    case OP_NE: return l != r;
+    case OP_LT: return l < r;
+    case OP_LE: return l <= r;
+    case OP_GT: return l > r;
+    case OP_GE: return l >= r;
+    case OP_SHL: return (long long) (ul << (r & 63));
+    case OP_SHR: return l >> (r & 63);
+    case OP_ADD: return (long long) (ul + ur);
+    case OP_SUB: return (long long) (ul - ur);
+    case OP_MUL: return (long long) (ul * ur);
+    case OP_DIV:
+    case OP_MOD:
+        if (r == 0)
+        {
+            if (a->skip == 0)
+                fail(a, "division by zero");
+            return 0;
+        }
+        if (r == -1) /* LLONG_MIN / -1 overflows */
+            return op == OP_DIV ? (long long) (0 - ul) : 0;
+        return op == OP_DIV ? l / r : l % r;
+    default: return 0;
+    }
+}
+
+/* Parse a number in the digits of base at the next character */
+static long long parseNumber(Arith *a)
+{
+    unsigned long long v = 0;
+    unsigned int base = 10;
+    if (peek(a, 0) == '0' && (peek(a, 1) == 'x' || peek(a, 1) == 'X') && isxdigit((unsigned char) peek(a, 2)))
+    {
+        base = 16;
+        a->s += 2;
+    }
+    else if (peek(a, 0) == '0')
+        base = 8;
+    while (a->s < a->end && isalnum((unsigned char) *a->s))
+    {
+        char c = tolower((unsigned char) *a->s);
+        unsigned int digit = isdigit((unsigned char) c) ? (unsigned int) (c - '0') : (unsigned int) (c - 'a' + 10);
+        if (digit >= base)
+        {
+            fail(a, "invalid number");
+            return 0;
+        }
+        v = v * base + digit;
+        ++a->s;
+    }
+    return (long long) v;
+}
+
+/* Copy the name at the next character into key, which holds BUFF_MAX characters */
+static bool readName(Arith *a, char *key)
+{
+    size_t n = 0;
+    while (a->s + n < a->end && isalnum((unsigned char) a->s[n]))
+        ++n;
+    if (n > BUFF_MAX - 1)
+    {
+        fail(a, "name too long");
+        return false;
+    }
+    memcpy(key, a->s, n);
+    key[n] = '\0';
+    a->s += n;
+    return true;
+}
+
+/* Value of the constant named key, 0 if it is undefined or empty */
+static long long nameValue(Arith *a, char *key)
+{
+    const char *val = getConst(key);
+    char *end = NULL;
+    long long v = strtoll(val, &end, 0);
+    while (isspace((unsigned char) *end))
+        ++end;
+    if (*end != '\0' || (end == val && val[0] != '\0'))
+    {
+        if (a->skip == 0)
+        {
+            fprintf(stderr, "arith: '%s' is not a number\n", val);
+            a->ok = false;
+        }
+        return 0;
+    }
+    return v;
+}
+
+/* Parse a unary operator, parenthesized expression, number or name */
+static long long parseUnary(Arith *a)
+{
+    char key[BUFF_MAX];
+    long long v = 0;
+    char c;
+    skipSpace(a);
+    c = peek(a, 0);
+    if (++a->depth > ARITH_MAX_DEPTH)
+        fail(a, "expression nested too deeply");
+    else if (c == '+' || c == '-' || c == '!' || c == '~')
+    {
+        ++a->s;
+        v = parseUnary(a);
+        v = c == '-' ? (long long) (0 - (unsigned long long) v) : c == '!' ? !v : c == '~' ? ~v : v;
+    }
+    else if (c == '(')
+    {
+        ++a->s;
+        v = parseAssign(a);
+        skipSpace(a);
+        if (peek(a, 0) != ')')
+            fail(a, "expected ')'");
+        ++a->s;
+    }
+    else if (isdigit((unsigned char) c))
+        v = parseNumber(a);
+    else if (isalpha((unsigned char) c))
+    {
+        if (readName(a, key))
+            v = nameValue(a, key);
+    }
+    else
+        fail(a, c == '\0' ? "expected an operand" : "unexpected character");
+    --a->depth;
+    return a->ok ? v : 0;
+}
+
+/* Parse operators binding at least as tightly as minPrec, left to right */
+static long long parseBinary(Arith *a, unsigned int minPrec)
+{
+    long long l = parseUnary(a);
+    long long r;
+    size_t len;
+    Op op;
+    while (a->ok)
+    {
+        skipSpace(a);
+        op = peekBinary(a, &len);
+        if (op == OP_NONE || prec[op] < minPrec)
+            break;
+        a->s += len;
+        if (op == OP_AND || op == OP_OR) /* The right side only counts if the left didn't decide */
+        {
+            bool decided = op == OP_AND ? l == 0 : l != 0;
+            a->skip += decided;
+            r = parseBinary(a, prec[op] + 1);
+            a->skip -= decided;
+            l = decided ? op == OP_OR : r != 0;
+        }
+        else
+        {
+            r = parseBinary(a, prec[op] + 1);
+            l = apply(a, op, l, r);
+        }
+    }
+    return l;
+}
+
+/* Parse COND ? A : B, only evaluating the side chosen */
+static long long parseTernary(Arith *a)
+{
+    long long c = parseBinary(a, 1);
+    long long x;
+    long long y;
+    skipSpace(a);
+    if (!a->ok || peek(a, 0) != '?')
+        return c;
+    ++a->s;
+    a->skip += c == 0;
+    x = parseAssign(a);
+    a->skip -= c == 0;
+    skipSpace(a);
+    if (peek(a, 0) != ':')
+    {
+        fail(a, "expected ':'");
+        return 0;
+    }
+    ++a->s;
+    if (++a->depth > ARITH_MAX_DEPTH)
+    {
+        fail(a, "expression nested too deeply");
+        return 0;
+    }
+    a->skip += c != 0;
+    y = parseTernary(a);
+    a->skip -= c != 0;
+    --a->depth;
+    return c != 0 ? x : y;
+}
+
+/* Parse NAME OP= EXPR, storing the result in the constant, or a conditional */
+static long long parseAssign(Arith *a)
+{
+    char key[BUFF_MAX];
+    char num[24];
+    const char *start;
+    long long v;
+    size_t len = 0;
+    Op op = OP_NONE;
+    char c;
+    skipSpace(a);
+    start = a->s;
+    if (!isalpha((unsigned char) peek(a, 0)) || !readName(a, key))
+        return parseTernary(a);
+    skipSpace(a);
+    c = peek(a, 0);
+    if (c == '=' && peek(a, 1) != '=')
+        len = 1;
+    else if (c != '\0' && strchr("+-*/%&^|", c) != NULL && peek(a, 1) == '=')
+    {
+        len = 2;
+        op = c == '+' ? OP_ADD : c == '-' ? OP_SUB : c == '*' ? OP_MUL : c == '/' ? OP_DIV : c == '%' ? OP_MOD
+            : c == '&' ? OP_BAND : c == '^' ? OP_XOR : OP_BOR;
+    }
+    else if ((c == '<' || c == '>') && peek(a, 1) == c && peek(a, 2) == '=')
+    {
+        len = 3;
+        op = c == '<' ? OP_SHL : OP_SHR;
+    }
+    else /* Not an assignment, parse the name again as an operand */
+    {
+        a->s = start;
+        return parseTernary(a);
+    }
+    a->s += len;
+    if (++a->depth > ARITH_MAX_DEPTH)
+    {
+        fail(a, "expression nested too deeply");
+        return 0;
+    }
+    v = parseAssign(a);
+    --a->depth;
+    if (!a->ok || a->skip > 0)
+        return v;
+    if (op != OP_NONE)
+        v = apply(a, op, nameValue(a, key), v);
+    if (!a->ok)
+        return 0;
+    sprintf(num, "%lld", v);
+    if (!addConst(key, num))
+        a->ok = false;
+    return v;
+}
+
+/*
+  Evaluate the len characters of expr, storing the value in result
+  An expression of only whitespace is 0
+  Returns false, after printing why, if the expression is invalid
+*/
+bool arithEval(const char *expr, size_t len, long long *result)
+{
+    Arith a = { expr, expr + len, expr, 0, 0, true };
+    skipSpace(&a);
+    *result = 0;
+    if (a.s == a.end)
+        return true;
+    *result = parseAssign(&a);
+    skipSpace(&a);
+    if (a.ok && a.s != a.end)
+        fail(&a, "unexpected character");
+    return a.ok;
+}
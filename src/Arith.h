@@ -0,0 +1,35 @@
+/*
+  Arithmetic expansion $(( EXPR )) and the let builtin
+
+  Expressions are evaluated on 64-bit signed integers that wrap around on
+  overflow, with the operators of C from lowest to highest precedence:
+    = += -= *= /= %= <<= >>= &= ^= |=    (right to left)
+    ?:
+    ||
+    &&
+    |
+    ^
+    &
+    == !=
+    < <= > >=
+    << >>
+    + -
+    * / %
+    unary + - ! ~
+  Numbers are decimal, 0x hexadecimal or 0 octal. A name is the value of the
+  constant, 0 if it is undefined or empty. The operands skipped by &&, || and
+  ?: are parsed without being evaluated, so they assign nothing and can't
+  divide by zero. The parser works directly on the text by precedence
+  climbing and never allocates
+*/
+#ifndef ARITH_H
+#define ARITH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define ARITH_MAX_DEPTH 256 /* Deepest nesting of parentheses and right-associative operators */
+
+bool arithEval(const char*, size_t, long long*);
+
+#endif
@@ -0,0 +1,80 @@
+/*
+  Growable character buffer. The contents are always kept null terminated so
+  data can be handed to any of the string functions directly
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Buffer.h"
+
+/* Initialize an empty buffer. No memory is allocated until the first append */
+void bufInit(Buffer *b)
+{
+    b->data = NULL;
+    b->len = 0;
+    b->cap = 0;
+}
+
+/* Release the memory held by the buffer and reset it to empty */
+void bufFree(Buffer *b)
+{
+    free(b->data);
+    bufInit(b);
+}
+
+/* Make sure there is room for at least n more characters plus the terminator */
+bool bufReserve(Buffer *b, size_t n)
+{
+    size_t need = b->len + n + 1;
+    size_t cap = b->cap;
+    char *data = NULL;
+    if (need <= cap)
+        return true;
+    if (cap == 0)
+        cap = INIT_BUFFER;
+    while (cap < need) /* Grow geometrically so appends are amortized constant time */
+        cap *= 2;
+    data = (char*) realloc(b->data, cap);
+    if (data == NULL)
+    {
+        fprintf(stderr, "bufReserve: out of memory\n");
+        return false;
+    }
+    b->data = data;
+    b->data[b->len] = '\0'; /* Keep a fresh allocation null terminated */
+    b->cap = cap;
+    return true;
+}
+
+/* Append n characters of s */
+bool bufAppend(Buffer *b, const char *s, size_t n)
+{
+    if (!bufReserve(b, n))
+        return false;
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+    b->data[b->len] = '\0';
+    return true;
+}
+
+/* Append a null terminated string */
+bool bufAppendStr(Buffer *b, const char *s)
+{ return bufAppend(b, s, strlen(s)); }
+
+/* Append a single character */
+bool bufAppendChar(Buffer *b, char c)
+{ return bufAppend(b, &c, 1); }
+
+/*
+  Hand ownership of the contents to the caller and reset the buffer
+  Always returns an allocated string, even if nothing was appended
+*/
+char* bufRelease(Buffer *b)
+{
+    char *data = NULL;
+    if (b->data == NULL && !bufReserve(b, 0))
+        return NULL;
+    data = b->data;
+    bufInit(b);
+    return data;
+}
@@ -0,0 +1,28 @@
+/*
+  Growable character buffer for strings whose final length is not known in
+  advance (e.g. captured command output)
+*/
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define INIT_BUFFER 256 /* Initial number of bytes to allocate for a buffer */
+
+typedef struct
+{
+    char *data; /* Null terminated contents */
+    size_t len; /* Number of characters stored, not counting the terminator */
+    size_t cap; /* Number of bytes allocated for data */
+} Buffer;
+
+void bufInit(Buffer*);
+void bufFree(Buffer*);
+bool bufReserve(Buffer*, size_t);
+bool bufAppend(Buffer*, const char*, size_t);
+bool bufAppendStr(Buffer*, const char*);
+bool bufAppendChar(Buffer*, char);
+char* bufRelease(Buffer*);
+
+#endif
@@ -0,0 +1,425 @@
+/*
+  Commands run directly by the shell process
+
+  Every builtin has the signature int fn(argc, argv, in, out) and must write
+  its output through writeOut/printOut so that the output can be redirected
+  into a capture buffer when the builtin is the body of a command substitution
+*/
+#include <stdarg.h>
+#include "Builtins.h"
+#include "History.h"
+#include "Copy.h"
+#include "Grep.h"
+#include "Sort.h"
+#include "Arith.h"
+#include "Test.h"
+#include "Jobs.h"
+#include "Startup.h"
+
+static Buffer *capture = NULL; /* Buffer receiving output written to CAPTURE_FD */
+
+static const Builtin builtins[] = {
+    { "[", builtinTest, true },
+    { "bg", builtinBg, false },
+    { "cat", builtinCat, true },
+    { "cd", builtinCd, false },
+    { "echo", builtinEcho, true },
+    { "exit", builtinExit, false },
+    { "export", builtinExport, false },
+    { "fg", builtinFg, false },
+    { "grep", builtinGrep, true },
+    { "history", builtinHistory, true },
+    { "jobs", builtinJobs, true },
+    { "let", builtinLet, false },
+    { "snapshot", builtinSnapshot, false },
+    { "sort", builtinSort, true },
+    { "tee", builtinTee, true },
+    { "test", builtinTest, true },
+    { "wait", builtinWait, false },
+};
+
+/* Look up the builtin with the given name. Returns NULL if there is none */
+const Builtin* getBuiltin(char *name)
+{
+    for (unsigned int i = 0; i < sizeof(builtins) / sizeof(builtins[0]); ++i)
+    {
+        if (strcmp(name, builtins[i].name) == 0)
+            return &builtins[i];
+    }
+    return NULL;
+}
+
+/* Get the table of every builtin, storing its size in n */
+const Builtin* getBuiltins(unsigned int *n)
+{
+    *n = sizeof(builtins) / sizeof(builtins[0]);
+    return builtins;
+}
+
+/* Check if the command name refers to a builtin */
+bool isBuiltin(char *name)
+{ return getBuiltin(name) != NULL; }
+
+/* Run the builtin named by argv[0] */
+int runBuiltin(int argc, char **argv, int in, int out)
+{
+    const Builtin *b = getBuiltin(argv[0]);
+    if (b == NULL)
+    {
+        fprintf(stderr, "runBuiltin: \'%s\' is not a builtin\n", argv[0]);
+        return 1;
+    }
+    return b->fn(argc, argv, in, out);
+}
+
+/*
+  Make buf the destination for output written to CAPTURE_FD
+  Returns the previous destination so nested captures can restore it
+*/
+Buffer* setCapture(Buffer *buf)
+{
+    Buffer *prev = capture;
+    capture = buf;
+    return prev;
+}
+
+/* Write n characters of s to out, retrying short writes */
+bool writeOut(int out, const char *s, size_t n)
+{
+    ssize_t r = 0;
+    if (out == CAPTURE_FD)
+    {
+        if (capture == NULL)
+        {
+            fprintf(stderr, "writeOut: no capture buffer set\n");
+            return false;
+        }
+        return bufAppend(capture, s, n);
+    }
+    if (out == 1)
+        fflush(stdout); /* Keep ordering with anything the shell already printed */
+    while (n > 0)
+    {
+        r = write(out, s, n);
+        if (r == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        s += r;
+        n -= r;
+    }
+    return true;
+}
+
+/* printf to out */
+bool printOut(int out, const char *fmt, ...)
+{
+    char small[BUFF_MAX];
+    char *s = small;
+    bool ok;
+    int n;
+    va_list ap;
+    va_start(ap, fmt);
+    n = vsnprintf(small, sizeof(small), fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return false;
+    if (n >= (int) sizeof(small)) /* Did not fit, format again into a big enough string */
+    {
+        s = (char*) malloc(n + 1);
+        if (s == NULL)
+            return false;
+        va_start(ap, fmt);
+        vsnprintf(s, n + 1, fmt, ap);
+        va_end(ap);
+    }
+    ok = writeOut(out, s, n);
+    if (s != small)
+        free(s);
+    return ok;
+}
+
+/* Change the working directory of the shell */
+int builtinCd(int argc, char **argv, int in, int out)
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "cd: invalid number of arguments\n");
+        return 1;
+    }
+    if (chdir(argv[1]) == -1)
+    {
+        fprintf(stderr, "cd: failed to change directory\n");
+        return 1;
+    }
+    return 0;
+}
+
+/* Quit the shell with an optional exit code */
+int builtinExit(int argc, char **argv, int in, int out)
+{
+    int code = 0;
+    if (argc > 1)
+        code = atoi(argv[1]);
+    exit(code);
+}
+
+/*
+  Pass constants on to child processes
+  export: List the exported constants
+  export NAME...: Export every NAME, later assignments update the environment too
+*/
+int builtinExport(int argc, char **argv, int in, int out)
+{
+    int result = 0;
+    if (argc == 1)
+    {
+        for (unsigned int i = 0; i < numConsts; ++i)
+        {
+            if (exported[i] && !printOut(out, "%s = %s\n", consts[i][0], consts[i][1]))
+                return 1;
+        }
+        return 0;
+    }
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!exportConst(argv[i]))
+            result = 1;
+    }
+    return result;
+}
+
+/* Print the arguments separated by spaces */
+int builtinEcho(int argc, char **argv, int in, int out)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        if (i > 1 && !writeOut(out, " ", 1))
+            return 1;
+        if (!writeOut(out, argv[i], strlen(argv[i])))
+            return 1;
+    }
+    if (!writeOut(out, "\n", 1))
+        return 1;
+    return 0;
+}
+
+/* Print the history entries listed in ids, numbered from 1 */
+static bool printEntries(int out, size_t *ids, size_t n)
+{
+    const char *s;
+    size_t len;
+    for (size_t i = 0; i < n; ++i)
+    {
+        s = histGet(ids[i], &len);
+        if (s != NULL && !printOut(out, "%6zu  %.*s\n", ids[i] + 1, (int) len, s))
+            return false;
+    }
+    return true;
+}
+
+/*
+  Show or search the command history
+  history [N]: List the last N entries (all of them by default)
+  history -p PREFIX: List entries starting with PREFIX
+  history -s TEXT: List entries containing TEXT
+  history -c: Clear the history
+  history -m MAX: Keep only the newest MAX entries
+*/
+int builtinHistory(int argc, char **argv, int in, int out)
+{
+    size_t *ids = NULL;
+    size_t n = 0;
+    size_t total = 0;
+    size_t first = 0;
+    const char *s;
+    size_t len;
+    bool ok = true;
+    if (!histIsOpen() && !histOpen(NULL))
+        return 1;
+    if (argc == 3 && strcmp(argv[1], "-p") == 0)
+        ids = histSearchPrefix(argv[2], &n);
+    else if (argc == 3 && strcmp(argv[1], "-s") == 0)
+        ids = histSearchSubstr(argv[2], &n);
+    else if (argc == 2 && strcmp(argv[1], "-c") == 0)
+        return histClear() ? 0 : 1;
+    else if (argc == 3 && strcmp(argv[1], "-m") == 0)
+    {
+        if (atoll(argv[2]) <= 0)
+        {
+            fprintf(stderr, "history: invalid size \'%s\'\n", argv[2]);
+            return 1;
+        }
+        return histCompact(atoll(argv[2])) ? 0 : 1;
+    }
+    else if (argc <= 2)
+    {
+        total = histCount();
+        if (argc == 2)
+        {
+            if (atoll(argv[1]) <= 0)
+            {
+                fprintf(stderr, "history: invalid count \'%s\'\n", argv[1]);
+                return 1;
+            }
+            if ((size_t) atoll(argv[1]) < total)
+                first = total - atoll(argv[1]);
+        }
+        for (size_t i = first; ok && i < total; ++i)
+        {
+            s = histGet(i, &len);
+            ok = printOut(out, "%6zu  %.*s\n", i + 1, (int) len, s);
+        }
+        return ok ? 0 : 1;
+    }
+    else
+    {
+        fprintf(stderr, "history: usage: history [N] | -p PREFIX | -s TEXT | -c | -m MAX\n");
+        return 1;
+    }
+    if (ids == NULL)
+        return 1;
+    ok = printEntries(out, ids, n);
+    free(ids);
+    return ok ? 0 : 1;
+}
+
+/* Save the constants and PATH cache so the next shell can start from them instead of running the rc file */
+int builtinSnapshot(int argc, char **argv, int in, int out)
+{
+    if (argc != 1)
+    {
+        fprintf(stderr, "snapshot: invalid number of arguments\n");
+        return 1;
+    }
+    return startupSave() ? 0 : 1;
+}
+
+/* Get the job named by arg (an id with an optional leading %), or the current job if arg is NULL. Returns 0 if there is none */
+static int jobArg(const char *name, const char *arg)
+{
+    int id = 0;
+    if (arg == NULL)
+    {
+        id = jobsCurrent();
+        if (id == 0)
+            fprintf(stderr, "%s: no current job\n", name);
+        return id;
+    }
+    if (arg[0] == '%')
+        ++arg;
+    id = atoi(arg);
+    if (id <= 0)
+        fprintf(stderr, "%s: invalid job \'%s\'\n", name, arg);
+    return id < 0 ? 0 : id;
+}
+
+/* Continue a stopped job in the background */
+int builtinBg(int argc, char **argv, int in, int out)
+{
+    int id;
+    if (argc > 2)
+    {
+        fprintf(stderr, "bg: invalid number of arguments\n");
+        return 1;
+    }
+    id = jobArg("bg", argc == 2 ? argv[1] : NULL);
+    return id == 0 ? 1 : jobsResume(id, false);
+}
+
+/* Bring a job to the foreground and wait for it */
+int builtinFg(int argc, char **argv, int in, int out)
+{
+    int id;
+    if (argc > 2)
+    {
+        fprintf(stderr, "fg: invalid number of arguments\n");
+        return 1;
+    }
+    id = jobArg("fg", argc == 2 ? argv[1] : NULL);
+    return id == 0 ? 1 : jobsResume(id, true);
+}
+
+/* List the jobs started by the shell */
+int builtinJobs(int argc, char **argv, int in, int out)
+{
+    jobsList(out);
+    return 0;
+}
+
+/*
+  Wait for jobs to finish
+  wait: Wait for every running job, returns 0
+  wait ID...: Wait for each job, returns the exit status of the last one
+*/
+int builtinWait(int argc, char **argv, int in, int out)
+{
+    int result = 0;
+    int id;
+    if (argc == 1)
+        return jobsWaitAll();
+    for (int i = 1; i < argc; ++i)
+    {
+        id = jobArg("wait", argv[i]);
+        result = id == 0 ? 1 : jobsWait(id);
+    }
+    return result;
+}
+
+/*
+  Copy the files (or the input) to the output
+  cat [FILE]...
+*/
+int builtinCat(int argc, char **argv, int in, int out)
+{ return copyCat(argc, argv, in, out); }
+
+/*
+  Copy the input to the output and to the files
+  tee [-a] [FILE]...
+*/
+int builtinTee(int argc, char **argv, int in, int out)
+{ return copyTee(argc, argv, in, out); }
+
+/*
+  Print the lines of the files (or the input) that match a pattern
+  grep [-c] [-v] [-n] [-l] [-F] PATTERN [FILE]...
+*/
+int builtinGrep(int argc, char **argv, int in, int out)
+{ return grepRun(argc, argv, in, out); }
+
+/*
+  Sort the lines of the files (or the input)
+  sort [-r] [-S SIZE] [-T DIR] [FILE]...
+*/
+int builtinSort(int argc, char **argv, int in, int out)
+{ return sortRun(argc, argv, in, out); }
+
+/*
+  Evaluate a condition without starting a process
+  test EXPR, [ EXPR ]: Returns 0 if it is true, 1 if it is false, 2 on errors
+*/
+int builtinTest(int argc, char **argv, int in, int out)
+{ return testRun(argc, argv, in, out); }
+
+/*
+  Evaluate each argument as an arithmetic expression
+  let EXPR...: Returns 0 if the last expression is not 0, 1 if it is 0 or an
+  expression is invalid
+*/
+int builtinLet(int argc, char **argv, int in, int out)
+{
+    long long v = 0;
+    if (argc < 2)
+    {
+        fprintf(stderr, "let: expected an expression\n");
+        return 1;
+    }
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!arithEval(argv[i], strlen(argv[i]), &v))
+            return 1;
+    }
+    return v == 0;
+}
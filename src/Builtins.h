@@ -0,0 +1,48 @@
+/*
+  Commands that are run inside the shell process instead of being forked and
+  exec'd. Builtins receive the file descriptors they should use for input and
+  output so they can take part in pipelines and command substitution
+*/
+#ifndef BUILTINS_H
+#define BUILTINS_H
+
+#include "Parser.h"
+#include "Buffer.h"
+
+#define CAPTURE_FD -2 /* Pseudo file descriptor that sends builtin output to the active capture buffer */
+
+typedef int (*BuiltinFn)(int argc, char **argv, int in, int out);
+
+typedef struct
+{
+    const char *name;
+    BuiltinFn fn;
+    bool pure; /* Only produces output and leaves the shell state untouched, so it is safe to run without a subshell */
+} Builtin;
+
+const Builtin* getBuiltin(char*);
+const Builtin* getBuiltins(unsigned int*);
+bool isBuiltin(char*);
+int runBuiltin(int, char**, int, int);
+Buffer* setCapture(Buffer*);
+bool writeOut(int, const char*, size_t);
+bool printOut(int, const char*, ...);
+
+int builtinBg(int, char**, int, int);
+int builtinCat(int, char**, int, int);
+int builtinCd(int, char**, int, int);
+int builtinExit(int, char**, int, int);
+int builtinExport(int, char**, int, int);
+int builtinEcho(int, char**, int, int);
+int builtinFg(int, char**, int, int);
+int builtinGrep(int, char**, int, int);
+int builtinHistory(int, char**, int, int);
+int builtinJobs(int, char**, int, int);
+int builtinLet(int, char**, int, int);
+int builtinSnapshot(int, char**, int, int);
+int builtinSort(int, char**, int, int);
+int builtinTee(int, char**, int, int);
+int builtinTest(int, char**, int, int);
+int builtinWait(int, char**, int, int);
+
+#endif
@@ -0,0 +1,552 @@
+/*
+  The cache prefix and its content addressed store
+*/
+#define _GNU_SOURCE
+#include "Parser.h"
+#include "Builtins.h"
+#include "Cache.h"
+#include "Jobs.h"
+#include "Redir.h"
+#include <stdint.h>
+#include <sys/mman.h>
+
+typedef unsigned __int128 Hash; /* 128-bit FNV-1a */
+
+#define HASH_OFFSET (((Hash) 0x6c62272e07bb0142ULL << 64) | 0x62b821756295c58dULL)
+#define HASH_PRIME (((Hash) 1 << 88) | 0x13b)
+
+static Hash hashBytes(Hash h, const void *data, size_t n)
+{
+    const unsigned char *p = (const unsigned char*) data;
+    for (size_t i = 0; i < n; ++i)
+    {
+        h ^= p[i];
+        h *= HASH_PRIME;
+    }
+    return h;
+}
+
+/* Hash the string with its length in front, so neighbouring strings can't run into each other */
+static Hash hashStr(Hash h, const char *s)
+{
+    uint64_t len = strlen(s);
+    h = hashBytes(h, &len, sizeof(len));
+    return hashBytes(h, s, len);
+}
+
+/* Hash everything that can be read from fd from its start. Returns false on a read error */
+static bool hashFd(int fd, Hash *h)
+{
+    char buf[CACHE_BLOCK];
+    struct stat st;
+    ssize_t n;
+    *h = HASH_OFFSET;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            *h = hashBytes(*h, map, st.st_size);
+            munmap(map, st.st_size);
+            return true;
+        }
+    }
+    if (lseek(fd, 0, SEEK_SET) == -1 && errno != ESPIPE)
+        return false;
+    while ((n = read(fd, buf, sizeof(buf))) != 0)
+    {
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        *h = hashBytes(*h, buf, n);
+    }
+    return true;
+}
+
+static void toHex(Hash h, char *hex)
+{
+    for (int i = 31; i >= 0; --i)
+    {
+        hex[i] = "0123456789abcdef"[h & 0xf];
+        h >>= 4;
+    }
+    hex[32] = '\0';
+}
+
+/* Path of name inside the store, NULL if it is too long */
+static char* storePath(const CacheSpec *c, const char *sub, const char *name, char *path)
+{
+    int n = snprintf(path, PATH_MAX, "%s/%s%s%s", c->dir, sub, sub[0] == '\0' ? "" : "/", name);
+    return n >= 0 && n < PATH_MAX ? path : NULL;
+}
+
+/* Copy from the current offset of from to to. Returns false on failure */
+static bool copyFd(int from, int to)
+{
+    char buf[CACHE_BLOCK];
+    ssize_t n;
+    while ((n = copy_file_range(from, NULL, to, NULL, 1 << 30, 0)) > 0)
+        ;
+    if (n == 0)
+        return true;
+    if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)
+        return false;
+    while ((n = read(from, buf, sizeof(buf))) != 0)
+    {
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        if (!writeOut(to, buf, n))
+            return false;
+    }
+    return true;
+}
+
+/* Write everything from the start of fd to out, which may be CAPTURE_FD */
+static bool replayFd(int fd, int out)
+{
+    char buf[CACHE_BLOCK];
+    ssize_t n;
+    if (lseek(fd, 0, SEEK_SET) == -1)
+        return false;
+    while ((n = read(fd, buf, sizeof(buf))) != 0)
+    {
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        if (!writeOut(out, buf, n))
+            return false;
+    }
+    return true;
+}
+
+/*
+  Parse the options of a cache prefix in argv into c, storing the index of
+  the first argument of the command in used. The names point into argv
+  Returns false if the options are invalid or no command is given
+*/
+bool cacheParse(char **argv, unsigned int numArgs, CacheSpec *c, unsigned int *used)
+{
+    unsigned int i = 1;
+    c->numInputs = 0;
+    c->numOutputs = 0;
+    c->numNames = 0;
+    c->content = false;
+    c->owned = false;
+    c->dir = NULL;
+    c->key[0] = '\0';
+    c->tmp = NULL;
+    while (i < numArgs && argv[i][0] == '-')
+    {
+        char opt = argv[i][1];
+        if (strcmp(argv[i], "--") == 0)
+        {
+            ++i;
+            break;
+        }
+        if (argv[i][2] != '\0' || (opt != 'i' && opt != 'o' && opt != 'e' && opt != 'c'))
+        {
+            fprintf(stderr, "cache: invalid option \'%s\'\n", argv[i]);
+            return false;
+        }
+        if (opt == 'c')
+        {
+            c->content = true;
+            ++i;
+            continue;
+        }
+        if (i + 1 >= numArgs)
+        {
+            fprintf(stderr, "cache: option \'%s\' needs a value\n", argv[i]);
+            return false;
+        }
+        if ((opt == 'i' && c->numInputs == CACHE_MAX_FILES) || (opt == 'o' && c->numOutputs == CACHE_MAX_FILES) || (opt == 'e' && c->numNames == CACHE_MAX_FILES))
+        {
+            fprintf(stderr, "cache: too many \'%s\' options\n", argv[i]);
+            return false;
+        }
+        if (opt == 'i')
+            c->inputs[c->numInputs++] = argv[i + 1];
+        else if (opt == 'o')
+        {
+            if (strchr(argv[i + 1], '\n') != NULL)
+            {
+                fprintf(stderr, "cache: invalid output \'%s\'\n", argv[i + 1]);
+                return false;
+            }
+            c->outputs[c->numOutputs++] = argv[i + 1];
+        }
+        else
+            c->names[c->numNames++] = argv[i + 1];
+        i += 2;
+    }
+    if (i >= numArgs)
+    {
+        fprintf(stderr, "cache: no command given\n");
+        return false;
+    }
+    *used = i;
+    return true;
+}
+
+/* Add what identifies the input at path to the key */
+static Hash hashInput(Hash h, const char *path, bool content)
+{
+    struct stat st;
+    Hash data;
+    int fd;
+    h = hashStr(h, path);
+    if (stat(path, &st) == -1)
+        return hashStr(h, "-"); /* A missing input is part of the key too */
+    if (content && S_ISREG(st.st_mode) && (fd = open(path, O_RDONLY | O_CLOEXEC)) != -1)
+    {
+        bool ok = hashFd(fd, &data);
+        close(fd);
+        if (ok)
+            return hashBytes(hashStr(h, "c"), &data, sizeof(data));
+    }
+    uint64_t id[6] = { st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec, st.st_ino, st.st_dev, st.st_mode };
+    return hashBytes(hashStr(h, "s"), id, sizeof(id));
+}
+
+/* Work out the store directory and the key of the command */
+static bool makeKey(CacheSpec *c, char **argv, unsigned int numArgs, char **redirs, char **filenames, unsigned int numRedirs)
+{
+    char cwd[PATH_MAX];
+    const char *dir = getConst("CACHEDIR");
+    const char *home = NULL;
+    Hash h = HASH_OFFSET;
+    size_t len = 0;
+    if (strlen(dir) > 0)
+        c->dir = strdup(dir);
+    else
+    {
+        home = getenv("HOME");
+        if (home == NULL)
+        {
+            fprintf(stderr, "cache: neither CACHEDIR nor HOME is set\n");
+            return false;
+        }
+        len = strlen(home) + strlen(CACHE_NAME) + 2;
+        c->dir = (char*) malloc(len);
+        if (c->dir != NULL)
+            snprintf(c->dir, len, "%s/%s", home, CACHE_NAME);
+    }
+    if (c->dir == NULL || getcwd(cwd, sizeof(cwd)) == NULL)
+    {
+        fprintf(stderr, "cache: could not work out the key of \'%s\'\n", argv[0]);
+        return false;
+    }
+    h = hashBytes(h, &numArgs, sizeof(numArgs));
+    for (unsigned int i = 0; i < numArgs; ++i)
+        h = hashStr(h, argv[i]);
+    h = hashBytes(h, &numRedirs, sizeof(numRedirs));
+    for (unsigned int i = 0; i < numRedirs; ++i)
+        h = hashStr(hashStr(h, redirs[i]), filenames[i]);
+    h = hashStr(hashStr(h, cwd), getConst("PATH"));
+    h = hashBytes(h, &c->numNames, sizeof(c->numNames));
+    for (unsigned int i = 0; i < c->numNames; ++i)
+        h = hashStr(hashStr(h, c->names[i]), getConst(c->names[i]));
+    h = hashBytes(h, &c->numInputs, sizeof(c->numInputs));
+    for (unsigned int i = 0; i < c->numInputs; ++i)
+        h = hashInput(h, c->inputs[i], c->content);
+    h = hashBytes(h, &c->numOutputs, sizeof(c->numOutputs));
+    for (unsigned int i = 0; i < c->numOutputs; ++i)
+        h = hashStr(h, c->outputs[i]);
+    toHex(h, c->key);
+    return true;
+}
+
+/* Put the object named hex back at path */
+static bool restoreOutput(const CacheSpec *c, const char *hex, const char *path)
+{
+    char obj[PATH_MAX];
+    int from;
+    int to;
+    bool ok;
+    if (storePath(c, "objects", hex, obj) == NULL || (from = open(obj, O_RDONLY | O_CLOEXEC)) == -1)
+        return false;
+    to = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (to == -1)
+    {
+        close(from);
+        return false;
+    }
+    ok = copyFd(from, to);
+    close(from);
+    close(to);
+    return ok;
+}
+
+/* Add name to the list unless it is already there. Returns false if the list is full */
+static bool addName(char **names, unsigned int *n, char *name)
+{
+    for (unsigned int i = 0; i < *n; ++i)
+    {
+        if (strcmp(names[i], name) == 0)
+            return true;
+    }
+    if (*n == CACHE_MAX_FILES)
+    {
+        fprintf(stderr, "cache: too many files to cache '%s'\n", name);
+        return false;
+    }
+    names[(*n)++] = name;
+    return true;
+}
+
+/*
+  Make the files read by the redirections inputs and the regular files
+  written by them outputs, as if they were named with -i and -o, so that a
+  hit depends on what the command read and puts back what it wrote. Files
+  appended to are inputs too: what they end up holding depends on what they
+  held before
+  Returns false if the command can't be cached
+*/
+static bool addRedirs(CacheSpec *c, char **redirs, char **filenames, unsigned int numRedirs)
+{
+    struct stat st;
+    Redir r;
+    for (unsigned int i = 0; i < numRedirs; ++i)
+    {
+        if (!redirParse(redirs[i], &r)) /* Reported when the command runs */
+            continue;
+        if (r.kind == REDIR_DUP && strcmp(redirs[i], ">&") == 0 && strcmp(filenames[i], "-") != 0
+            && !(isdigit(filenames[i][0]) && filenames[i][1] == '\0')) /* >& FILE */
+            r.kind = REDIR_OUT;
+        if ((r.kind == REDIR_IN || r.kind == REDIR_RDWR || r.kind == REDIR_APPEND) && !addName(c->inputs, &c->numInputs, filenames[i]))
+            return false;
+        if (r.kind != REDIR_OUT && r.kind != REDIR_APPEND && r.kind != REDIR_RDWR)
+            continue;
+        if (stat(filenames[i], &st) == 0 && !S_ISREG(st.st_mode)) /* e.g. /dev/null, nothing to put back */
+            continue;
+        if (strchr(filenames[i], '\n') != NULL)
+        {
+            fprintf(stderr, "cache: invalid output '%s'\n", filenames[i]);
+            return false;
+        }
+        if (!addName(c->outputs, &c->numOutputs, filenames[i]))
+            return false;
+    }
+    return true;
+}
+
+/*
+  Replay the entry of the command if the store has one
+  argv, numArgs: The command after the prefix
+  redirs, filenames, numRedirs: Its redirections, whose files count as inputs and outputs
+  out: Where the standard output of the command goes
+  Returns true and stores the exit status in status if the command was
+  replayed, false if it has to be run
+*/
+bool cacheLookup(CacheSpec *c, char **argv, unsigned int numArgs, char **redirs, char **filenames, unsigned int numRedirs, int out, int *status)
+{
+    char path[PATH_MAX];
+    char hex[33];
+    char line[PATH_MAX + 64];
+    char stdoutHex[33] = "";
+    FILE *entry;
+    int fd;
+    bool found = false;
+    int n = 0;
+    if (!addRedirs(c, redirs, filenames, numRedirs))
+        return false;
+    for (unsigned int i = 0; i < c->numOutputs; ++i)
+    {
+        c->outputs[i] = strdup(c->outputs[i]); /* The prefix is freed before the command runs */
+        if (c->outputs[i] == NULL)
+        {
+            c->numOutputs = i;
+            c->owned = true;
+            return false;
+        }
+    }
+    c->owned = true;
+    if (!makeKey(c, argv, numArgs, redirs, filenames, numRedirs))
+    {
+        c->key[0] = '\0';
+        return false;
+    }
+    if (storePath(c, "entries", c->key, path) == NULL || (entry = fopen(path, "re")) == NULL)
+        return false;
+    /* Make sure every object is still there before writing anything */
+    while (fgets(line, sizeof(line), entry) != NULL)
+    {
+        if (sscanf(line, "status %d", status) == 1)
+            found = true;
+        else if (sscanf(line, "stdout %32s", stdoutHex) == 1)
+            ;
+        else if (sscanf(line, "output %32s %n", hex, &n) == 1 && storePath(c, "objects", hex, path) != NULL && access(path, R_OK) == 0)
+            ;
+        else
+            found = false;
+        if (!found)
+            break;
+    }
+    if (!found || stdoutHex[0] == '\0' || storePath(c, "objects", stdoutHex, path) == NULL || (fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+    {
+        fclose(entry);
+        return false;
+    }
+    rewind(entry);
+    while (fgets(line, sizeof(line), entry) != NULL)
+    {
+        if (sscanf(line, "output %32s %n", hex, &n) != 1)
+            continue;
+        line[strcspn(line, "\n")] = '\0';
+        if (!restoreOutput(c, hex, line + n))
+        {
+            fprintf(stderr, "cache: could not restore \'%s\'\n", line + n);
+            *status = 1;
+        }
+    }
+    fclose(entry);
+    if (!replayFd(fd, out))
+    {
+        fprintf(stderr, "cache: could not replay the output of \'%s\'\n", argv[0]);
+        *status = 1;
+    }
+    close(fd);
+    return true;
+}
+
+/*
+  Create the store if needed and open a file in it to receive the output of
+  the command. Returns the descriptor, or -1 (after releasing c) if the
+  command can't be cached and should just run
+*/
+int cacheBegin(CacheSpec *c)
+{
+    char path[PATH_MAX];
+    int fd;
+    if (c->key[0] == '\0')
+    {
+        cacheClear(c);
+        return -1;
+    }
+    if ((mkdir(c->dir, 0700) == -1 && errno != EEXIST)
+        || storePath(c, "objects", "", path) == NULL || (mkdir(path, 0700) == -1 && errno != EEXIST)
+        || storePath(c, "entries", "", path) == NULL || (mkdir(path, 0700) == -1 && errno != EEXIST)
+        || storePath(c, "", "tmp.XXXXXX", path) == NULL || (fd = mkostemp(path, O_CLOEXEC)) == -1)
+    {
+        fprintf(stderr, "cache: could not write to \'%s\'\n", c->dir);
+        cacheClear(c);
+        return -1;
+    }
+    c->tmp = strdup(path);
+    return redirHigh(fd); /* Builtins write to it while their redirections are applied */
+}
+
+/* Move the file at tmp into the store under the hash of the contents of fd */
+static bool storeObject(const CacheSpec *c, int fd, const char *tmp, char *hex)
+{
+    char path[PATH_MAX];
+    Hash h;
+    if (!hashFd(fd, &h))
+        return false;
+    toHex(h, hex);
+    if (storePath(c, "objects", hex, path) == NULL)
+        return false;
+    return rename(tmp, path) == 0;
+}
+
+/* Copy the output file at path into the store, naming the object in hex */
+static bool storeOutput(const CacheSpec *c, const char *path, char *hex)
+{
+    char tmp[PATH_MAX];
+    struct stat st;
+    int from = open(path, O_RDONLY | O_CLOEXEC);
+    int to;
+    bool ok;
+    if (from == -1)
+        return false;
+    if (fstat(from, &st) == -1 || !S_ISREG(st.st_mode) || storePath(c, "", "tmp.XXXXXX", tmp) == NULL || (to = mkostemp(tmp, O_CLOEXEC)) == -1)
+    {
+        close(from);
+        return false;
+    }
+    ok = copyFd(from, to) && storeObject(c, to, tmp, hex);
+    if (!ok)
+        unlink(tmp);
+    close(from);
+    close(to);
+    return ok;
+}
+
+/*
+  Save the result of the command that wrote its output to fd and pass the
+  output on to out. Commands that couldn't be run, were killed (status 126
+  and up) or timed out and commands whose outputs weren't created are not
+  saved
+  Releases c and closes fd
+*/
+void cacheFinish(CacheSpec *c, int fd, int status, int out)
+{
+    char hexes[CACHE_MAX_FILES][33];
+    char stdoutHex[33];
+    char path[PATH_MAX];
+    char tmp[PATH_MAX];
+    FILE *entry = NULL;
+    int entryFd;
+    bool ok = status >= 0 && status < 126 && status != JOBS_TIMED_OUT;
+    for (unsigned int i = 0; ok && i < c->numOutputs; ++i)
+        ok = storeOutput(c, c->outputs[i], hexes[i]);
+    if (!replayFd(fd, out))
+        fprintf(stderr, "cache: could not write the output\n");
+    if (ok && storeObject(c, fd, c->tmp, stdoutHex))
+    {
+        free(c->tmp);
+        c->tmp = NULL;
+        if (storePath(c, "entries", c->key, path) != NULL && storePath(c, "", "tmp.XXXXXX", tmp) != NULL
+            && (entryFd = mkostemp(tmp, O_CLOEXEC)) != -1)
+        {
+            entry = fdopen(entryFd, "w");
+            if (entry == NULL)
+                close(entryFd);
+        }
+        if (entry != NULL)
+        {
+            fprintf(entry, "status %d\nstdout %s\n", status, stdoutHex);
+            for (unsigned int i = 0; i < c->numOutputs; ++i)
+                fprintf(entry, "output %s %s\n", hexes[i], c->outputs[i]);
+            if (fclose(entry) != 0 || rename(tmp, path) != 0) /* Readers see the whole entry or none of it */
+                unlink(tmp);
+        }
+    }
+    cacheAbort(c, fd);
+}
+
+/* Close fd and drop the store file it was writing, then release c */
+void cacheAbort(CacheSpec *c, int fd)
+{
+    close(fd);
+    if (c->tmp != NULL)
+        unlink(c->tmp);
+    cacheClear(c);
+}
+
+/* Release what c owns */
+void cacheClear(CacheSpec *c)
+{
+    if (c->owned)
+    {
+        for (unsigned int i = 0; i < c->numOutputs; ++i)
+            free(c->outputs[i]);
+    }
+    c->numOutputs = 0;
+    c->owned = false;
+    free(c->dir);
+    c->dir = NULL;
+    free(c->tmp);
+    c->tmp = NULL;
+}
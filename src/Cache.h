@@ -0,0 +1,53 @@
+/*
+  Caching the results of commands
+
+  A command line can start with the cache prefix to skip running a command
+  whose result is already known:
+    cache [-i FILE]... [-o FILE]... [-e NAME]... [-c] [--] COMMAND...
+  The key of a command is a hash of its arguments and redirections, the
+  working directory, PATH, the constants named with -e and the inputs named
+  with -i, each identified by its size, modification time and inode, or by
+  the hash of its contents with -c. Files read or appended to through
+  redirections are inputs too, and regular files written through them are
+  outputs, as if they were named with -i and -o. A command that exits normally has its
+  exit status, its standard output and the files named with -o saved in the
+  store, a directory of objects named by the hash of their contents and
+  entries named by key listing the objects of each command. The next time
+  the key comes up the output is written and the files put back without
+  running anything
+
+  The store is the directory in the CACHEDIR constant, or CACHE_NAME in the
+  home directory
+*/
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+
+#define CACHE_NAME ".soyshell_cache" /* Store in the home directory when CACHEDIR isn't set */
+#define CACHE_MAX_FILES 32 /* Most inputs, outputs or constants named with each option */
+#define CACHE_BLOCK (1 << 16) /* Bytes copied at once */
+
+typedef struct
+{
+    char *inputs[CACHE_MAX_FILES];
+    unsigned int numInputs;
+    char *outputs[CACHE_MAX_FILES]; /* Owned once the key has been looked up */
+    unsigned int numOutputs;
+    char *names[CACHE_MAX_FILES];
+    unsigned int numNames;
+    bool content; /* Identify inputs by the hash of their contents */
+    bool owned; /* The outputs have been copied out of the argument list */
+    char *dir; /* Store directory */
+    char key[33]; /* Hex key of the command, empty if it couldn't be computed */
+    char *tmp; /* Store file holding the output while the command runs */
+} CacheSpec;
+
+bool cacheParse(char**, unsigned int, CacheSpec*, unsigned int*);
+bool cacheLookup(CacheSpec*, char**, unsigned int, char**, char**, unsigned int, int, int*);
+int cacheBegin(CacheSpec*);
+void cacheFinish(CacheSpec*, int, int, int);
+void cacheAbort(CacheSpec*, int);
+void cacheClear(CacheSpec*);
+
+#endif
@@ -0,0 +1,122 @@
+/*
+  Client for soyshell --serve
+
+  Usage: soyclient SOCKET COMMAND...
+  Joins COMMAND into one command line, runs it in the server with this
+  process's stdio and working directory and exits with its status
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "Server.h"
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_un addr;
+    char *cmd = NULL;
+    size_t len = 0;
+    uint32_t n = 0;
+    int32_t status = 0;
+    int fds[SERVE_FDS] = { 0, 1, 2, -1 };
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov[2];
+    struct msghdr msg;
+    struct cmsghdr *c = NULL;
+    ssize_t r = 0;
+    size_t got = 0;
+    int sock = -1;
+    if (argc < 3)
+    {
+        fprintf(stderr, "usage: soyclient SOCKET COMMAND...\n");
+        return 2;
+    }
+    for (int i = 2; i < argc; ++i)
+        len += strlen(argv[i]) + 1;
+    if (len > SERVE_MAX_CMD)
+    {
+        fprintf(stderr, "soyclient: command line too long\n");
+        return 2;
+    }
+    cmd = (char*) malloc(len);
+    cmd[0] = '\0';
+    for (int i = 2; i < argc; ++i)
+    {
+        if (i > 2)
+            strcat(cmd, " ");
+        strcat(cmd, argv[i]);
+    }
+    n = strlen(cmd);
+    if (strlen(argv[1]) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "soyclient: socket path too long\n");
+        return 2;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, argv[1]);
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    fds[3] = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (sock == -1 || fds[3] == -1 || connect(sock, (struct sockaddr*) &addr, sizeof(addr)) == -1)
+    {
+        fprintf(stderr, "soyclient: could not connect to '%s' (%s)\n", argv[1], strerror(errno));
+        return 2;
+    }
+    /* Header and command line in one message, with the descriptors attached */
+    iov[0].iov_base = &n;
+    iov[0].iov_len = sizeof(n);
+    iov[1].iov_base = cmd;
+    iov[1].iov_len = n;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(c), fds, sizeof(fds));
+    while ((r = sendmsg(sock, &msg, 0)) == -1 && errno == EINTR)
+        ;
+    if (r == -1)
+    {
+        fprintf(stderr, "soyclient: failed to send the command\n");
+        return 2;
+    }
+    /* Send whatever a short write left behind, the descriptors already went with the first byte */
+    for (size_t off = r; off < sizeof(n) + n; off += r)
+    {
+        if (off < sizeof(n))
+            r = write(sock, (char*) &n + off, sizeof(n) - off);
+        else
+            r = write(sock, cmd + off - sizeof(n), sizeof(n) + n - off);
+        if (r == -1 && errno == EINTR)
+            r = 0;
+        else if (r <= 0)
+        {
+            fprintf(stderr, "soyclient: failed to send the command\n");
+            return 2;
+        }
+    }
+    free(cmd);
+    while (got < sizeof(status))
+    {
+        r = read(sock, (char*) &status + got, sizeof(status) - got);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0)
+        {
+            fprintf(stderr, "soyclient: server closed the connection\n");
+            return 2;
+        }
+        got += r;
+    }
+    close(sock);
+    return status;
+}
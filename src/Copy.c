@@ -0,0 +1,332 @@
+/*
+  Zero copy transfers between descriptors for the cat and tee builtins
+*/
+#include "Parser.h"
+#include "Builtins.h"
+#include "Copy.h"
+#include <sys/sendfile.h>
+
+#define FALLBACK -1 /* Returned by moveFast when the fds don't support zero copy transfers */
+
+typedef struct
+{
+    int fd;
+    const char *name;
+    bool slow; /* splice is not supported for this fd, copy through the buffer */
+    bool failed; /* A write error occured, stop writing here */
+} CopyDest;
+
+typedef struct
+{
+    int in;
+    CopyDest dests[MAX_ARGS];
+    unsigned int numDests;
+    int status;
+} Tee;
+
+static char buf[COPY_BUFF];
+
+/* Copy everything from in to out through the buffer. Returns 1 on errors */
+static int moveLoop(int in, int out)
+{
+    ssize_t n;
+    while ((n = read(in, buf, sizeof(buf))) != 0)
+    {
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+        if (!writeOut(out, buf, n))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+  Move everything from in to out without copying it through user space
+  splice is used when either side is a pipe and sendfile when reading a regular file
+  Returns FALLBACK if nothing was moved because the kernel can't handle this pair of fds
+*/
+static int moveFast(int in, int out)
+{
+    struct stat sin;
+    struct stat sout;
+    ssize_t n;
+    size_t moved = 0;
+    if (out == CAPTURE_FD || fstat(in, &sin) == -1 || fstat(out, &sout) == -1)
+        return FALLBACK;
+    if (S_ISFIFO(sin.st_mode) || S_ISFIFO(sout.st_mode)) /* file->pipe, pipe->file, pipe->pipe */
+    {
+        while ((n = splice(in, NULL, out, NULL, COPY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE)) != 0)
+        {
+            if (n == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (moved == 0 && (errno == EINVAL || errno == ENOSYS))
+                    return FALLBACK;
+                return 1;
+            }
+            moved += n;
+        }
+        return 0;
+    }
+    if (S_ISREG(sin.st_mode)) /* file->anything else */
+    {
+        while ((n = sendfile(out, in, NULL, COPY_CHUNK)) != 0)
+        {
+            if (n == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (moved == 0 && (errno == EINVAL || errno == ENOSYS))
+                    return FALLBACK;
+                return 1;
+            }
+            moved += n;
+        }
+        return 0;
+    }
+    return FALLBACK;
+}
+
+/*
+  Concatenate the files (or the input) to the output
+  cat [FILE]...
+*/
+int copyCat(int argc, char **argv, int in, int out)
+{
+    char *input[] = { "-" };
+    char **names = argc < 2 ? input : argv + 1;
+    unsigned int numNames = argc < 2 ? 1 : argc - 1;
+    int r = 0;
+    int fd;
+    int status;
+    fflush(stdout); /* Anything the shell printed has to come first */
+    for (unsigned int i = 0; i < numNames; ++i)
+    {
+        if (strcmp(names[i], "-") == 0)
+            fd = in;
+        else
+            fd = open(names[i], O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            fprintf(stderr, "cat: could not open %s\n", names[i]);
+            r = 1;
+            continue;
+        }
+        status = moveFast(fd, out);
+        if (status == FALLBACK)
+            status = moveLoop(fd, out);
+        if (status != 0)
+        {
+            fprintf(stderr, "cat: error copying %s: %s\n", fd == in ? "input" : names[i], strerror(errno));
+            r = 1;
+        }
+        if (fd != in)
+            close(fd);
+    }
+    return r;
+}
+
+/* Write n bytes of data to the destination, dropping it on error */
+static void writeDest(Tee *t, CopyDest *d, const char *data, size_t n)
+{
+    if (d->failed || writeOut(d->fd, data, n))
+        return;
+    fprintf(stderr, "tee: error writing %s: %s\n", d->name, strerror(errno));
+    d->failed = true;
+    t->status = 1;
+}
+
+/* Copy the input to every destination through the buffer */
+static void teeLoop(Tee *t)
+{
+    ssize_t n;
+    while ((n = read(t->in, buf, sizeof(buf))) != 0)
+    {
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "tee: error reading input: %s\n", strerror(errno));
+            t->status = 1;
+            return;
+        }
+        for (unsigned int i = 0; i < t->numDests; ++i)
+            writeDest(t, &t->dests[i], buf, n);
+    }
+}
+
+/*
+  Drain exactly n bytes from the pipe scratch into the destination
+  Falls back to read/write for this destination if splice is refused
+*/
+static bool drainTo(Tee *t, int scratch, CopyDest *d, size_t n)
+{
+    ssize_t m;
+    while (n > 0)
+    {
+        if (!d->slow && !d->failed)
+        {
+            m = splice(scratch, NULL, d->fd, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (m == -1 && errno == EINTR)
+                continue;
+            if (m == -1 && errno == EINVAL) /* e.g. O_APPEND files on some kernels */
+            {
+                d->slow = true;
+                continue;
+            }
+            if (m == -1)
+            {
+                fprintf(stderr, "tee: error writing %s: %s\n", d->name, strerror(errno));
+                d->failed = true;
+                t->status = 1;
+                continue;
+            }
+        }
+        else /* Pull the data out of the pipe ourselves */
+        {
+            m = read(scratch, buf, n < sizeof(buf) ? n : sizeof(buf));
+            if (m == -1 && errno == EINTR)
+                continue;
+            if (m <= 0)
+                return false;
+            writeDest(t, d, buf, m);
+        }
+        n -= m;
+    }
+    return true;
+}
+
+/*
+  Duplicate the input to every destination without copying it through user space
+  Returns false if the input can't be used this way
+*/
+static bool teeFast(Tee *t)
+{
+    int scratch[2];
+    int devnull;
+    ssize_t n;
+    ssize_t m;
+    int size;
+    bool first = true;
+    struct stat st;
+    if (fstat(t->in, &st) == -1 || !S_ISFIFO(st.st_mode))
+        return false;
+    if (pipe2(scratch, O_CLOEXEC) == -1)
+        return false;
+    devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (devnull == -1)
+    {
+        close(scratch[0]);
+        close(scratch[1]);
+        return false;
+    }
+    /* The scratch pipe must be able to hold everything the input can, or tee would come up short */
+    size = fcntl(t->in, F_GETPIPE_SZ);
+    if (size > 0)
+        size = fcntl(scratch[1], F_SETPIPE_SZ, size);
+    if (size <= 0)
+        size = fcntl(scratch[1], F_GETPIPE_SZ);
+    if (size <= 0 || size > COPY_CHUNK)
+        size = COPY_CHUNK;
+    while (1)
+    {
+        n = tee(t->in, scratch[1], size, 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && first && (errno == EINVAL || errno == ENOSYS))
+        {
+            close(scratch[0]);
+            close(scratch[1]);
+            close(devnull);
+            return false;
+        }
+        if (n <= 0) /* End of input or error */
+        {
+            if (n == -1)
+            {
+                fprintf(stderr, "tee: error reading input: %s\n", strerror(errno));
+                t->status = 1;
+            }
+            break;
+        }
+        first = false;
+        drainTo(t, scratch[0], &t->dests[0], n);
+        for (unsigned int i = 1; i < t->numDests; ++i)
+        {
+            m = tee(t->in, scratch[1], n, 0);
+            if (m != n) /* Can't happen while the input still holds the n bytes */
+            {
+                fprintf(stderr, "tee: short duplicate of input\n");
+                t->status = 1;
+                break;
+            }
+            drainTo(t, scratch[0], &t->dests[i], n);
+        }
+        /* Every destination has its copy, consume the data from the input */
+        while (n > 0)
+        {
+            m = splice(t->in, NULL, devnull, NULL, n, SPLICE_F_MOVE);
+            if (m == -1 && errno == EINTR)
+                continue;
+            if (m == -1)
+                m = read(t->in, buf, n < (ssize_t) sizeof(buf) ? n : (ssize_t) sizeof(buf));
+            if (m <= 0)
+                break;
+            n -= m;
+        }
+    }
+    close(scratch[0]);
+    close(scratch[1]);
+    close(devnull);
+    return true;
+}
+
+/*
+  Copy the input to the output and to every file
+  tee [-a] [FILE]...
+*/
+int copyTee(int argc, char **argv, int in, int out)
+{
+    static Tee t;
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    int i = 1;
+    int fd;
+    if (argc > 1 && strcmp(argv[1], "-a") == 0) /* Append instead of truncating */
+    {
+        flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+        ++i;
+    }
+    t.in = in;
+    t.status = 0;
+    t.numDests = 1;
+    t.dests[0].fd = out;
+    t.dests[0].name = "output";
+    t.dests[0].slow = out == CAPTURE_FD;
+    t.dests[0].failed = false;
+    for (; i < argc; ++i)
+    {
+        fd = open(argv[i], flags, 0666);
+        if (fd == -1)
+        {
+            fprintf(stderr, "tee: could not open %s\n", argv[i]);
+            t.status = 1;
+            continue;
+        }
+        t.dests[t.numDests].fd = fd;
+        t.dests[t.numDests].name = argv[i];
+        t.dests[t.numDests].slow = false;
+        t.dests[t.numDests].failed = false;
+        ++t.numDests;
+    }
+    fflush(stdout); /* Anything the shell printed has to come first */
+    if (!teeFast(&t))
+        teeLoop(&t);
+    for (unsigned int j = 1; j < t.numDests; ++j)
+        close(t.dests[j].fd);
+    return t.status;
+}
@@ -0,0 +1,28 @@
+/*
+  The cat and tee builtins
+
+  cat [FILE]...
+  Copies the files (or the input, also named by -) to the output. splice is
+  used when either side is a pipe and sendfile when reading a regular file,
+  so the data never passes through the shell. Other descriptors, and output
+  going into a command substitution, are copied through a COPY_BUFF sized
+  buffer
+
+  tee [-a] [FILE]...
+  Copies the input to the output and every file, appending with -a. When the
+  input is a pipe each round tee(2) clones the pending data into a scratch
+  pipe that is spliced into one destination at a time, and the data is only
+  consumed from the input once every destination has its copy. Destinations
+  that refuse splice (e.g. O_APPEND files on some kernels) are written from
+  the buffer instead
+*/
+#ifndef COPY_H
+#define COPY_H
+
+#define COPY_CHUNK (1 << 20) /* Most bytes moved by one splice, sendfile or tee call */
+#define COPY_BUFF (1 << 17) /* Size of the buffer used when the kernel can't move the data */
+
+int copyCat(int, char**, int, int);
+int copyTee(int, char**, int, int);
+
+#endif
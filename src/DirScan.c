@@ -0,0 +1,90 @@
+/*
+  Batched directory reading with getdents64
+*/
+#include "Parser.h"
+#include "DirScan.h"
+#include <sys/syscall.h>
+
+/* Layout of the records returned by getdents64 */
+struct linux_dirent64
+{
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* Open path for scanning */
+bool dirOpen(DirScan *d, const char *path)
+{
+    d->buf = NULL;
+    d->len = 0;
+    d->pos = 0;
+    d->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (d->fd == -1)
+        return false;
+    d->buf = (char*) malloc(DIRSCAN_BATCH);
+    if (d->buf == NULL)
+    {
+        close(d->fd);
+        d->fd = -1;
+        return false;
+    }
+    return true;
+}
+
+/*
+  Get the next entry, skipping . and ..
+  name is only valid until the next call. type is a DT_* constant, which may be
+  DT_UNKNOWN on filesystems that don't report it
+  Returns false once every entry has been read
+*/
+bool dirNext(DirScan *d, const char **name, unsigned char *type)
+{
+    struct linux_dirent64 *ent = NULL;
+    while (1)
+    {
+        if (d->pos >= d->len) /* Batch used up, fetch the next one */
+        {
+            d->len = syscall(SYS_getdents64, d->fd, d->buf, DIRSCAN_BATCH);
+            d->pos = 0;
+            if (d->len <= 0)
+                return false;
+        }
+        ent = (struct linux_dirent64*) (d->buf + d->pos);
+        d->pos += ent->d_reclen;
+        if (ent->d_name[0] == '.' && (ent->d_name[1] == '\0' || (ent->d_name[1] == '.' && ent->d_name[2] == '\0')))
+            continue;
+        *name = ent->d_name;
+        *type = ent->d_type;
+        return true;
+    }
+}
+
+/* Release the scanner */
+void dirClose(DirScan *d)
+{
+    if (d->fd != -1)
+        close(d->fd);
+    free(d->buf);
+    d->fd = -1;
+    d->buf = NULL;
+}
+
+/*
+  Check if the entry name in directory dir is a directory, only calling stat
+  when the type reported by getdents64 is not conclusive (links, DT_UNKNOWN)
+*/
+bool dirIsDir(const char *dir, const char *name, unsigned char type)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    if (type == DT_DIR)
+        return true;
+    if (type != DT_LNK && type != DT_UNKNOWN)
+        return false;
+    if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int) sizeof(path))
+        return false;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
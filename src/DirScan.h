@@ -0,0 +1,28 @@
+/*
+  Directory reader that pulls entries from the kernel in large getdents64
+  batches instead of one readdir call per entry. Used wherever a whole
+  directory has to be walked (PATH scanning, completion, globbing)
+*/
+#ifndef DIRSCAN_H
+#define DIRSCAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <dirent.h> /* DT_* entry types */
+
+#define DIRSCAN_BATCH (256 * 1024) /* Bytes of directory entries fetched per system call */
+
+typedef struct
+{
+    int fd;
+    char *buf; /* Batch of raw linux_dirent64 records */
+    long len; /* Number of valid bytes in buf */
+    long pos; /* Offset of the next record in buf */
+} DirScan;
+
+bool dirOpen(DirScan*, const char*);
+bool dirNext(DirScan*, const char**, unsigned char*);
+void dirClose(DirScan*);
+bool dirIsDir(const char*, const char*, unsigned char);
+
+#endif
@@ -0,0 +1,555 @@
+/*
+  Line editor for interactive input
+
+  When stdin is a terminal it is switched to raw mode while a line is being
+  read so every key can be handled: cursor movement, history recall (up/down)
+  and tab completion. Command names are completed from the PATH trie and the
+  builtins, anything else as a file path with the directory read in batches.
+  When stdin is not a terminal lines are read as-is with getline
+*/
+#include "Parser.h"
+#include "Editor.h"
+#include "Builtins.h"
+#include "History.h"
+#include "PathCache.h"
+#include "DirScan.h"
+#include <termios.h>
+#include <sys/ioctl.h>
+
+typedef struct
+{
+    Buffer buf; /* Text of the line */
+    size_t pos; /* Cursor position in buf */
+    const char *prompt;
+    size_t histPos; /* History entry being shown, histCount() for the line being typed */
+    char *saved; /* Line being typed while browsing the history */
+    bool lastTab; /* Previous key was a tab that could not complete anything */
+} Line;
+
+/* Write the whole string to the terminal */
+static void termWrite(const char *s, size_t n)
+{
+    ssize_t w;
+    while (n > 0)
+    {
+        w = write(1, s, n);
+        if (w == -1 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return;
+        s += w;
+        n -= w;
+    }
+}
+
+/* Redraw the prompt and line and put the cursor back in place */
+static void refresh(Line *l)
+{
+    char move[32];
+    Buffer out;
+    bufInit(&out);
+    bufAppendStr(&out, "\r");
+    bufAppendStr(&out, l->prompt);
+    bufAppend(&out, l->buf.data, l->buf.len);
+    bufAppendStr(&out, "\x1b[0K"); /* Clear anything left over from a longer line */
+    if (l->pos < l->buf.len)
+    {
+        snprintf(move, sizeof(move), "\x1b[%zuD", l->buf.len - l->pos);
+        bufAppendStr(&out, move);
+    }
+    termWrite(out.data, out.len);
+    bufFree(&out);
+}
+
+/* Insert n characters at the cursor */
+static void insertText(Line *l, const char *s, size_t n)
+{
+    if (!bufReserve(&l->buf, n))
+        return;
+    memmove(l->buf.data + l->pos + n, l->buf.data + l->pos, l->buf.len - l->pos + 1);
+    memcpy(l->buf.data + l->pos, s, n);
+    l->buf.len += n;
+    l->pos += n;
+}
+
+/* Delete the characters in [from, to) */
+static void deleteText(Line *l, size_t from, size_t to)
+{
+    if (from >= to || to > l->buf.len)
+        return;
+    memmove(l->buf.data + from, l->buf.data + to, l->buf.len - to + 1);
+    l->buf.len -= to - from;
+    if (l->pos > to)
+        l->pos -= to - from;
+    else if (l->pos > from)
+        l->pos = from;
+}
+
+/* Replace the line with s */
+static void setText(Line *l, const char *s, size_t n)
+{
+    l->buf.len = 0;
+    bufAppend(&l->buf, s, n);
+    l->pos = l->buf.len;
+}
+
+/* Show history entry i, or the line being typed if i is past the end */
+static void showHistory(Line *l, size_t i)
+{
+    size_t len;
+    const char *s;
+    size_t total = histIsOpen() ? histCount() : 0;
+    if (i > total)
+        return;
+    if (l->histPos == total && i < total) /* Leaving the line being typed */
+    {
+        free(l->saved);
+        l->saved = strdup(l->buf.data);
+    }
+    l->histPos = i;
+    if (i == total)
+        setText(l, l->saved != NULL ? l->saved : "", l->saved != NULL ? strlen(l->saved) : 0);
+    else if ((s = histGet(i, &len)) != NULL)
+        setText(l, s, len);
+}
+
+static int cmpStrings(const void *a, const void *b)
+{ return strcmp(*(char* const*) a, *(char* const*) b); }
+
+/* Add a copy of s to the list */
+static void addCandidate(char ***list, size_t *n, size_t *max, const char *s)
+{
+    if (*n == *max)
+    {
+        *max = *max == 0 ? 16 : *max * 2;
+        *list = (char**) realloc(*list, *max * sizeof(char*));
+    }
+    (*list)[(*n)++] = strdup(s);
+}
+
+/* Check if the word starting at start is in command position (first word of a command) */
+static bool isCommandWord(const char *line, size_t start)
+{
+    size_t end = start;
+    size_t tok = 0;
+    while (end > 0 && isspace(line[end - 1]))
+        --end;
+    if (end == 0)
+        return true;
+    tok = end;
+    while (tok > 0 && !isspace(line[tok - 1]))
+        --tok;
+    switch (end - tok)
+    {
+    case 1:
+        return line[tok] == '|' || line[tok] == ';' || line[tok] == '{';
+    case 2:
+        return strncmp(line + tok, "&&", 2) == 0 || strncmp(line + tok, "||", 2) == 0;
+    default:
+        return false;
+    }
+}
+
+/* Complete a command name from the builtins and the PATH trie */
+static char** completeCommand(const char *word, size_t *n)
+{
+    unsigned int numB = 0;
+    const Builtin *b = getBuiltins(&numB);
+    size_t len = strlen(word);
+    size_t numP = 0;
+    size_t max = 0;
+    char **list = pathComplete(word, &numP);
+    max = numP;
+    *n = numP;
+    for (unsigned int i = 0; i < numB; ++i)
+    {
+        if (strncmp(b[i].name, word, len) == 0)
+            addCandidate(&list, n, &max, b[i].name);
+    }
+    if (*n == 0)
+        return list;
+    /* Merge the two sources and drop names found in both */
+    qsort(list, *n, sizeof(char*), cmpStrings);
+    size_t k = 1;
+    for (size_t i = 1; i < *n; ++i)
+    {
+        if (strcmp(list[i], list[k - 1]) == 0)
+            free(list[i]);
+        else
+            list[k++] = list[i];
+    }
+    *n = k;
+    return list;
+}
+
+/* Complete a file path. Directories get a trailing / */
+static char** completeFile(const char *word, size_t *n)
+{
+    const char *slash = strrchr(word, '/');
+    char dir[PATH_MAX];
+    char cand[PATH_MAX];
+    const char *base = word;
+    size_t dirLen = 0;
+    size_t baseLen = 0;
+    const char *name = NULL;
+    unsigned char type;
+    char **list = NULL;
+    size_t max = 0;
+    DirScan d;
+    *n = 0;
+    if (slash != NULL)
+    {
+        dirLen = slash - word + 1; /* Keep the / */
+        if (dirLen >= sizeof(dir))
+            return NULL;
+        memcpy(dir, word, dirLen);
+        dir[dirLen] = '\0';
+        base = slash + 1;
+    }
+    else
+        strcpy(dir, ".");
+    baseLen = strlen(base);
+    if (!dirOpen(&d, dir))
+        return NULL;
+    while (dirNext(&d, &name, &type))
+    {
+        if (strncmp(name, base, baseLen) != 0)
+            continue;
+        if (name[0] == '.' && base[0] != '.') /* Hidden unless asked for */
+            continue;
+        if (snprintf(cand, sizeof(cand), "%.*s%s%s", (int) dirLen, word, name, dirIsDir(dir, name, type) ? "/" : "") >= (int) sizeof(cand))
+            continue;
+        addCandidate(&list, n, &max, cand);
+    }
+    dirClose(&d);
+    if (*n > 1)
+        qsort(list, *n, sizeof(char*), cmpStrings);
+    return list;
+}
+
+/*
+  Find the completions for the word ending at pos in line
+  The start of the word is stored in start. Returns a sorted allocated array
+  of allocated strings, each the full replacement for the word
+*/
+char** completeWord(const char *line, size_t pos, size_t *start, size_t *n)
+{
+    char word[PATH_MAX];
+    size_t s = pos;
+    while (s > 0 && !isspace(line[s - 1]))
+        --s;
+    *start = s;
+    *n = 0;
+    if (pos - s >= sizeof(word))
+        return NULL;
+    memcpy(word, line + s, pos - s);
+    word[pos - s] = '\0';
+    if (isCommandWord(line, s) && strchr(word, '/') == NULL)
+        return completeCommand(word, n);
+    return completeFile(word, n);
+}
+
+/* Print the candidates in columns below the line, then redraw it */
+static void listCandidates(Line *l, char **list, size_t n)
+{
+    struct winsize ws;
+    size_t width = EDIT_WIDTH;
+    size_t col = 0;
+    size_t shown = n < EDIT_MAX_LIST ? n : EDIT_MAX_LIST;
+    size_t widest = 0;
+    const char *name;
+    Buffer out;
+    char more[64];
+    if (ioctl(1, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
+        width = ws.ws_col;
+    for (size_t i = 0; i < shown; ++i)
+    {
+        name = strrchr(list[i], '/');
+        name = (name != NULL && name[1] != '\0') ? name + 1 : list[i];
+        if (strlen(name) > widest)
+            widest = strlen(name);
+    }
+    widest += 2;
+    bufInit(&out);
+    bufAppendStr(&out, "\r\n");
+    for (size_t i = 0; i < shown; ++i)
+    {
+        name = strrchr(list[i], '/');
+        name = (name != NULL && name[1] != '\0') ? name + 1 : list[i];
+        if (col + widest > width && col > 0)
+        {
+            bufAppendStr(&out, "\r\n");
+            col = 0;
+        }
+        bufAppendStr(&out, name);
+        for (size_t k = strlen(name); k < widest; ++k)
+            bufAppendChar(&out, ' ');
+        col += widest;
+    }
+    if (shown < n)
+    {
+        snprintf(more, sizeof(more), "\r\n(%zu more)", n - shown);
+        bufAppendStr(&out, more);
+    }
+    bufAppendStr(&out, "\r\n");
+    termWrite(out.data, out.len);
+    bufFree(&out);
+    refresh(l);
+}
+
+/* Handle the tab key */
+static void complete(Line *l)
+{
+    size_t start = 0;
+    size_t n = 0;
+    size_t lcp = 0;
+    size_t wordLen = 0;
+    char **list = completeWord(l->buf.data, l->pos, &start, &n);
+    bool listed = false;
+    wordLen = l->pos - start;
+    if (n == 0)
+        termWrite("\a", 1);
+    else if (n == 1)
+    {
+        deleteText(l, start, l->pos);
+        insertText(l, list[0], strlen(list[0]));
+        if (list[0][strlen(list[0]) - 1] != '/')
+            insertText(l, " ", 1);
+    }
+    else
+    {
+        /* Extend the word by whatever all candidates have in common */
+        lcp = strlen(list[0]);
+        for (size_t i = 1; i < n; ++i)
+        {
+            size_t k = 0;
+            while (k < lcp && list[i][k] == list[0][k])
+                ++k;
+            lcp = k;
+        }
+        if (lcp > wordLen)
+        {
+            deleteText(l, start, l->pos);
+            insertText(l, list[0], lcp);
+        }
+        else if (l->lastTab)
+        {
+            listCandidates(l, list, n);
+            listed = true;
+        }
+        else
+        {
+            termWrite("\a", 1);
+            l->lastTab = true;
+        }
+    }
+    if (listed || n <= 1 || lcp > wordLen)
+        l->lastTab = false;
+    for (size_t i = 0; i < n; ++i)
+        free(list[i]);
+    free(list);
+    refresh(l);
+}
+
+/* Read a line without editing, as when input comes from a file or pipe */
+static char* readPlain(const char *prompt)
+{
+    char *line = NULL;
+    size_t n = 0;
+    ssize_t len;
+    printf("%s", prompt);
+    len = getline(&line, &n, stdin);
+    if (len == -1)
+    {
+        free(line);
+        return NULL;
+    }
+    if (len > 0 && line[len - 1] == '\n')
+        line[len - 1] = '\0';
+    return line;
+}
+
+/* Read one byte from the terminal */
+static int readKey()
+{
+    unsigned char c;
+    ssize_t r;
+    while ((r = read(0, &c, 1)) == -1 && errno == EINTR)
+        ;
+    return r == 1 ? c : -1;
+}
+
+/* Handle the rest of an escape sequence (arrow keys, home, end, delete) */
+static void escape(Line *l)
+{
+    int a = readKey();
+    int b = readKey();
+    if (a != '[' && a != 'O')
+        return;
+    if (b >= '0' && b <= '9') /* ESC [ n ~ */
+    {
+        if (readKey() != '~')
+            return;
+        if (b == '3' && l->pos < l->buf.len)
+            deleteText(l, l->pos, l->pos + 1);
+        else if (b == '1' || b == '7')
+            l->pos = 0;
+        else if (b == '4' || b == '8')
+            l->pos = l->buf.len;
+        return;
+    }
+    switch (b)
+    {
+    case 'A':
+        if (l->histPos > 0)
+            showHistory(l, l->histPos - 1);
+        break;
+    case 'B':
+        showHistory(l, l->histPos + 1);
+        break;
+    case 'C':
+        if (l->pos < l->buf.len)
+            ++l->pos;
+        break;
+    case 'D':
+        if (l->pos > 0)
+            --l->pos;
+        break;
+    case 'H':
+        l->pos = 0;
+        break;
+    case 'F':
+        l->pos = l->buf.len;
+        break;
+    }
+}
+
+/*
+  Read a line, showing prompt first
+  Returns the allocated line without its newline, or NULL at end of input
+*/
+char* editorReadLine(const char *prompt)
+{
+    struct termios orig;
+    struct termios raw;
+    Line l;
+    int c;
+    bool done = false;
+    bool eof = false;
+    size_t k;
+    if (!isatty(0) || tcgetattr(0, &orig) == -1)
+        return readPlain(prompt);
+    raw = orig;
+    raw.c_iflag &= ~(ICRNL | IXON | BRKINT | ISTRIP | INPCK);
+    raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(0, TCSADRAIN, &raw) == -1)
+        return readPlain(prompt);
+    fflush(stdout);
+    bufInit(&l.buf);
+    bufReserve(&l.buf, 0);
+    l.pos = 0;
+    l.prompt = prompt;
+    l.histPos = histIsOpen() ? histCount() : 0;
+    l.saved = NULL;
+    l.lastTab = false;
+    refresh(&l);
+    while (!done)
+    {
+        c = readKey();
+        if (c != '\t')
+            l.lastTab = false;
+        switch (c)
+        {
+        case -1: /* Input closed */
+            eof = true;
+            done = true;
+            break;
+        case '\r':
+        case '\n':
+            done = true;
+            break;
+        case 1: /* Ctrl-A */
+            l.pos = 0;
+            break;
+        case 2: /* Ctrl-B */
+            if (l.pos > 0)
+                --l.pos;
+            break;
+        case 3: /* Ctrl-C abandons the line */
+            termWrite("^C\r\n", 4);
+            setText(&l, "", 0);
+            break;
+        case 4: /* Ctrl-D ends input on an empty line, otherwise deletes */
+            if (l.buf.len == 0)
+            {
+                eof = true;
+                done = true;
+            }
+            else
+                deleteText(&l, l.pos, l.pos + 1);
+            break;
+        case 5: /* Ctrl-E */
+            l.pos = l.buf.len;
+            break;
+        case 6: /* Ctrl-F */
+            if (l.pos < l.buf.len)
+                ++l.pos;
+            break;
+        case 8: /* Backspace */
+        case 127:
+            if (l.pos > 0)
+                deleteText(&l, l.pos - 1, l.pos);
+            break;
+        case '\t':
+            complete(&l);
+            break;
+        case 11: /* Ctrl-K */
+            deleteText(&l, l.pos, l.buf.len);
+            break;
+        case 12: /* Ctrl-L */
+            termWrite("\x1b[H\x1b[2J", 7);
+            break;
+        case 14: /* Ctrl-N */
+            showHistory(&l, l.histPos + 1);
+            break;
+        case 16: /* Ctrl-P */
+            if (l.histPos > 0)
+                showHistory(&l, l.histPos - 1);
+            break;
+        case 21: /* Ctrl-U */
+            deleteText(&l, 0, l.pos);
+            break;
+        case 23: /* Ctrl-W deletes the previous word */
+            k = l.pos;
+            while (k > 0 && isspace(l.buf.data[k - 1]))
+                --k;
+            while (k > 0 && !isspace(l.buf.data[k - 1]))
+                --k;
+            deleteText(&l, k, l.pos);
+            break;
+        case 27:
+            escape(&l);
+            break;
+        default:
+            if (c >= 32)
+            {
+                char ch = (char) c;
+                insertText(&l, &ch, 1);
+            }
+            break;
+        }
+        if (!done)
+            refresh(&l);
+    }
+    termWrite("\r\n", 2);
+    tcsetattr(0, TCSADRAIN, &orig);
+    free(l.saved);
+    if (eof && l.buf.len == 0)
+    {
+        bufFree(&l.buf);
+        return NULL;
+    }
+    return bufRelease(&l.buf);
+}
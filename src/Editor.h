@@ -0,0 +1,16 @@
+/*
+  Line editor for interactive input with history recall and tab completion
+  of command names and file paths
+*/
+#ifndef EDITOR_H
+#define EDITOR_H
+
+#include <stddef.h>
+
+#define EDIT_MAX_LIST 200 /* Most completion candidates listed at once */
+#define EDIT_WIDTH 80 /* Terminal width to assume when it can't be queried */
+
+char* editorReadLine(const char*);
+char** completeWord(const char*, size_t, size_t*, size_t*);
+
+#endif
@@ -0,0 +1,95 @@
+/*
+  Environment array for exec
+
+  env holds owned "KEY=VALUE" strings followed by a NULL so it can be passed to
+  exec as is. Setting a variable replaces its slot or appends a new one
+*/
+#include "Parser.h"
+#include "Env.h"
+
+extern char **environ;
+
+static char **env = NULL;
+static unsigned int numEnv = 0; /* Number of variables, not counting the terminating NULL */
+static unsigned int maxEnv = 0; /* Number of slots allocated, including the terminating NULL */
+
+/* Copy the environment the shell was started with */
+bool envInit()
+{
+    unsigned int n = 0;
+    while (environ[n] != NULL)
+        ++n;
+    maxEnv = INIT_ENV;
+    while (maxEnv < n + 1)
+        maxEnv *= 2;
+    env = (char**) malloc(maxEnv * sizeof(char*));
+    if (env == NULL)
+        return false;
+    for (numEnv = 0; numEnv < n; ++numEnv)
+        env[numEnv] = strdup(environ[numEnv]);
+    env[numEnv] = NULL;
+    return true;
+}
+
+/* Release the environment array */
+void envFree()
+{
+    for (unsigned int i = 0; i < numEnv; ++i)
+        free(env[i]);
+    free(env);
+    env = NULL;
+    numEnv = 0;
+    maxEnv = 0;
+}
+
+/* Find the slot holding key. Returns numEnv if there is none */
+static unsigned int findSlot(const char *key)
+{
+    size_t len = strlen(key);
+    for (unsigned int i = 0; i < numEnv; ++i)
+    {
+        if (strncmp(env[i], key, len) == 0 && env[i][len] == '=')
+            return i;
+    }
+    return numEnv;
+}
+
+/* Set key to val in the environment of future child processes */
+bool envSet(const char *key, const char *val)
+{
+    size_t len = strlen(key) + strlen(val) + 2;
+    unsigned int i = findSlot(key);
+    char *s = (char*) malloc(len);
+    char **grown = NULL;
+    if (s == NULL)
+        return false;
+    snprintf(s, len, "%s=%s", key, val);
+    if (i < numEnv)
+    {
+        free(env[i]);
+        env[i] = s;
+        return true;
+    }
+    if (numEnv + 1 == maxEnv) /* Need to expand the array */
+    {
+        grown = (char**) realloc(env, maxEnv * 2 * sizeof(char*));
+        if (grown == NULL)
+        {
+            free(s);
+            return false;
+        }
+        env = grown;
+        maxEnv *= 2;
+    }
+    env[numEnv++] = s;
+    env[numEnv] = NULL;
+    return true;
+}
+
+/* Check if key is set in the environment */
+bool envHas(const char *key)
+{ return findSlot(key) < numEnv; }
+
+/* Get the NULL terminated environment array to pass to exec */
+char** envGet()
+{ return env; }
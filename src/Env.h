@@ -0,0 +1,21 @@
+/*
+  Environment handed to child processes
+
+  The array starts as a copy of the environment the shell was started with and
+  is patched in place whenever an exported constant changes, so starting a
+  command never has to build it
+*/
+#ifndef ENV_H
+#define ENV_H
+
+#include <stdbool.h>
+
+#define INIT_ENV 64 /* Initial number of environment slots to allocate */
+
+bool envInit();
+void envFree();
+bool envSet(const char*, const char*);
+bool envHas(const char*);
+char** envGet();
+
+#endif
@@ -0,0 +1,322 @@
+/*
+  Pathname expansion
+
+  A segment is compiled to a list of elements: a star or a 256 bit character
+  set (plain characters are one bit sets). Matching a name first compares the
+  literal prefix and suffix of the pattern, which rejects most entries of a
+  large directory with two memcmps, and only then runs the star backtracking
+  over the element list. Directories are read with DirScan and the results are
+  sorted before they are returned
+*/
+#include "Parser.h"
+#include "Glob.h"
+#include "DirScan.h"
+
+/* Check if the argument contains a wildcard */
+bool isGlob(const char *s)
+{ return strpbrk(s, "*?[") != NULL; }
+
+static void setBit(uint8_t *set, unsigned char c)
+{ set[c >> 3] |= 1 << (c & 7); }
+
+static bool hasBit(const uint8_t *set, unsigned char c)
+{ return (set[c >> 3] >> (c & 7)) & 1; }
+
+/*
+  Parse the bracket expression starting at s (just after the '[') into set
+  Returns the length consumed including the closing ']', 0 if it isn't closed
+*/
+static size_t parseClass(const char *s, size_t len, uint8_t *set)
+{
+    size_t i = 0;
+    bool negate = false;
+    if (i < len && (s[i] == '!' || s[i] == '^'))
+    {
+        negate = true;
+        ++i;
+    }
+    memset(set, 0, 32);
+    for (size_t first = i; i < len && (s[i] != ']' || i == first); ++i)
+    {
+        unsigned char lo = s[i];
+        unsigned char hi = lo;
+        if (i + 2 < len && s[i + 1] == '-' && s[i + 2] != ']') /* Range */
+        {
+            hi = s[i + 2];
+            i += 2;
+        }
+        for (unsigned int c = lo; c <= hi; ++c)
+            setBit(set, c);
+    }
+    if (i >= len) /* No closing bracket */
+        return 0;
+    if (negate)
+    {
+        for (unsigned int b = 0; b < 32; ++b)
+            set[b] = ~set[b];
+        set[0] &= ~1; /* Never match the terminator */
+    }
+    return i + 1;
+}
+
+/* Compile the len characters at s into seg */
+static bool compileSeg(const char *s, size_t len, GlobSeg *seg)
+{
+    size_t stars = 0;
+    size_t i = 0;
+    size_t used = 0;
+    GlobElem *e = NULL;
+    memset(seg, 0, sizeof(*seg));
+    seg->text = strndup(s, len);
+    seg->elems = (GlobElem*) malloc((len + 1) * sizeof(GlobElem));
+    if (seg->text == NULL || seg->elems == NULL)
+        return false;
+    seg->literal = true;
+    seg->dotOk = len > 0 && s[0] == '.';
+    while (i < len)
+    {
+        e = &seg->elems[seg->numElems++];
+        e->star = false;
+        e->single = false;
+        if (s[i] == '*')
+        {
+            while (i < len && s[i] == '*') /* Consecutive stars are one star */
+                ++i;
+            e->star = true;
+            seg->literal = false;
+            ++stars;
+            continue;
+        }
+        ++seg->minLen;
+        if (s[i] == '?')
+        {
+            memset(e->set, 0xff, 32);
+            e->set[0] &= ~1;
+            seg->literal = false;
+            ++i;
+            continue;
+        }
+        if (s[i] == '[' && (used = parseClass(s + i + 1, len - i - 1, e->set)) != 0)
+        {
+            seg->literal = false;
+            i += used + 1;
+            continue;
+        }
+        /* Plain character, including a '[' that is never closed */
+        memset(e->set, 0, 32);
+        setBit(e->set, s[i]);
+        e->single = true;
+        e->c = s[i++];
+    }
+    while (seg->prefixLen < seg->numElems && seg->elems[seg->prefixLen].single)
+        ++seg->prefixLen;
+    if (seg->prefixLen < seg->numElems)
+    {
+        while (seg->suffixLen < seg->numElems && seg->elems[seg->numElems - 1 - seg->suffixLen].single)
+            ++seg->suffixLen;
+    }
+    seg->simple = stars <= 1 && seg->prefixLen + seg->suffixLen + stars == seg->numElems;
+    return true;
+}
+
+static void freeSeg(GlobSeg *seg)
+{
+    free(seg->text);
+    free(seg->elems);
+}
+
+/* Check if the entry name matches the compiled segment */
+static bool matchSeg(const GlobSeg *seg, const char *name)
+{
+    size_t n = strlen(name);
+    size_t e = 0;
+    size_t i = 0;
+    size_t starE = SIZE_MAX;
+    size_t starI = 0;
+    if (name[0] == '.' && !seg->dotOk) /* Hidden entries have to be asked for */
+        return false;
+    if (n < seg->minLen)
+        return false;
+    for (size_t k = 0; k < seg->prefixLen; ++k)
+    {
+        if ((unsigned char) name[k] != seg->elems[k].c)
+            return false;
+    }
+    for (size_t k = 0; k < seg->suffixLen; ++k)
+    {
+        if ((unsigned char) name[n - 1 - k] != seg->elems[seg->numElems - 1 - k].c)
+            return false;
+    }
+    if (seg->simple) /* Prefix and suffix fit and a star (if any) takes the rest */
+        return seg->prefixLen == seg->numElems ? n == seg->numElems : true;
+    /* Star backtracking, only ever restarting from the last star */
+    while (i < n)
+    {
+        if (e < seg->numElems && seg->elems[e].star)
+        {
+            starE = e++;
+            starI = i;
+        }
+        else if (e < seg->numElems && hasBit(seg->elems[e].set, (unsigned char) name[i]))
+        {
+            ++e;
+            ++i;
+        }
+        else if (starE != SIZE_MAX)
+        {
+            e = starE + 1;
+            i = ++starI;
+        }
+        else
+            return false;
+    }
+    while (e < seg->numElems && seg->elems[e].star)
+        ++e;
+    return e == seg->numElems;
+}
+
+typedef struct
+{
+    GlobSeg *segs;
+    size_t numSegs;
+    bool dirOnly; /* Pattern ended with '/' */
+    char **list;
+    size_t n;
+    size_t max;
+} GlobState;
+
+static bool addMatch(GlobState *g, const char *path)
+{
+    if (g->n == g->max)
+    {
+        size_t max = g->max == 0 ? 16 : g->max * 2;
+        char **grown = (char**) realloc(g->list, max * sizeof(char*));
+        if (grown == NULL)
+            return false;
+        g->list = grown;
+        g->max = max;
+    }
+    g->list[g->n] = strdup(path);
+    return g->list[g->n++] != NULL;
+}
+
+/*
+  Match segment i and the ones after it below path, which holds len characters
+  and ends with '/' unless it is empty (the working directory)
+*/
+static void expand(GlobState *g, Buffer *path, size_t i)
+{
+    const GlobSeg *seg = &g->segs[i];
+    bool last = i + 1 == g->numSegs;
+    size_t len = path->len;
+    const char *name = NULL;
+    unsigned char type;
+    struct stat st;
+    DirScan d;
+    if (seg->literal) /* Nothing to match, just follow the name */
+    {
+        bufAppendStr(path, seg->text);
+        if (!last)
+        {
+            bufAppendChar(path, '/');
+            expand(g, path, i + 1);
+        }
+        else if ((g->dirOnly ? stat(path->data, &st) == 0 && S_ISDIR(st.st_mode) : lstat(path->data, &st) == 0))
+            addMatch(g, path->data);
+        path->len = len;
+        path->data[len] = '\0';
+        return;
+    }
+    if (!dirOpen(&d, len == 0 ? "." : path->data))
+        return;
+    while (dirNext(&d, &name, &type))
+    {
+        if (!matchSeg(seg, name))
+            continue;
+        /* Only directories can lead to more matches */
+        if ((!last || g->dirOnly) && !dirIsDir(len == 0 ? "." : path->data, name, type))
+            continue;
+        bufAppendStr(path, name);
+        if (!last)
+        {
+            bufAppendChar(path, '/');
+            expand(g, path, i + 1);
+        }
+        else
+            addMatch(g, path->data);
+        path->len = len;
+        path->data[len] = '\0';
+    }
+    dirClose(&d);
+}
+
+static int cmpStrings(const void *a, const void *b)
+{ return strcmp(*(char* const*) a, *(char* const*) b); }
+
+/*
+  Expand the pattern into the sorted list of paths matching it
+  Returns an allocated array of allocated strings and stores its size in n,
+  NULL with n = 0 if nothing matches
+*/
+char** globExpand(const char *pattern, size_t *n)
+{
+    GlobState g;
+    Buffer path;
+    const char *p = pattern;
+    const char *slash = NULL;
+    size_t len = strlen(pattern);
+    *n = 0;
+    memset(&g, 0, sizeof(g));
+    bufInit(&path);
+    if (!bufReserve(&path, 0))
+        return NULL;
+    while (len > 1 && pattern[len - 1] == '/')
+    {
+        g.dirOnly = true;
+        --len;
+    }
+    if (*p == '/') /* Absolute pattern */
+    {
+        while (*p == '/')
+            ++p;
+        bufAppend(&path, pattern, p - pattern);
+    }
+    g.segs = (GlobSeg*) malloc((len + 1) * sizeof(GlobSeg));
+    if (g.segs == NULL)
+    {
+        bufFree(&path);
+        return NULL;
+    }
+    while (p < pattern + len)
+    {
+        slash = memchr(p, '/', pattern + len - p);
+        if (slash == NULL)
+            slash = pattern + len;
+        if (!compileSeg(p, slash - p, &g.segs[g.numSegs++]))
+            break;
+        p = slash + 1;
+    }
+    if (p >= pattern + len && g.numSegs > 0)
+        expand(&g, &path, 0);
+    for (size_t i = 0; i < g.numSegs; ++i)
+        freeSeg(&g.segs[i]);
+    free(g.segs);
+    bufFree(&path);
+    if (g.dirOnly) /* Keep the trailing slash the pattern asked for */
+    {
+        for (size_t i = 0; i < g.n; ++i)
+        {
+            size_t l = strlen(g.list[i]);
+            char *s = (char*) realloc(g.list[i], l + 2);
+            if (s != NULL)
+            {
+                s[l] = '/';
+                s[l + 1] = '\0';
+                g.list[i] = s;
+            }
+        }
+    }
+    qsort(g.list, g.n, sizeof(char*), cmpStrings);
+    *n = g.n;
+    return g.list;
+}
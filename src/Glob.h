@@ -0,0 +1,39 @@
+/*
+  Pathname expansion of *, ? and [...] in command arguments
+
+  Each '/' separated segment of a pattern is compiled once. Segments without
+  wildcards are used as is without reading their directory, and only
+  directories are descended into, so patterns like a/x/b*.log prune early
+*/
+#ifndef GLOB_H
+#define GLOB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct
+{
+    bool star; /* Matches any run of characters, set is unused */
+    bool single; /* Set holds a single plain character, c */
+    unsigned char c;
+    uint8_t set[32]; /* Bitmap of the characters matched at this position */
+} GlobElem;
+
+typedef struct
+{
+    char *text; /* Segment as written */
+    bool literal; /* No wildcards, text names the entry directly */
+    GlobElem *elems;
+    size_t numElems;
+    size_t minLen; /* Number of elements that consume exactly one character */
+    size_t prefixLen; /* Number of leading single character elements */
+    size_t suffixLen; /* Number of trailing single character elements */
+    bool simple; /* At most one star and only single characters, so prefix and suffix decide the match */
+    bool dotOk; /* Pattern starts with '.', so it may match hidden entries */
+} GlobSeg;
+
+bool isGlob(const char*);
+char** globExpand(const char*, size_t*);
+
+#endif
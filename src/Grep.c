@@ -0,0 +1,641 @@
+/*
+  Fixed string and regular expression search for the grep builtin
+*/
+#include "Parser.h"
+#include "Builtins.h"
+#include "Grep.h"
+#include <stdint.h>
+#include <regex.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#define GREP_X86
+#endif
+
+typedef struct
+{
+    const char *needle; /* Fixed string, NULL when re is used */
+    size_t needleLen;
+    regex_t re;
+    bool invert; /* -v */
+    bool count; /* -c */
+    bool number; /* -n */
+    bool list; /* -l */
+    bool names; /* Prefix lines with the file name */
+} GrepOptions;
+
+typedef struct
+{
+    const char *name; /* File name, NULL for the input descriptor */
+    size_t count; /* Selected lines */
+    size_t lineNo; /* Number of the line the search is at */
+    bool failed;
+    bool stop; /* -l found its line, the rest of the input doesn't matter */
+    Buffer out; /* Pending output */
+    int fd; /* Where out is flushed to as it fills up, -1 to keep everything */
+} GrepFile;
+
+typedef struct
+{
+    const GrepOptions *opts;
+    GrepFile *files;
+    unsigned int numFiles;
+    unsigned int next; /* Next file for a worker to take */
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    bool *finished;
+} GrepJob;
+
+typedef const char* (*FindFn)(const char*, size_t, const char*, size_t);
+typedef size_t (*CountFn)(const char*, size_t);
+
+/* First occurrence of needle (k >= 2 bytes) in s[0..n), checking the remaining bytes with memmem */
+static const char* findTail(const char *s, size_t n, const char *needle, size_t k)
+{ return (const char*) memmem(s, n, needle, k); }
+
+/* Number of newlines in s[0..n) */
+static size_t countTail(const char *s, size_t n)
+{
+    size_t c = 0;
+    const char *end = s + n;
+    while ((s = (const char*) memchr(s, '\n', end - s)) != NULL)
+    {
+        ++c;
+        ++s;
+    }
+    return c;
+}
+
+#ifdef GREP_X86
+/*
+  Candidates are the positions whose byte equals the needle's first byte and
+  whose byte k - 1 further equals its last byte. Two compares per block rule
+  out almost every position, the few left are compared in full
+*/
+static const char* findSse2(const char *s, size_t n, const char *needle, size_t k)
+{
+    __m128i first = _mm_set1_epi8(needle[0]);
+    __m128i last = _mm_set1_epi8(needle[k - 1]);
+    size_t i = 0;
+    uint32_t bits;
+    for (; i + k - 1 + 16 <= n; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*) (s + i));
+        __m128i b = _mm_loadu_si128((const __m128i*) (s + i + k - 1));
+        bits = (uint32_t) _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (bits != 0)
+        {
+            size_t j = i + __builtin_ctz(bits);
+            if (memcmp(s + j + 1, needle + 1, k - 2) == 0)
+                return s + j;
+            bits &= bits - 1;
+        }
+    }
+    return findTail(s + i, n - i, needle, k);
+}
+
+static size_t countSse2(const char *s, size_t n)
+{
+    __m128i nl = _mm_set1_epi8('\n');
+    size_t c = 0;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+        c += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (s + i)), nl)));
+    return c + countTail(s + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static const char* findAvx2(const char *s, size_t n, const char *needle, size_t k)
+{
+    __m256i first = _mm256_set1_epi8(needle[0]);
+    __m256i last = _mm256_set1_epi8(needle[k - 1]);
+    size_t i = 0;
+    uint32_t bits;
+    for (; i + k - 1 + 32 <= n; i += 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i*) (s + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*) (s + i + k - 1));
+        bits = (uint32_t) _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        while (bits != 0)
+        {
+            size_t j = i + __builtin_ctz(bits);
+            if (memcmp(s + j + 1, needle + 1, k - 2) == 0)
+                return s + j;
+            bits &= bits - 1;
+        }
+    }
+    return findSse2(s + i, n - i, needle, k);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t countAvx2(const char *s, size_t n)
+{
+    __m256i nl = _mm256_set1_epi8('\n');
+    size_t c = 0;
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+        c += __builtin_popcount((uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (s + i)), nl)));
+    return c + countSse2(s + i, n - i);
+}
+#endif
+
+static FindFn findFn = NULL;
+static CountFn countFn = NULL;
+
+/* Pick the widest implementation the CPU supports, done before any worker starts */
+static void pickImpl()
+{
+    if (findFn != NULL)
+        return;
+#ifdef GREP_X86
+    __builtin_cpu_init();
+    findFn = __builtin_cpu_supports("avx2") ? findAvx2 : findSse2;
+    countFn = __builtin_cpu_supports("avx2") ? countAvx2 : countSse2;
+#else
+    findFn = findTail;
+    countFn = countTail;
+#endif
+}
+
+/*
+  Find the first line of s[0..n) containing the pattern
+  Returns a pointer inside that line, or NULL if no line matches
+*/
+static const char* findMatch(const GrepOptions *o, const char *s, size_t n)
+{
+    if (o->needle != NULL)
+    {
+        if (o->needleLen == 0)
+            return n > 0 ? s : NULL;
+        if (o->needleLen == 1)
+            return (const char*) memchr(s, o->needle[0], n);
+        if (n < o->needleLen)
+            return NULL;
+        return findFn(s, n, o->needle, o->needleLen);
+    }
+    for (const char *end = s + n; s < end;)
+    {
+        const char *nl = (const char*) memchr(s, '\n', end - s);
+        regmatch_t m;
+        m.rm_so = 0;
+        m.rm_eo = (nl == NULL ? end : nl) - s;
+        if (regexec(&o->re, s, 1, &m, REG_STARTEND) == 0)
+            return s;
+        if (nl == NULL)
+            break;
+        s = nl + 1;
+    }
+    return NULL;
+}
+
+/* Write the pending output if it is large enough, or always if force */
+static void flushFile(GrepFile *f, bool force)
+{
+    if (f->fd == -1 || f->out.len == 0 || (!force && f->out.len < GREP_FLUSH))
+        return;
+    if (!writeOut(f->fd, f->out.data, f->out.len))
+        f->failed = true;
+    f->out.len = 0;
+}
+
+/*
+  Mapping being searched by this thread. Touching a page past the end of a
+  file that was truncated (e.g. by log rotation) while it is searched raises
+  SIGBUS, and grep usually runs in the shell process
+*/
+static __thread const char *busMap = NULL;
+static __thread size_t busLen = 0;
+static __thread volatile sig_atomic_t busHit = 0; /* The file was truncated, stop producing lines */
+static long pageSize = 4096;
+
+/*
+  Put zeros where the file used to be and let the search run to the end of
+  the mapping, which is safer than unwinding it (regexec holds a lock).
+  The zeros are never output since every line after busHit is dropped
+*/
+static void onBus(int sig, siginfo_t *info, void *ctx)
+{
+    const char *addr = (const char*) info->si_addr;
+    (void) ctx;
+    if (busMap != NULL && addr >= busMap && addr < busMap + busLen)
+    {
+        char *start = (char*) ((uintptr_t) addr & ~(uintptr_t) (pageSize - 1));
+        if (mmap(start, busMap + busLen - start, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED)
+        {
+            busHit = 1;
+            return;
+        }
+    }
+    signal(sig, SIG_DFL); /* Not ours, fail as if nothing was installed */
+    raise(sig);
+}
+
+/* Output one selected line s[0..len) without its newline */
+static void emitLine(const GrepOptions *o, GrepFile *f, const char *s, size_t len)
+{
+    char num[24];
+    size_t before = f->out.len;
+    if (busHit)
+    {
+        f->stop = true;
+        return;
+    }
+    ++f->count;
+    if (o->list)
+    {
+        f->stop = true;
+        return;
+    }
+    if (o->count)
+        return;
+    if (o->names)
+    {
+        bufAppendStr(&f->out, f->name);
+        bufAppendChar(&f->out, ':');
+    }
+    if (o->number)
+    {
+        snprintf(num, sizeof(num), "%zu:", f->lineNo);
+        bufAppendStr(&f->out, num);
+    }
+    bufAppend(&f->out, s, len);
+    bufAppendChar(&f->out, '\n');
+    if (busHit) /* Part of the line was truncated away, don't pass on the zeros standing in for it */
+    {
+        f->out.len = before;
+        --f->count;
+        f->stop = true;
+        return;
+    }
+    flushFile(f, false);
+}
+
+/* Handle the lines of s[0..n), none of which contain the pattern */
+static void passLines(const GrepOptions *o, GrepFile *f, const char *s, size_t n)
+{
+    size_t lines;
+    size_t before;
+    if (busHit)
+    {
+        f->stop = true;
+        return;
+    }
+    if (n == 0)
+        return;
+    if (!o->invert && !o->number) /* Nothing to do for lines that aren't selected */
+        return;
+    lines = countFn(s, n) + (s[n - 1] != '\n'); /* The last line of the input may lack its newline */
+    if (!o->invert || (o->count && !o->list))
+    {
+        f->lineNo += lines;
+        if (o->invert)
+            f->count += lines;
+        return;
+    }
+    if (o->list || o->number || o->names) /* Every line needs handling of its own */
+    {
+        for (const char *end = s + n; s < end && !f->stop;)
+        {
+            const char *nl = (const char*) memchr(s, '\n', end - s);
+            if (nl == NULL)
+                nl = end;
+            emitLine(o, f, s, nl - s);
+            ++f->lineNo;
+            s = nl + 1;
+        }
+        return;
+    }
+    before = f->out.len; /* Copy the lines as they are */
+    bufAppend(&f->out, s, n);
+    if (s[n - 1] != '\n')
+        bufAppendChar(&f->out, '\n');
+    if (busHit)
+    {
+        f->out.len = before;
+        f->stop = true;
+        return;
+    }
+    f->count += lines;
+    f->lineNo += lines;
+    flushFile(f, false);
+}
+
+/* Search s[0..n), which holds whole lines only */
+static void searchLines(const GrepOptions *o, GrepFile *f, const char *s, size_t n)
+{
+    size_t pos = 0;
+    while (pos < n && !f->stop)
+    {
+        const char *m = findMatch(o, s + pos, n - pos);
+        const char *start;
+        const char *end;
+        if (m == NULL)
+        {
+            passLines(o, f, s + pos, n - pos);
+            return;
+        }
+        start = (const char*) memrchr(s + pos, '\n', m - (s + pos));
+        start = start == NULL ? s + pos : start + 1;
+        end = (const char*) memchr(m, '\n', s + n - m);
+        if (end == NULL)
+            end = s + n;
+        passLines(o, f, s + pos, start - (s + pos));
+        if (f->stop)
+            return;
+        if (o->invert)
+            ++f->lineNo;
+        else
+        {
+            emitLine(o, f, start, end - start);
+            ++f->lineNo;
+        }
+        pos = end - s + 1;
+    }
+}
+
+/* Search everything that can be read from fd */
+static void searchFd(const GrepOptions *o, GrepFile *f, int fd)
+{
+    struct stat st;
+    Buffer in;
+    ssize_t r;
+    size_t done = 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        off_t off = lseek(fd, 0, SEEK_CUR); /* Start where a redirected stdin currently is */
+        char *map;
+        if (off == -1)
+            off = 0;
+        if (off >= st.st_size)
+            return;
+        map = (char*) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            busMap = map;
+            busLen = st.st_size;
+            busHit = 0;
+            searchLines(o, f, map + off, st.st_size - off);
+            if (busHit)
+            {
+                fprintf(stderr, "grep: \'%s\' was truncated while it was searched\n", f->name == NULL ? "(standard input)" : f->name);
+                f->failed = true;
+                busHit = 0;
+            }
+            busMap = NULL;
+            munmap(map, st.st_size);
+            lseek(fd, 0, SEEK_END); /* Consumed like it would have been by reading */
+            return;
+        }
+    }
+    bufInit(&in);
+    while (!f->stop)
+    {
+        if (!bufReserve(&in, GREP_BLOCK))
+        {
+            f->failed = true;
+            break;
+        }
+        r = read(fd, in.data + in.len, in.cap - in.len - 1);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0)
+        {
+            if (r == -1)
+            {
+                fprintf(stderr, "grep: read error\n");
+                f->failed = true;
+            }
+            searchLines(o, f, in.data, in.len); /* Last line without a newline */
+            break;
+        }
+        in.len += r;
+        /* Search the whole lines and keep the partial one for the next read */
+        const char *nl = (const char*) memrchr(in.data + done, '\n', in.len - done);
+        if (nl == NULL)
+        {
+            done = in.len;
+            continue;
+        }
+        searchLines(o, f, in.data, nl - in.data + 1);
+        in.len -= nl - in.data + 1;
+        memmove(in.data, nl + 1, in.len);
+        done = 0;
+    }
+    bufFree(&in);
+}
+
+/* Search one named file */
+static void searchFile(const GrepOptions *o, GrepFile *f)
+{
+    int fd = open(f->name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        fprintf(stderr, "grep: could not open \'%s\'\n", f->name);
+        f->failed = true;
+        return;
+    }
+    searchFd(o, f, fd);
+    close(fd);
+}
+
+/* Search files until there are none left */
+static void* worker(void *arg)
+{
+    GrepJob *job = (GrepJob*) arg;
+    unsigned int i;
+    while (true)
+    {
+        pthread_mutex_lock(&job->lock);
+        i = job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if (i >= job->numFiles)
+            return NULL;
+        searchFile(job->opts, &job->files[i]);
+        pthread_mutex_lock(&job->lock);
+        job->finished[i] = true;
+        pthread_cond_broadcast(&job->done);
+        pthread_mutex_unlock(&job->lock);
+    }
+}
+
+/* Write what the search of f produced besides the lines, then the pending output */
+static bool finishFile(const GrepOptions *o, GrepFile *f, int out)
+{
+    const char *name = f->name == NULL ? "(standard input)" : f->name;
+    f->fd = out;
+    if (o->list && f->count > 0)
+    {
+        bufAppendStr(&f->out, name);
+        bufAppendChar(&f->out, '\n');
+    }
+    else if (o->count && !o->list)
+    {
+        char num[24];
+        if (o->names)
+        {
+            bufAppendStr(&f->out, name);
+            bufAppendChar(&f->out, ':');
+        }
+        snprintf(num, sizeof(num), "%zu\n", f->count);
+        bufAppendStr(&f->out, num);
+    }
+    flushFile(f, true);
+    return !f->failed;
+}
+
+/* Search several files at once, writing the results in the order the files were given */
+static bool searchParallel(const GrepOptions *o, GrepFile *files, unsigned int n, int out)
+{
+    GrepJob job;
+    pthread_t threads[GREP_MAX_THREADS];
+    unsigned int numThreads = 0;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    bool ok = true;
+    job.opts = o;
+    job.files = files;
+    job.numFiles = n;
+    job.next = 0;
+    job.finished = (bool*) calloc(n, sizeof(bool));
+    if (job.finished == NULL)
+        return false;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.done, NULL);
+    while (numThreads < n && numThreads < GREP_MAX_THREADS && (long) numThreads < cpus
+        && pthread_create(&threads[numThreads], NULL, worker, &job) == 0)
+        ++numThreads;
+    if (numThreads == 0) /* Could not start any thread, search here */
+        worker(&job);
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        pthread_mutex_lock(&job.lock);
+        while (!job.finished[i])
+            pthread_cond_wait(&job.done, &job.lock);
+        pthread_mutex_unlock(&job.lock);
+        ok = finishFile(o, &files[i], out) && ok;
+        bufFree(&files[i].out);
+    }
+    for (unsigned int i = 0; i < numThreads; ++i)
+        pthread_join(threads[i], NULL);
+    pthread_cond_destroy(&job.done);
+    pthread_mutex_destroy(&job.lock);
+    free(job.finished);
+    return ok;
+}
+
+/* Set up the search state of one input */
+static void initFile(GrepFile *f, const char *name, int fd)
+{
+    f->name = name;
+    f->count = 0;
+    f->lineNo = 1;
+    f->failed = false;
+    f->stop = false;
+    f->fd = fd;
+    bufInit(&f->out);
+}
+
+/*
+  Run grep with its command line arguments, reading in when no file is given
+  Returns 0 if a line was selected, 1 if none was and 2 on errors
+*/
+int grepRun(int argc, char **argv, int in, int out)
+{
+    GrepOptions o;
+    GrepFile *files = NULL;
+    bool fixed = false;
+    bool ok = true;
+    size_t selected = 0;
+    int i = 1;
+    struct sigaction bus;
+    struct sigaction oldBus;
+    memset(&o, 0, sizeof(o));
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; ++i)
+    {
+        if (strcmp(argv[i], "--") == 0)
+        {
+            ++i;
+            break;
+        }
+        for (const char *c = argv[i] + 1; *c != '\0'; ++c)
+        {
+            if (*c == 'c')
+                o.count = true;
+            else if (*c == 'v')
+                o.invert = true;
+            else if (*c == 'n')
+                o.number = true;
+            else if (*c == 'l')
+                o.list = true;
+            else if (*c == 'F')
+                fixed = true;
+            else
+            {
+                fprintf(stderr, "grep: invalid option \'-%c\'\n", *c);
+                return 2;
+            }
+        }
+    }
+    if (i >= argc)
+    {
+        fprintf(stderr, "grep: usage: grep [-c] [-v] [-n] [-l] [-F] PATTERN [FILE]...\n");
+        return 2;
+    }
+    if (fixed || strpbrk(argv[i], ".[]*^$\\") == NULL)
+    {
+        o.needle = argv[i];
+        o.needleLen = strlen(argv[i]);
+    }
+    else if (regcomp(&o.re, argv[i], REG_NOSUB) != 0)
+    {
+        fprintf(stderr, "grep: invalid regular expression \'%s\'\n", argv[i]);
+        return 2;
+    }
+    ++i;
+    pickImpl();
+    o.names = argc - i > 1;
+    pageSize = sysconf(_SC_PAGESIZE);
+    sigemptyset(&bus.sa_mask);
+    bus.sa_sigaction = onBus;
+    bus.sa_flags = SA_SIGINFO;
+    sigaction(SIGBUS, &bus, &oldBus);
+    if (i == argc) /* Search the input */
+    {
+        GrepFile f;
+        initFile(&f, NULL, out);
+        searchFd(&o, &f, in);
+        ok = finishFile(&o, &f, out);
+        selected = f.count;
+        bufFree(&f.out);
+    }
+    else if (argc - i == 1)
+    {
+        GrepFile f;
+        initFile(&f, argv[i], out);
+        searchFile(&o, &f);
+        ok = finishFile(&o, &f, out);
+        selected = f.count;
+        bufFree(&f.out);
+    }
+    else
+    {
+        files = (GrepFile*) malloc((argc - i) * sizeof(GrepFile));
+        if (files == NULL)
+            ok = false;
+        for (int k = 0; files != NULL && k < argc - i; ++k)
+            initFile(&files[k], argv[i + k], -1); /* Workers keep their output until it is their turn */
+        if (files != NULL)
+            ok = searchParallel(&o, files, argc - i, out);
+        for (int k = 0; files != NULL && k < argc - i; ++k)
+            selected += files[k].count;
+        free(files);
+    }
+    if (o.needle == NULL)
+        regfree(&o.re);
+    sigaction(SIGBUS, &oldBus, NULL);
+    if (!ok)
+        return 2;
+    return selected > 0 ? 0 : 1;
+}
@@ -0,0 +1,28 @@
+/*
+  The grep builtin
+
+  grep [-c] [-v] [-n] [-l] [-F] PATTERN [FILE]...
+  A pattern without any of . [ ] * ^ $ \ (or any pattern with -F) is
+  searched for as a fixed string over the whole input at once: 32 or 16
+  bytes are compared against the first and last byte of the string with
+  AVX2 or SSE2, and only the positions where both match are checked in full.
+  The line around a match is found with memchr/memrchr afterwards, so lines
+  that can't match are never looked at one by one. Other patterns are POSIX
+  basic regular expressions matched a line at a time
+
+  Regular files, including stdin redirected from one, are mmapped. A file
+  truncated while it is searched raises SIGBUS, which is caught so that grep
+  stops on that file with an error instead of taking the shell down. Pipes and terminals
+  are read in GREP_BLOCK sized blocks. With several files each one
+  is searched by its own thread and the results are written in order
+*/
+#ifndef GREP_H
+#define GREP_H
+
+#define GREP_BLOCK (1 << 20) /* Bytes read from a pipe at once */
+#define GREP_FLUSH (1 << 16) /* Output is written once this much is pending */
+#define GREP_MAX_THREADS 16 /* Most files searched at the same time */
+
+int grepRun(int, char**, int, int);
+
+#endif
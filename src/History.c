@@ -0,0 +1,652 @@
+/*
+  Persistent command history backed by an mmapped append-only log
+
+  log: entry\n entry\n ...
+  idx: uint64 offset of entry 0, uint64 offset of entry 1, ...
+
+  Opening the history only maps the two files, so startup cost is the same for
+  ten entries or ten million. Searching uses two indexes built on first use
+  and extended incrementally as entries are appended:
+    - a list of entry numbers sorted by text for prefix searches
+    - a trigram filter for every HIST_BLOCK entries so substring searches only
+      scan the blocks that can possibly contain the text
+  Appends are serialized with flock so several shells can share the history.
+  The files are never truncated in place: clearing and compaction write new
+  files and rename them over the old ones, so a mapping another shell is
+  reading never shrinks under it
+*/
+#include "Parser.h"
+#include "History.h"
+#include "Redir.h"
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+
+static char *logPath = NULL; /* Path to the log */
+static char *idxPath = NULL; /* Path to the offset index */
+static int logFd = -1;
+static int idxFd = -1;
+static char *logMap = NULL; /* Mapping of the log */
+static size_t logLen = 0; /* Size of the log mapping */
+static uint64_t *idxMap = NULL; /* Mapping of the offset index */
+static size_t idxLen = 0; /* Size of the index mapping in bytes */
+static size_t count = 0; /* Number of complete entries */
+static uint32_t *sorted = NULL; /* Entry numbers sorted by text */
+static size_t numSorted = 0; /* Number of entries covered by sorted */
+static uint64_t (*blooms)[HIST_BLOOM_WORDS] = NULL; /* Trigram filter of every complete block */
+static size_t numBlooms = 0; /* Number of blocks with a filter */
+static size_t maxBlooms = 0; /* Number of filters allocated */
+
+/* Drop the lazily built search indexes */
+static void resetIndexes()
+{
+    free(sorted);
+    sorted = NULL;
+    numSorted = 0;
+    free(blooms);
+    blooms = NULL;
+    numBlooms = 0;
+    maxBlooms = 0;
+}
+
+/* Unmap both files */
+static void unmapFiles()
+{
+    if (logMap != NULL)
+        munmap(logMap, logLen);
+    if (idxMap != NULL)
+        munmap(idxMap, idxLen);
+    logMap = NULL;
+    idxMap = NULL;
+    logLen = 0;
+    idxLen = 0;
+}
+
+/*
+  Open (creating if needed) the log and index files
+  The log is held with a shared lock while the index is opened. Compaction
+  renames the new index into place before the new log while holding an
+  exclusive lock on the old log, so the pair opened is always from the same
+  generation: a new log means the new index is already there, and an old log
+  can only be locked once compaction is over, when it is seen to be replaced
+*/
+static bool openFiles()
+{
+    struct stat opened;
+    struct stat onDisk;
+    while (true)
+    {
+        logFd = redirHigh(open(logPath, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600));
+        if (logFd == -1)
+            return false;
+        if (flock(logFd, LOCK_SH) == -1 || fstat(logFd, &opened) == -1 || stat(logPath, &onDisk) == -1
+            || (opened.st_ino == onDisk.st_ino && opened.st_dev == onDisk.st_dev))
+            break; /* Without locks or stat there is nothing better to do than use it */
+        close(logFd); /* Replaced while we waited for the lock */
+    }
+    idxFd = redirHigh(open(idxPath, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600));
+    flock(logFd, LOCK_UN);
+    if (idxFd == -1)
+    {
+        close(logFd);
+        logFd = -1;
+        return false;
+    }
+    return true;
+}
+
+/* Close the files after another shell replaced them (i.e. compacted the history) */
+static void closeFiles()
+{
+    unmapFiles();
+    if (logFd != -1)
+        close(logFd);
+    if (idxFd != -1)
+        close(idxFd);
+    logFd = -1;
+    idxFd = -1;
+    count = 0;
+    resetIndexes();
+}
+
+/* Reopen the files if the log on disk is no longer the one we have open */
+static bool checkReplaced()
+{
+    struct stat onDisk;
+    struct stat ours;
+    if (stat(logPath, &onDisk) == 0 && fstat(logFd, &ours) == 0 && onDisk.st_ino == ours.st_ino && onDisk.st_dev == ours.st_dev)
+        return true;
+    closeFiles();
+    return openFiles();
+}
+
+/*
+  Build the offset index by scanning the log
+  Only needed once for a log without an index (e.g. one written by hand)
+*/
+static bool rebuildIndex(size_t size)
+{
+    char *map = (char*) mmap(NULL, size, PROT_READ, MAP_SHARED, logFd, 0);
+    uint64_t offs[BUFF_MAX];
+    size_t n = 0;
+    uint64_t start = 0;
+    char *nl = NULL;
+    if (map == MAP_FAILED)
+        return false;
+    if (ftruncate(idxFd, 0) == -1)
+    {
+        munmap(map, size);
+        return false;
+    }
+    while (start < size && (nl = memchr(map + start, '\n', size - start)) != NULL)
+    {
+        offs[n++] = start;
+        if (n == BUFF_MAX)
+        {
+            if (write(idxFd, offs, sizeof(offs)) != sizeof(offs))
+                break;
+            n = 0;
+        }
+        start = nl - map + 1;
+    }
+    if (n > 0 && write(idxFd, offs, n * sizeof(uint64_t)) == -1)
+        fprintf(stderr, "history: failed to write index\n");
+    munmap(map, size);
+    return true;
+}
+
+/* Bring the mappings up to date with anything appended since they were made */
+static bool remap()
+{
+    struct stat ls;
+    struct stat is;
+    if (logFd == -1)
+        return false;
+    if (fstat(logFd, &ls) == -1 || fstat(idxFd, &is) == -1)
+        return false;
+    if (is.st_size == 0 && ls.st_size > 0) /* Log without index */
+    {
+        rebuildIndex(ls.st_size);
+        if (fstat(idxFd, &is) == -1)
+            return false;
+    }
+    if ((size_t) ls.st_size != logLen || (size_t) is.st_size != idxLen)
+    {
+        unmapFiles();
+        if (ls.st_size > 0)
+        {
+            logMap = (char*) mmap(NULL, ls.st_size, PROT_READ, MAP_SHARED, logFd, 0);
+            if (logMap == MAP_FAILED)
+            {
+                logMap = NULL;
+                return false;
+            }
+            logLen = ls.st_size;
+        }
+        if (is.st_size >= (off_t) sizeof(uint64_t))
+        {
+            idxMap = (uint64_t*) mmap(NULL, is.st_size, PROT_READ, MAP_SHARED, idxFd, 0);
+            if (idxMap == MAP_FAILED)
+            {
+                idxMap = NULL;
+                unmapFiles();
+                return false;
+            }
+            idxLen = is.st_size;
+        }
+    }
+    size_t n = idxLen / sizeof(uint64_t);
+    while (n > 0 && idxMap[n - 1] >= logLen) /* Ignore an entry whose text never made it to the log */
+        --n;
+    if (n < count || n < numSorted) /* History was cleared or rewritten under us */
+        resetIndexes();
+    count = n;
+    return true;
+}
+
+/* Pick up another shell's clear or compaction, then anything appended since the last look */
+static bool refresh()
+{ return logFd != -1 && checkReplaced() && remap(); }
+
+/*
+  Open the history stored at path
+  If path is NULL the HISTFILE environment variable is used, falling back to
+  HIST_NAME in the home directory
+*/
+bool histOpen(const char *path)
+{
+    const char *home = NULL;
+    size_t len = 0;
+    if (logFd != -1)
+        histClose();
+    if (path == NULL)
+        path = getenv("HISTFILE");
+    if (path == NULL || strlen(path) == 0)
+    {
+        home = getenv("HOME");
+        if (home == NULL)
+            return false;
+        len = strlen(home) + strlen(HIST_NAME) + 2;
+        logPath = (char*) malloc(len);
+        snprintf(logPath, len, "%s/%s", home, HIST_NAME);
+    }
+    else
+        logPath = strdup(path);
+    len = strlen(logPath) + strlen(HIST_IDX_SUFFIX) + 1;
+    idxPath = (char*) malloc(len);
+    snprintf(idxPath, len, "%s%s", logPath, HIST_IDX_SUFFIX);
+    if (!openFiles() || !remap())
+    {
+        fprintf(stderr, "history: could not open \'%s\'\n", logPath);
+        histClose();
+        return false;
+    }
+    return true;
+}
+
+/* Close the history and release everything held for it */
+void histClose()
+{
+    closeFiles();
+    free(logPath);
+    free(idxPath);
+    logPath = NULL;
+    idxPath = NULL;
+}
+
+/* Check if a history file is open */
+bool histIsOpen()
+{ return logFd != -1; }
+
+/* Number of entries in the history */
+size_t histCount()
+{
+    refresh();
+    return count;
+}
+
+/*
+  Get entry i. The returned text is not null terminated; its length is stored
+  in len. Returns NULL if there is no such entry
+*/
+const char* histGet(size_t i, size_t *len)
+{
+    if (i >= count)
+        return NULL;
+    uint64_t start = idxMap[i];
+    uint64_t end = (i + 1 < count) ? idxMap[i + 1] : logLen;
+    if (end <= start || end > logLen) /* Damaged index */
+    {
+        *len = 0;
+        return "";
+    }
+    *len = end - start - 1; /* Don't include the newline */
+    return logMap + start;
+}
+
+/* Maximum number of entries to keep, from HISTSIZE */
+static size_t histMax()
+{
+    char *val = getConst("HISTSIZE");
+    long long n = 0;
+    if (strlen(val) > 0)
+        n = atoll(val);
+    if (n <= 0)
+        return HIST_DEFAULT_MAX;
+    return n;
+}
+
+/* Append an entry to the history */
+bool histAdd(const char *line)
+{
+    struct iovec iov[2];
+    struct stat st;
+    uint64_t off;
+    bool ok = false;
+    size_t max;
+    if (logFd == -1 || strchr(line, '\n') != NULL)
+        return false;
+    if (!checkReplaced())
+        return false;
+    if (flock(logFd, LOCK_EX) == -1)
+        return false;
+    if (fstat(logFd, &st) == 0)
+    {
+        off = st.st_size;
+        iov[0].iov_base = (void*) line;
+        iov[0].iov_len = strlen(line);
+        iov[1].iov_base = "\n";
+        iov[1].iov_len = 1;
+        if (writev(logFd, iov, 2) == (ssize_t) (iov[0].iov_len + 1))
+            ok = write(idxFd, &off, sizeof(off)) == sizeof(off);
+    }
+    flock(logFd, LOCK_UN);
+    if (!ok)
+        return false;
+    if (fstat(idxFd, &st) == 0)
+    {
+        max = histMax();
+        /* Compact with some slack so the rewrite is amortized over many appends */
+        if ((size_t) st.st_size / sizeof(uint64_t) > max + max / 8)
+            histCompact(max);
+    }
+    return true;
+}
+
+/* Remove every entry */
+bool histClear()
+{ return histCompact(0); }
+
+/* Write n bytes, retrying short writes */
+static bool writeAll(int fd, const void *data, size_t n)
+{
+    const char *p = (const char*) data;
+    ssize_t w;
+    while (n > 0)
+    {
+        w = write(fd, p, n);
+        if (w == -1 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return false;
+        p += w;
+        n -= w;
+    }
+    return true;
+}
+
+/*
+  Rewrite the history keeping only the newest keep entries
+  New files are written next to the old ones and renamed over them, so other
+  shells either see the old history or the new one
+*/
+bool histCompact(size_t keep)
+{
+    char *tmpLog = NULL;
+    char *tmpIdx = NULL;
+    int tl = -1;
+    int ti = -1;
+    uint64_t offs[BUFF_MAX];
+    uint64_t base;
+    size_t first;
+    size_t n = 0;
+    bool ok = false;
+    if (logFd == -1 || !checkReplaced())
+        return false;
+    if (flock(logFd, LOCK_EX) == -1)
+        return false;
+    if (!remap() || count <= keep)
+    {
+        flock(logFd, LOCK_UN);
+        return count <= keep;
+    }
+    first = count - keep;
+    base = first < count ? idxMap[first] : logLen;
+    tmpLog = (char*) malloc(strlen(logPath) + 8);
+    tmpIdx = (char*) malloc(strlen(idxPath) + 8);
+    sprintf(tmpLog, "%s.tmp", logPath);
+    sprintf(tmpIdx, "%s.tmp", idxPath);
+    tl = open(tmpLog, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    ti = open(tmpIdx, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (tl != -1 && ti != -1 && writeAll(tl, logMap + base, logLen - base))
+    {
+        ok = true;
+        for (size_t i = first; ok && i < count; ++i)
+        {
+            offs[n++] = idxMap[i] - base;
+            if (n == BUFF_MAX || i + 1 == count)
+            {
+                ok = writeAll(ti, offs, n * sizeof(uint64_t));
+                n = 0;
+            }
+        }
+    }
+    if (tl != -1)
+        close(tl);
+    if (ti != -1)
+        close(ti);
+    /*
+      Replace the index first and the log last. Readers pair the two in
+      openFiles under a shared lock on the log, which our exclusive lock on
+      the old log holds off, and only reopen once the log itself changes
+    */
+    if (ok)
+        ok = rename(tmpIdx, idxPath) == 0 && rename(tmpLog, logPath) == 0;
+    if (!ok)
+    {
+        unlink(tmpLog);
+        unlink(tmpIdx);
+        fprintf(stderr, "history: failed to compact \'%s\'\n", logPath);
+    }
+    flock(logFd, LOCK_UN);
+    free(tmpLog);
+    free(tmpIdx);
+    closeFiles();
+    return openFiles() && remap() && ok;
+}
+
+/* Compare the text of entries a and b */
+static int cmpText(size_t a, size_t b)
+{
+    size_t la;
+    size_t lb;
+    const char *sa = histGet(a, &la);
+    const char *sb = histGet(b, &lb);
+    int r = memcmp(sa, sb, la < lb ? la : lb);
+    if (r != 0)
+        return r;
+    if (la != lb)
+        return la < lb ? -1 : 1;
+    return a < b ? -1 : (a > b); /* Equal text keeps history order */
+}
+
+static int cmpSorted(const void *a, const void *b)
+{ return cmpText(*(const uint32_t*) a, *(const uint32_t*) b); }
+
+static int cmpIds(const void *a, const void *b)
+{
+    size_t x = *(const size_t*) a;
+    size_t y = *(const size_t*) b;
+    return x < y ? -1 : (x > y);
+}
+
+/* Extend the sorted list with the entries appended since it was last built */
+static bool updateSorted()
+{
+    size_t n = count - numSorted;
+    uint32_t *tail = NULL;
+    uint32_t *merged = NULL;
+    size_t i = 0;
+    size_t j = 0;
+    size_t k = 0;
+    if (n == 0)
+        return true;
+    tail = (uint32_t*) malloc(n * sizeof(uint32_t));
+    merged = (uint32_t*) malloc(count * sizeof(uint32_t));
+    if (tail == NULL || merged == NULL)
+    {
+        free(tail);
+        free(merged);
+        return false;
+    }
+    for (i = 0; i < n; ++i)
+        tail[i] = numSorted + i;
+    qsort(tail, n, sizeof(uint32_t), cmpSorted);
+    /* Merge the new run into the existing one */
+    i = 0;
+    while (i < numSorted && j < n)
+        merged[k++] = cmpText(sorted[i], tail[j]) <= 0 ? sorted[i++] : tail[j++];
+    while (i < numSorted)
+        merged[k++] = sorted[i++];
+    while (j < n)
+        merged[k++] = tail[j++];
+    free(tail);
+    free(sorted);
+    sorted = merged;
+    numSorted = count;
+    return true;
+}
+
+/* Compare entry id against prefix, treating entries that start with prefix as equal */
+static int cmpPrefix(size_t id, const char *prefix, size_t plen)
+{
+    size_t len;
+    const char *s = histGet(id, &len);
+    int r = memcmp(s, prefix, len < plen ? len : plen);
+    if (r != 0)
+        return r;
+    return len < plen ? -1 : 0;
+}
+
+/*
+  Find every entry starting with prefix
+  Returns an allocated array of entry numbers in history order and stores its size in n
+*/
+size_t* histSearchPrefix(const char *prefix, size_t *n)
+{
+    size_t plen = strlen(prefix);
+    size_t lo = 0;
+    size_t hi = 0;
+    size_t end = 0;
+    size_t *ids = NULL;
+    *n = 0;
+    if (!refresh() || !updateSorted())
+        return NULL;
+    /* Binary search for the first entry not less than prefix */
+    hi = numSorted;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (cmpPrefix(sorted[mid], prefix, plen) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    end = lo;
+    while (end < numSorted && cmpPrefix(sorted[end], prefix, plen) == 0)
+        ++end;
+    ids = (size_t*) malloc((end - lo + 1) * sizeof(size_t));
+    if (ids == NULL)
+        return NULL;
+    for (size_t i = lo; i < end; ++i)
+        ids[(*n)++] = sorted[i];
+    qsort(ids, *n, sizeof(size_t), cmpIds);
+    return ids;
+}
+
+/* Hash three characters to a bit in a trigram filter */
+static unsigned int trigramBit(const char *s)
+{
+    uint32_t t = (unsigned char) s[0] | ((unsigned char) s[1] << 8) | ((unsigned char) s[2] << 16);
+    return (t * 2654435761u) >> (32 - 12); /* 12 bits = HIST_BLOOM_WORDS * 64 */
+}
+
+/* Add every trigram of s to the filter */
+static void addTrigrams(uint64_t *bloom, const char *s, size_t len)
+{
+    unsigned int bit;
+    for (size_t i = 0; i + 3 <= len; ++i)
+    {
+        bit = trigramBit(s + i);
+        bloom[bit >> 6] |= (uint64_t) 1 << (bit & 63);
+    }
+}
+
+/* Compute the trigram filter of the entries in [first, last) */
+static void buildBloom(uint64_t *bloom, size_t first, size_t last)
+{
+    size_t len;
+    const char *s;
+    memset(bloom, 0, HIST_BLOOM_WORDS * sizeof(uint64_t));
+    for (size_t i = first; i < last; ++i)
+    {
+        s = histGet(i, &len);
+        addTrigrams(bloom, s, len);
+    }
+}
+
+/* Build filters for the complete blocks appended since the last search */
+static bool updateBlooms()
+{
+    size_t full = count / HIST_BLOCK;
+    if (full > maxBlooms)
+    {
+        size_t max = maxBlooms == 0 ? 64 : maxBlooms;
+        while (max < full)
+            max *= 2;
+        uint64_t (*b)[HIST_BLOOM_WORDS] = realloc(blooms, max * sizeof(*blooms));
+        if (b == NULL)
+            return false;
+        blooms = b;
+        maxBlooms = max;
+    }
+    for (; numBlooms < full; ++numBlooms)
+        buildBloom(blooms[numBlooms], numBlooms * HIST_BLOCK, (numBlooms + 1) * HIST_BLOCK);
+    return true;
+}
+
+/* Check if every bit of query is set in bloom */
+static bool bloomMatch(const uint64_t *bloom, const uint64_t *query)
+{
+    for (int w = 0; w < HIST_BLOOM_WORDS; ++w)
+    {
+        if ((bloom[w] & query[w]) != query[w])
+            return false;
+    }
+    return true;
+}
+
+/*
+  Find every entry containing text
+  Returns an allocated array of entry numbers in history order and stores its size in n
+*/
+size_t* histSearchSubstr(const char *text, size_t *n)
+{
+    size_t tlen = strlen(text);
+    uint64_t query[HIST_BLOOM_WORDS];
+    uint64_t partial[HIST_BLOOM_WORDS];
+    const uint64_t *bloom = NULL;
+    size_t cap = 64;
+    size_t *ids = NULL;
+    size_t len;
+    const char *s;
+    *n = 0;
+    if (!refresh() || !updateBlooms())
+        return NULL;
+    memset(query, 0, sizeof(query));
+    addTrigrams(query, text, tlen); /* Text shorter than a trigram matches every filter */
+    ids = (size_t*) malloc(cap * sizeof(size_t));
+    if (ids == NULL)
+        return NULL;
+    for (size_t b = 0; b * HIST_BLOCK < count; ++b)
+    {
+        size_t first = b * HIST_BLOCK;
+        size_t last = first + HIST_BLOCK < count ? first + HIST_BLOCK : count;
+        if (b < numBlooms)
+            bloom = blooms[b];
+        else /* Trailing partial block has no stored filter */
+        {
+            buildBloom(partial, first, last);
+            bloom = partial;
+        }
+        if (!bloomMatch(bloom, query))
+            continue;
+        for (size_t i = first; i < last; ++i)
+        {
+            s = histGet(i, &len);
+            if (memmem(s, len, text, tlen) == NULL)
+                continue;
+            if (*n == cap)
+            {
+                size_t *grown = (size_t*) realloc(ids, 2 * cap * sizeof(size_t));
+                if (grown == NULL)
+                    return ids;
+                ids = grown;
+                cap *= 2;
+            }
+            ids[(*n)++] = i;
+        }
+    }
+    return ids;
+}
@@ -0,0 +1,32 @@
+/*
+  Persistent command history
+
+  The history is an append-only log of newline terminated entries plus an
+  index file holding the 64-bit offset of every entry. Both are mmapped on
+  open so startup does not depend on the number of entries. Prefix and
+  substring indexes are built lazily the first time they are needed
+*/
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define HIST_NAME ".soyshell_history" /* History file name in $HOME when HISTFILE is not set */
+#define HIST_IDX_SUFFIX ".idx" /* Suffix of the offset index next to the log */
+#define HIST_DEFAULT_MAX 1000000 /* Default cap on the number of entries (see HISTSIZE) */
+#define HIST_BLOCK 64 /* Number of entries summarized by one substring filter */
+#define HIST_BLOOM_WORDS 64 /* Size of a substring filter in 64-bit words */
+
+bool histOpen(const char*);
+void histClose();
+bool histIsOpen();
+bool histAdd(const char*);
+size_t histCount();
+const char* histGet(size_t, size_t*);
+size_t* histSearchPrefix(const char*, size_t*);
+size_t* histSearchSubstr(const char*, size_t*);
+bool histClear();
+bool histCompact(size_t);
+
+#endif
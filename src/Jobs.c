@@ -0,0 +1,745 @@
+/*
+  Job table driven by pidfds and epoll
+
+  Every process of a job gets a pidfd registered with epoll, tagged with the
+  job's slot and the process's index so an exit is matched to its job in
+  constant time and reaped with waitid(P_PIDFD). Exits are never learned from
+  SIGCHLD; the signalfd only tells us when a process stopped or continued.
+  Job ids are slot numbers + 1, and free slots are reused through a free list
+
+  With job control (interactive sessions on a terminal) every job runs in its
+  own process group and foreground jobs are handed the terminal, so ^C and ^Z
+  reach the job instead of the shell
+
+  A job with a deadline also runs in its own process group, without job
+  control too, so the signal reaches every stage of a pipeline and whatever
+  they started. Its timerfd is tagged with the job's slot and TIMER_INDEX in
+  place of a process index. When it fires the job gets its signal and the
+  timer is rearmed for the grace period, after which the group gets SIGKILL
+*/
+#include "Parser.h"
+#include "Jobs.h"
+#include "Builtins.h"
+#include "Redir.h"
+#include <signal.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+
+#ifndef P_PIDFD
+#define P_PIDFD 3 /* Older headers don't have it yet */
+#endif
+#define SIGNAL_EVENT UINT64_MAX /* epoll tag of the signalfd */
+#define NO_SLOT UINT32_MAX
+#define TIMER_INDEX UINT32_MAX /* Process index in the epoll tag of a job's timerfd */
+
+static Job *jobs = NULL;
+static unsigned int numSlots = 0; /* Slots handed out so far, used or free */
+static unsigned int maxSlots = 0;
+static unsigned int freeList = NO_SLOT;
+static unsigned int *doneQueue = NULL; /* Slots of background jobs that finished since the last poll */
+static unsigned int numDone = 0;
+static unsigned int maxDone = 0;
+static int current = 0; /* Job fg and bg act on when no id is given, 0 if unknown */
+static int epfd = -1;
+static int sigfd = -1;
+static sigset_t oldMask; /* Signal mask before SIGCHLD was blocked for the signalfd */
+static bool masked = false;
+static struct rlimit oldLimit; /* Descriptor limit before it was raised to make room for pidfds */
+static bool raised = false;
+static unsigned int numPolled = 0; /* Running processes without a pidfd, which have to be polled */
+static bool control = false; /* Job control is on */
+static bool interactive = false; /* Report finished background jobs at the prompt */
+static pid_t shellPgid = 0;
+static pid_t leader = 0; /* Process group of the job being started */
+static bool groupFg = true; /* The job being started runs in the foreground */
+static Deadline pending = { 0, 0, 0 }; /* Deadline of the job being started */
+
+/*
+  Set the shell up for running jobs. Job control is only turned on for an
+  interactive shell reading from a terminal
+*/
+void jobsInit(bool isInteractive)
+{
+    interactive = isInteractive;
+    if (!isInteractive || !isatty(0))
+        return;
+    shellPgid = getpgrp();
+    while (tcgetpgrp(0) != shellPgid) /* Wait until we are in the foreground */
+    {
+        if (tcgetpgrp(0) == -1)
+            return;
+        kill(-shellPgid, SIGTTIN);
+        shellPgid = getpgrp();
+    }
+    /* The terminal belongs to whichever job runs in the foreground, so the shell must not be stopped by it */
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    if (setpgid(0, 0) == 0)
+        shellPgid = getpid();
+    tcsetpgrp(0, shellPgid);
+    control = true;
+}
+
+/* Create the epoll instance and the SIGCHLD signalfd on first use */
+static bool ensureLoop()
+{
+    sigset_t set;
+    struct epoll_event ev;
+    struct rlimit lim;
+    if (epfd != -1)
+        return true;
+    epfd = redirHigh(epoll_create1(EPOLL_CLOEXEC));
+    if (epfd == -1)
+        return false;
+    /* Every running process holds a pidfd, so allow as many descriptors as we are permitted */
+    if (getrlimit(RLIMIT_NOFILE, &oldLimit) == 0 && oldLimit.rlim_cur < oldLimit.rlim_max)
+    {
+        lim = oldLimit;
+        lim.rlim_cur = lim.rlim_max;
+        raised = setrlimit(RLIMIT_NOFILE, &lim) == 0;
+    }
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &set, &oldMask) == 0) /* signalfd only sees blocked signals */
+    {
+        masked = true;
+        sigfd = redirHigh(signalfd(-1, &set, SFD_CLOEXEC | SFD_NONBLOCK));
+    }
+    if (sigfd != -1)
+    {
+        ev.events = EPOLLIN;
+        ev.data.u64 = SIGNAL_EVENT;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev);
+    }
+    return true;
+}
+
+/*
+  Forget the job table and restore the signal state the shell started with
+  Used by subshells: the jobs belong to the parent, and sharing its epoll
+  instance would steal the parent's events. The table's memory is left to the
+  parent's copy
+*/
+void jobsReset()
+{
+    if (epfd != -1)
+        close(epfd);
+    if (sigfd != -1)
+        close(sigfd);
+    epfd = -1;
+    sigfd = -1;
+    if (masked)
+        sigprocmask(SIG_SETMASK, &oldMask, NULL);
+    if (raised)
+        setrlimit(RLIMIT_NOFILE, &oldLimit);
+    masked = false;
+    raised = false;
+    numPolled = 0;
+    if (control)
+    {
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+    }
+    control = false;
+    interactive = false;
+    jobs = NULL;
+    numSlots = maxSlots = 0;
+    freeList = NO_SLOT;
+    doneQueue = NULL;
+    numDone = maxDone = 0;
+    current = 0;
+    pending.ns = 0;
+}
+
+/* Start a new job, the next process forked becomes its process group leader */
+void jobsNewGroup(bool fg)
+{
+    leader = 0;
+    groupFg = fg;
+    pending.ns = 0;
+}
+
+/*
+  Give the job being started a deadline, counted from when it is added. Must
+  be called before its first process is forked so the job gets a process
+  group of its own. A deadline of 0 ns leaves the job without one
+*/
+void jobsSetDeadline(const Deadline *d)
+{ pending = *d; }
+
+/* Put a process just forked for the current job in its process group (parent side) */
+void jobsForked(pid_t child)
+{
+    if (!control && pending.ns == 0)
+        return;
+    if (leader == 0)
+        leader = child;
+    setpgid(child, leader);
+}
+
+/*
+  Prepare a process forked for the job being started: join its process group
+  (taking the terminal if it runs in the foreground) and drop the shell's job
+  state
+*/
+void jobsChild()
+{
+    pid_t pgid = leader == 0 ? getpid() : leader;
+    if (control || pending.ns > 0)
+        setpgid(0, pgid);
+    if (control && groupFg)
+        tcsetpgrp(0, pgid);
+    jobsReset();
+}
+
+/* Get the job with the given id, NULL if there is none */
+static Job* getJob(int id)
+{
+    if (id < 1 || (unsigned int) id > numSlots || !jobs[id - 1].used)
+        return NULL;
+    return &jobs[id - 1];
+}
+
+/* Stop watching the deadline of a job */
+static void stopTimer(Job *j)
+{
+    if (j->timer == -1)
+        return;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, j->timer, NULL);
+    close(j->timer);
+    j->timer = -1;
+}
+
+/* Send sig to every process of the job, through its process group if it has one */
+static void signalJob(const Job *j, int sig)
+{
+    if (j->pgid != 0)
+    {
+        kill(-j->pgid, sig);
+        return;
+    }
+    for (unsigned int i = 0; i < j->numProcs; ++i)
+    {
+        if (!j->procs[i].done)
+            kill(j->procs[i].pid, sig);
+    }
+}
+
+/* Release the slot of a job */
+static void removeJob(unsigned int slot)
+{
+    Job *j = &jobs[slot];
+    stopTimer(j);
+    for (unsigned int i = 0; i < j->numProcs; ++i)
+    {
+        if (j->procs[i].fd != -1)
+        {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, j->procs[i].fd, NULL);
+            close(j->procs[i].fd);
+        }
+    }
+    free(j->procs);
+    free(j->cmd);
+    j->procs = NULL;
+    j->cmd = NULL;
+    j->used = false;
+    j->nextFree = freeList;
+    freeList = slot;
+    if (current == (int) slot + 1)
+        current = 0;
+}
+
+/* Exit status of a process from its waitid info */
+static int exitStatus(const siginfo_t *info)
+{ return info->si_code == CLD_EXITED ? info->si_status : 128 + info->si_status; }
+
+/* Record that process i of the job in slot exited with status */
+static void procDone(unsigned int slot, unsigned int i, int status)
+{
+    Job *j = &jobs[slot];
+    JobProc *p = &j->procs[i];
+    if (p->done)
+        return;
+    p->done = true;
+    p->status = status;
+    if (p->fd != -1)
+    {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, p->fd, NULL);
+        close(p->fd);
+        p->fd = -1;
+    }
+    else
+        --numPolled;
+    if (--j->running > 0)
+        return;
+    j->state = JOB_DONE;
+    stopTimer(j);
+    if (j->bg) /* Report it at the next prompt */
+    {
+        if (numDone == maxDone)
+        {
+            maxDone = maxDone == 0 ? INIT_JOBS : maxDone * 2;
+            doneQueue = (unsigned int*) realloc(doneQueue, maxDone * sizeof(unsigned int));
+        }
+        doneQueue[numDone++] = slot;
+    }
+}
+
+/* Reap process i of the job in slot if it has exited */
+static void reap(unsigned int slot, unsigned int i)
+{
+    JobProc *p = &jobs[slot].procs[i];
+    siginfo_t info;
+    int status = 0;
+    if (p->done)
+        return;
+    if (p->fd == -1) /* No pidfd, ask about the pid directly */
+    {
+        pid_t r = waitpid(p->pid, &status, WNOHANG);
+        if (r == p->pid)
+            procDone(slot, i, WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+        else if (r == -1)
+            procDone(slot, i, 1);
+        return;
+    }
+    info.si_pid = 0;
+    if (waitid(P_PIDFD, p->fd, &info, WEXITED | WNOHANG) == -1)
+        procDone(slot, i, 1);
+    else if (info.si_pid != 0)
+        procDone(slot, i, exitStatus(&info));
+}
+
+/* Pick up stop and continue notifications for the processes of the job in slot */
+static void checkStopped(unsigned int slot)
+{
+    Job *j = &jobs[slot];
+    siginfo_t info;
+    int status = 0;
+    for (unsigned int i = 0; i < j->numProcs; ++i)
+    {
+        if (j->procs[i].done)
+            continue;
+        info.si_pid = 0;
+        if (j->procs[i].fd != -1)
+        {
+            if (waitid(P_PIDFD, j->procs[i].fd, &info, WSTOPPED | WCONTINUED | WNOHANG) == -1 || info.si_pid == 0)
+                continue;
+            if (info.si_code == CLD_STOPPED || info.si_code == CLD_TRAPPED)
+                j->state = JOB_STOPPED;
+            else if (info.si_code == CLD_CONTINUED)
+                j->state = JOB_RUNNING;
+        }
+        else if (waitpid(j->procs[i].pid, &status, WUNTRACED | WCONTINUED | WNOHANG) == j->procs[i].pid)
+        {
+            if (WIFSTOPPED(status))
+                j->state = JOB_STOPPED;
+            else if (WIFCONTINUED(status))
+                j->state = JOB_RUNNING;
+            else
+                procDone(slot, i, WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+        }
+    }
+}
+
+/* Find the slot of the job running pid. Only needed for the rare stop notifications */
+static unsigned int findPid(pid_t pid)
+{
+    for (unsigned int s = 0; s < numSlots; ++s)
+    {
+        if (!jobs[s].used || jobs[s].state == JOB_DONE)
+            continue;
+        for (unsigned int i = 0; i < jobs[s].numProcs; ++i)
+        {
+            if (jobs[s].procs[i].pid == pid)
+                return s;
+        }
+    }
+    return NO_SLOT;
+}
+
+/* Drain the signalfd, updating jobs that stopped or continued */
+static void readSignals()
+{
+    struct signalfd_siginfo si[16];
+    ssize_t n;
+    unsigned int slot;
+    while ((n = read(sigfd, si, sizeof(si))) > 0)
+    {
+        for (size_t k = 0; k < n / sizeof(si[0]); ++k)
+        {
+            /* Exits arrive through the pidfds */
+            if (si[k].ssi_code != CLD_STOPPED && si[k].ssi_code != CLD_CONTINUED && si[k].ssi_code != CLD_TRAPPED)
+                continue;
+            if ((slot = findPid(si[k].ssi_pid)) != NO_SLOT)
+                checkStopped(slot);
+        }
+    }
+}
+
+/* Arm a timerfd to fire once after ns nanoseconds */
+static bool setTimer(int fd, long long ns)
+{
+    struct itimerspec its;
+    its.it_interval.tv_sec = 0;
+    its.it_interval.tv_nsec = 0;
+    its.it_value.tv_sec = ns / 1000000000;
+    its.it_value.tv_nsec = ns % 1000000000;
+    return timerfd_settime(fd, 0, &its, NULL) == 0;
+}
+
+/* Start the deadline d of the job in slot */
+static void startTimer(unsigned int slot, const Deadline *d)
+{
+    Job *j = &jobs[slot];
+    struct epoll_event ev;
+    j->signal = d->signal;
+    j->graceNs = d->graceNs;
+    j->timer = redirHigh(timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK));
+    ev.events = EPOLLIN;
+    ev.data.u64 = ((uint64_t) slot << 32) | TIMER_INDEX;
+    if (j->timer != -1 && setTimer(j->timer, d->ns) && epoll_ctl(epfd, EPOLL_CTL_ADD, j->timer, &ev) == 0)
+        return;
+    fprintf(stderr, "timeout: failed to set a deadline for \'%s\'\n", j->cmd);
+    if (j->timer != -1)
+        close(j->timer);
+    j->timer = -1;
+}
+
+/*
+  The timer of the job in slot fired: send the job its signal and wait out the
+  grace period, or send SIGKILL if the grace period is what ran out
+*/
+static void expire(unsigned int slot)
+{
+    Job *j = &jobs[slot];
+    uint64_t ticks;
+    int sig = j->timedOut ? SIGKILL : j->signal;
+    if (read(j->timer, &ticks, sizeof(ticks)) != sizeof(ticks))
+        return;
+    signalJob(j, sig);
+    if (j->state == JOB_STOPPED && sig != SIGKILL) /* A stopped job would keep the signal pending */
+        signalJob(j, SIGCONT);
+    if (!j->timedOut && sig != SIGKILL && j->graceNs > 0)
+        setTimer(j->timer, j->graceNs);
+    else
+        stopTimer(j);
+    j->timedOut = true;
+}
+
+/*
+  Handle the events that are ready, waiting up to timeout milliseconds (-1
+  forever) for the first one
+  Returns the number of events handled, with sawSignal set if SIGCHLD arrived,
+  or -1 (after printing why) if epoll_wait failed
+*/
+static int handleEvents(int timeout, bool *sawSignal)
+{
+    struct epoll_event evs[JOBS_EVENTS];
+    int n;
+    if (epfd == -1)
+        return 0;
+    while ((n = epoll_wait(epfd, evs, JOBS_EVENTS, timeout)) == -1 && errno == EINTR)
+        ;
+    if (n == -1)
+    {
+        fprintf(stderr, "jobs: failed to wait for events: %s\n", strerror(errno));
+        return -1;
+    }
+    for (int k = 0; k < n; ++k)
+    {
+        if (evs[k].data.u64 == SIGNAL_EVENT)
+        {
+            readSignals();
+            if (sawSignal != NULL)
+                *sawSignal = true;
+            continue;
+        }
+        if ((evs[k].data.u64 & 0xffffffff) == TIMER_INDEX)
+            expire(evs[k].data.u64 >> 32);
+        else
+            reap(evs[k].data.u64 >> 32, evs[k].data.u64 & 0xffffffff);
+    }
+    return n;
+}
+
+/*
+  Add a job made of the n processes in pids (the stages of a pipeline, in
+  order) started for the command line cmd
+  Returns the job id
+*/
+int jobsAdd(pid_t *pids, unsigned int n, const char *cmd, bool bg)
+{
+    unsigned int slot = freeList;
+    Job *j = NULL;
+    struct epoll_event ev;
+    bool loop = ensureLoop();
+    if (slot != NO_SLOT)
+        freeList = jobs[slot].nextFree;
+    else
+    {
+        if (numSlots == maxSlots) /* Need to expand the table */
+        {
+            maxSlots = maxSlots == 0 ? INIT_JOBS : maxSlots * 2;
+            jobs = (Job*) realloc(jobs, maxSlots * sizeof(Job));
+        }
+        slot = numSlots++;
+    }
+    j = &jobs[slot];
+    j->used = true;
+    j->state = JOB_RUNNING;
+    j->bg = bg;
+    j->pgid = control || pending.ns > 0 ? leader : 0;
+    j->cmd = strdup(cmd);
+    j->timer = -1;
+    j->timedOut = false;
+    j->procs = (JobProc*) malloc(n * sizeof(JobProc));
+    j->numProcs = n;
+    j->running = n;
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        j->procs[i].pid = pids[i];
+        j->procs[i].done = false;
+        j->procs[i].status = 0;
+        j->procs[i].fd = loop ? redirHigh(syscall(SYS_pidfd_open, pids[i], 0)) : -1; /* pidfds are always close-on-exec */
+        ev.events = EPOLLIN;
+        ev.data.u64 = ((uint64_t) slot << 32) | i;
+        if (j->procs[i].fd != -1 && epoll_ctl(epfd, EPOLL_CTL_ADD, j->procs[i].fd, &ev) == -1)
+        {
+            close(j->procs[i].fd);
+            j->procs[i].fd = -1;
+        }
+        if (j->procs[i].fd == -1)
+            ++numPolled;
+    }
+    if (pending.ns > 0 && loop)
+        startTimer(slot, &pending);
+    pending.ns = 0;
+    if (bg)
+    {
+        current = slot + 1;
+        if (interactive)
+            printf("[%u] %d\n", slot + 1, (int) pids[n - 1]);
+    }
+    return slot + 1;
+}
+
+/* Check if any running process of the job has no pidfd */
+static bool needsPolling(const Job *j)
+{
+    for (unsigned int i = 0; i < j->numProcs; ++i)
+    {
+        if (!j->procs[i].done && j->procs[i].fd == -1)
+            return true;
+    }
+    return false;
+}
+
+/*
+  Block on the processes of the job in slot with waitpid: the ones without a
+  pidfd, or every one left if the event loop failed
+*/
+static void waitDirect(unsigned int slot, bool all)
+{
+    int status = 0;
+    for (unsigned int i = 0; i < jobs[slot].numProcs; ++i)
+    {
+        JobProc *p = &jobs[slot].procs[i];
+        if (p->done || (p->fd != -1 && !all))
+            continue;
+        if (waitpid(p->pid, &status, WUNTRACED) == -1)
+            procDone(slot, i, 1);
+        else if (WIFSTOPPED(status))
+            jobs[slot].state = JOB_STOPPED;
+        else
+            procDone(slot, i, WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+    }
+}
+
+/*
+  Wait until the job finishes or stops, handling events of other jobs along
+  the way. A foreground job gets the terminal while it runs
+  Returns the exit status of the last process, JOBS_TIMED_OUT if the job ran
+  past its deadline, 128 + SIGTSTP if the job stopped, or 127 if there is no
+  such job
+*/
+int jobsWait(int id)
+{
+    Job *j = getJob(id);
+    unsigned int slot = id - 1;
+    bool sawSignal = false;
+    bool broken = false; /* epoll_wait failed, so its events can't be relied on */
+    int status = 0;
+    if (j == NULL)
+    {
+        fprintf(stderr, "wait: no job %d\n", id);
+        return 127;
+    }
+    if (control && !j->bg && j->pgid != 0)
+        tcsetpgrp(0, j->pgid);
+    while (jobs[slot].state == JOB_RUNNING)
+    {
+        if (broken || needsPolling(&jobs[slot])) /* No pidfd for a process or no event loop, fall back to blocking */
+        {
+            waitDirect(slot, broken);
+            continue;
+        }
+        sawSignal = false;
+        if (handleEvents(-1, &sawSignal) == -1)
+            broken = true;
+        else if (sawSignal) /* SIGCHLDs merge, so look at this job directly rather than trusting the one we read */
+            checkStopped(slot);
+    }
+    if (control && !jobs[slot].bg && jobs[slot].pgid != 0)
+        tcsetpgrp(0, shellPgid);
+    j = &jobs[slot];
+    if (j->state == JOB_STOPPED)
+    {
+        j->bg = true;
+        current = id;
+        printf("\n[%d]  Stopped  %s\n", id, j->cmd);
+        return 128 + SIGTSTP;
+    }
+    status = j->timedOut ? JOBS_TIMED_OUT : j->procs[j->numProcs - 1].status;
+    removeJob(slot);
+    return status;
+}
+
+/* Wait for every running job. Returns 0 */
+int jobsWaitAll()
+{
+    for (unsigned int s = 0; s < numSlots; ++s)
+    {
+        if (jobs[s].used && jobs[s].state != JOB_STOPPED)
+            jobsWait(s + 1);
+    }
+    return 0;
+}
+
+/*
+  Continue a job in the foreground (waiting for it) or the background
+  Returns the job's status when run in the foreground, 0 otherwise
+*/
+int jobsResume(int id, bool fg)
+{
+    Job *j = getJob(id);
+    if (j == NULL || j->state == JOB_DONE)
+    {
+        fprintf(stderr, "%s: no job %d\n", fg ? "fg" : "bg", id);
+        return 1;
+    }
+    if (j->state == JOB_STOPPED)
+    {
+        signalJob(j, SIGCONT);
+        j->state = JOB_RUNNING;
+    }
+    if (!fg)
+    {
+        j->bg = true;
+        current = id;
+        printf("[%d]  %s &\n", id, j->cmd);
+        return 0;
+    }
+    j->bg = false;
+    printf("%s\n", j->cmd);
+    fflush(stdout);
+    return jobsWait(id);
+}
+
+/*
+  Forget all but the JOBS_KEEP_DONE newest background jobs that finished and
+  weren't collected by wait or jobs, so a long script doesn't grow the table.
+  The kept ones stay at the end of the done queue, newest last
+*/
+static void forgetDone()
+{
+    unsigned int kept = 0;
+    unsigned int slot;
+    bool seen;
+    for (unsigned int k = numDone; k > 0; --k)
+    {
+        slot = doneQueue[k - 1];
+        if (!jobs[slot].used || jobs[slot].state != JOB_DONE || !jobs[slot].bg)
+            continue; /* Already collected */
+        seen = false;
+        for (unsigned int m = numDone - kept; m < numDone; ++m) /* The slot may have been reused by a newer job */
+            seen = seen || doneQueue[m] == slot;
+        if (seen)
+            continue;
+        if (kept == JOBS_KEEP_DONE)
+            removeJob(slot);
+        else
+            doneQueue[numDone - ++kept] = slot;
+    }
+    if (kept > 0) /* The queue isn't allocated until a job finishes */
+        memmove(doneQueue, doneQueue + numDone - kept, kept * sizeof(unsigned int));
+    numDone = kept;
+}
+
+/*
+  Collect every job that finished without blocking. Interactive shells report
+  finished background jobs and forget them; otherwise the newest
+  JOBS_KEEP_DONE are kept until wait or jobs asks for them
+*/
+void jobsPoll()
+{
+    unsigned int slot;
+    while (handleEvents(0, NULL) == JOBS_EVENTS)
+        ;
+    for (unsigned int s = 0; numPolled > 0 && s < numSlots; ++s) /* Processes we couldn't get a pidfd for */
+    {
+        for (unsigned int i = 0; jobs[s].used && i < jobs[s].numProcs; ++i)
+        {
+            if (jobs[s].procs[i].fd == -1)
+                reap(s, i);
+        }
+    }
+    if (!interactive)
+    {
+        forgetDone();
+        return;
+    }
+    for (unsigned int k = 0; k < numDone; ++k)
+    {
+        slot = doneQueue[k];
+        if (!jobs[slot].used || jobs[slot].state != JOB_DONE || !jobs[slot].bg)
+            continue; /* Already collected by wait or jobs */
+        printf("[%u]  Done  %s\n", slot + 1, jobs[slot].cmd);
+        removeJob(slot);
+    }
+    numDone = 0;
+}
+
+/* Print every job with its state to out, forgetting the ones that finished */
+void jobsList(int out)
+{
+    static const char *states[] = { "Running", "Stopped", "Done" };
+    while (handleEvents(0, NULL) == JOBS_EVENTS)
+        ;
+    for (unsigned int s = 0; s < numSlots; ++s)
+    {
+        if (!jobs[s].used)
+            continue;
+        printOut(out, "[%u]  %s  %s\n", s + 1, states[jobs[s].state], jobs[s].cmd);
+        if (jobs[s].state == JOB_DONE)
+            removeJob(s);
+    }
+}
+
+/* Id of the job fg and bg use by default: the last one sent to the background, else the newest. 0 if none */
+int jobsCurrent()
+{
+    if (getJob(current) != NULL && jobs[current - 1].state != JOB_DONE)
+        return current;
+    for (unsigned int s = numSlots; s > 0; --s)
+    {
+        if (jobs[s - 1].used && jobs[s - 1].state != JOB_DONE)
+            return s;
+    }
+    return 0;
+}
@@ -0,0 +1,70 @@
+/*
+  Job table for commands started by the shell
+
+  Every process is watched through a pidfd registered with one epoll instance,
+  which also holds a signalfd for SIGCHLD so stopped jobs are noticed. Waiting
+  for a command and collecting finished background jobs both go through the
+  same event loop, so there is never a blocking waitpid on one child while
+  others are left as zombies. A job with a deadline adds a timerfd to the same
+  instance, so a timed job costs nothing until its time is up
+*/
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#define INIT_JOBS 16 /* Initial number of job slots to allocate */
+#define JOBS_EVENTS 64 /* Most events handled per epoll_wait call */
+#define JOBS_KEEP_DONE 16 /* Finished background jobs a non-interactive shell keeps for wait and jobs */
+#define JOBS_TIMED_OUT 124 /* Status of a job stopped for running past its deadline */
+
+typedef struct
+{
+    long long ns; /* Time the job may run for, 0 for no deadline */
+    int signal; /* Sent to the job when the time is up */
+    long long graceNs; /* Time between the signal and SIGKILL, 0 to never send SIGKILL */
+} Deadline;
+
+typedef enum { JOB_RUNNING, JOB_STOPPED, JOB_DONE } JobState;
+
+typedef struct
+{
+    pid_t pid;
+    int fd; /* pidfd, -1 once the process is reaped or if the kernel has no pidfds */
+    int status;
+    bool done;
+} JobProc;
+
+typedef struct
+{
+    bool used; /* Slot holds a job, otherwise it is on the free list */
+    JobState state;
+    bool bg; /* Started with & or sent to the background, report it at the prompt when it finishes */
+    pid_t pgid; /* Process group when job control is on, 0 otherwise */
+    JobProc *procs; /* One per pipeline stage */
+    unsigned int numProcs;
+    unsigned int running; /* Processes not reaped yet */
+    char *cmd;
+    int timer; /* timerfd of the deadline, -1 if there is none or it is over */
+    int signal; /* Sent when the deadline passes */
+    long long graceNs; /* Time after the signal until SIGKILL */
+    bool timedOut; /* The deadline passed */
+    unsigned int nextFree; /* Next slot on the free list */
+} Job;
+
+void jobsInit(bool);
+void jobsReset();
+void jobsNewGroup(bool);
+void jobsSetDeadline(const Deadline*);
+void jobsForked(pid_t);
+void jobsChild();
+int jobsAdd(pid_t*, unsigned int, const char*, bool);
+int jobsWait(int);
+int jobsWaitAll();
+int jobsResume(int, bool);
+void jobsPoll();
+void jobsList(int);
+int jobsCurrent();
+
+#endif
@@ -5,18 +5,33 @@
   s: {expr} / invoke
   invoke: cmd [ + | + cmd ]...
   op: && / || / ; / =
-  redir: < / > / >>
-  cmd: EXECUTABLE [+ arg]... [+ redir + FILE_NAME/DELIM] [ + &]
-  arg: $NAMED_CONSTANT / LITERAL
+  redir: [N]< / [N]> / [N]>| / [N]>> / [N]<> / [N]<& / [N]>& / &> / &>>
+  dup: [N]<&M / [N]>&M / [N]<&- / [N]>&-
+  cmd: [cache + [OPTION + ]...][timeout + [OPTION + ]...DURATION + ][place + [OPTION + ]...]EXECUTABLE [+ arg]... [+ redir + FILE_NAME/FD / + dup]... [ + &]
+  arg: $NAMED_CONSTANT / ${PARAMETER} / $? / $(expr) / $((arithmetic)) / PATTERN / LITERAL
 
   IMPORTANT: Don't forget to call init() to intialize the array of user
   defined constants and finish() to cleanup the array
 */
 #include "Parser.h"
+#include "Builtins.h"
+#include "PathCache.h"
+#include "Env.h"
+#include "Glob.h"
+#include "Jobs.h"
+#include "Place.h"
+#include "Scan.h"
+#include "Redir.h"
+#include "Cache.h"
+#include "Arith.h"
+#include "Timeout.h"
+#include <fnmatch.h>
 
 char ***consts; /* Array of string pairs to store user defined constants. If we have more time, this should be replaced with a BST */
 unsigned int numConsts; /* Current number of constants ie. next free index */
+int lastStatus = 0; /* Exit status of the last statement, expanded by $? */
 unsigned int maxConsts; /* Current maximum number of user defined constants */
+bool *exported; /* Parallel to consts, is the constant passed on to child processes */
 
 /* Initialize the global variables */
 void init()
@@ -24,6 +39,9 @@ void init()
     maxConsts = INIT_CONSTS;
     numConsts = 0;
     consts = (char***) malloc(maxConsts * sizeof(char**));
+    exported = (bool*) malloc(maxConsts * sizeof(bool));
+    if (!envInit())
+        fprintf(stderr, "warning: failed to copy the environment\n");
     /* Reserve the 0th index for the PATH variable */
     consts[numConsts] = (char**) malloc(2 * sizeof(char*));
     consts[numConsts][0] = (char*) malloc(BUFF_MAX * sizeof(char));
@@ -35,6 +53,8 @@ void init()
     if (consts[numConsts][1] == NULL)
         fprintf(stderr, "warning: failed to initialize PATH\n");
     strcat(consts[numConsts][1], "/bin");
+    exported[numConsts] = true; /* Children should find commands the same way the shell does */
+    envSet("PATH", consts[numConsts][1]);
     ++numConsts;
 }
 
@@ -48,6 +68,9 @@ void finish()
         free(consts[i]);
     }
     free(consts);
+    free(exported);
+    envFree();
+    redirFree();
 }
 
 /* Define a constant with the specified key and value */
@@ -82,6 +105,8 @@ bool addConst(char *key, char *val)
         {
             /* Just update the value */
             strcpy(consts[i][1], val);
+            if (exported[i])
+                return envSet(key, val);
             return true;
         }
     }
@@ -90,15 +115,38 @@ bool addConst(char *key, char *val)
     consts[numConsts][1] = (char*) malloc(BUFF_MAX * sizeof(char));
     strcpy(consts[numConsts][0], key);
     strcpy(consts[numConsts][1], val);
+    exported[numConsts] = false;
     ++numConsts;
     if (numConsts == maxConsts) /* Need to expand the array */
     {
         maxConsts *= 2;
         consts = (char***) realloc(consts, maxConsts * sizeof(char***));
+        exported = (bool*) realloc(exported, maxConsts * sizeof(bool));
     }
     return true;
 }
 
+/*
+  Pass the constant on to every child process started from now on
+  Variables that were already in the environment the shell started with are
+  exported without being defined as constants
+*/
+bool exportConst(char *key)
+{
+    for (unsigned int i = 0; i < numConsts; ++i)
+    {
+        if (strcmp(consts[i][0], key) == 0)
+        {
+            exported[i] = true;
+            return envSet(key, consts[i][1]);
+        }
+    }
+    if (envHas(key))
+        return true;
+    fprintf(stderr, "exportConst: '%s' is not defined\n", key);
+    return false;
+}
+
 /*
   Get the string associated with the key
   Returns blank string on failure
@@ -114,55 +162,38 @@ char* getConst(char *key)
     return "";
 }
 
-/* Check if the string is a valid operator */
-bool isOp(char *s)
+typedef enum { TOKEN_WORD, TOKEN_OP, TOKEN_PIPE } TokenKind;
+
+/*
+  Classify the len characters at s without copying them out, so operators can
+  be recognized in place while scanning an expression
+*/
+static TokenKind tokenKind(const char *s, int len)
 {
-    if (strlen(s) > 2) /* No operators are more than 2 characters long */
-        return false;
-    if (strlen(s) == 1) /* Single character operator lets us use a switch statement */
+    if (len == 1)
     {
         switch (s[0])
         {
         case ';':
         case '=':
-            return true;
+            return TOKEN_OP;
+        case '|':
+            return TOKEN_PIPE;
         default:
-            return false;
+            return TOKEN_WORD;
         }
     }
-    else /* Compare the string to supported 2 character operators */
+    if (len == 2 && s[0] == s[1]) /* Supported 2 character operators are a character doubled */
     {
-        if (strcmp(s, "&&") == 0)
-            return true;
-        if (strcmp(s, "||") == 0)
-            return true;
-        return false;
+        if (s[0] == '&' || s[0] == '|')
+            return TOKEN_OP;
     }
+    return TOKEN_WORD;
 }
 
-/* Check if the string is a pipe */
-bool isPipe(char *s)
-{ return (strlen(s) == 1 && s[0] == '|'); }
-
 /* Check if the string is a redirection operator */
 bool isRedir(char *s)
-{
-    
-    if (strlen(s) == 1)
-    {
-        switch (s[0])
-        {
-        case '<':
-        case '>':
-            return true;
-        default:
-            return false;
-        }
-    }
-    if (strcmp(s, ">>") == 0)
-        return true;
-    return false;
-}
+{ return redirParse(s, NULL); }
 
 /* Move pos to matching closing brace */
 bool matchBrace(char *s, int *pos, const unsigned int maxPos)
@@ -174,12 +205,14 @@ bool matchBrace(char *s, int *pos, const unsigned int maxPos)
     }
     unsigned int count = 1; /* Number of opening braces encountered */
     int i = *pos;
-    while (count > 0 && i < maxPos)
+    while (count > 0 && i < (int) maxPos)
     {
-        ++i;
+        i = scanFind(s, i + 1, maxPos, SCAN_BRACE);
+        if (i > (int) maxPos)
+            break;
         if (s[i] == '{')
             ++count;
-        if (s[i]=='}')
+        else
             --count;
     }
     if (count != 0)
@@ -199,19 +232,100 @@ bool matchQuote(char *s, int *pos, const unsigned int maxPos)
         fprintf(stderr, "matchBrace: position passed is not a quote\n");
         return false;
     }
+    int i = scanFind(s, *pos + 1, maxPos, SCAN_QUOTE);
+    if (i > (int) maxPos)
+        return false;
+    *pos = i;
+    return true;
+}
+
+/* Move pos from the opening parenthesis to the matching closing one, skipping over quoted text */
+bool matchParen(char *s, int *pos, const unsigned int maxPos)
+{
+    if (s[*pos] != '(')
+    {
+        fprintf(stderr, "matchParen: position passed is not a parenthesis\n");
+        return false;
+    }
+    unsigned int count = 1; /* Number of unclosed parentheses */
     int i = *pos;
-    while (i < maxPos)
+    while (count > 0 && i < (int) maxPos)
     {
-        ++i;
-        if (s[i] == '\"')
+        i = scanFind(s, i + 1, maxPos, SCAN_QUOTE | SCAN_PAREN);
+        if (i > (int) maxPos || (s[i] == '\"' && !matchQuote(s, &i, maxPos)))
             break;
+        if (s[i] == '(')
+            ++count;
+        if (s[i] == ')')
+            --count;
     }
-    if (s[i] != '\"')
+    if (count != 0)
+    {
+        fprintf(stderr, "matchParen: matching parenthesis not found\n");
         return false;
+    }
     *pos = i;
     return true;
 }
 
+/*
+  Return the position just past the whitespace delineated token starting at pos
+  A command substitution $( ... ) is kept whole even if it contains whitespace
+*/
+int skipToken(char *s, int pos, const int maxPos)
+{
+    while (1)
+    {
+        pos = scanFind(s, pos, maxPos, SCAN_SPACE | SCAN_DOLLAR);
+        if (pos > maxPos || s[pos] != '$')
+            return pos;
+        if (pos < maxPos && s[pos + 1] == '(')
+        {
+            ++pos;
+            if (!matchParen(s, &pos, maxPos)) /* Unterminated, let evalArg report it */
+                return maxPos + 1;
+        }
+        ++pos;
+    }
+}
+
+/*
+  Find the next operator token of the given kind in s[pos..maxPos]. Rather
+  than splitting off every word, the scan jumps between the characters
+  operators are made of with the SCAN_OP mask and only looks at the ones
+  that start a token. Like skipToken, a $( ... ) is skipped whole
+  len: Set to the length of the operator
+  Returns its position, maxPos + 1 if there is none
+*/
+static int findOp(char *s, int pos, const int maxPos, TokenKind kind, int *len)
+{
+    int start = pos;
+    int end;
+    while ((pos = scanFind(s, pos, maxPos, SCAN_OP | SCAN_DOLLAR)) <= maxPos)
+    {
+        if (s[pos] == '$')
+        {
+            if (pos < maxPos && s[pos + 1] == '(')
+            {
+                ++pos;
+                if (!matchParen(s, &pos, maxPos)) /* Unterminated, let evalArg report it */
+                    return maxPos + 1;
+            }
+        }
+        else if (pos == start || isspace(s[pos - 1]))
+        {
+            end = scanFind(s, pos, pos + 2 < maxPos ? pos + 2 : maxPos, SCAN_SPACE); /* No operator is longer than 2 */
+            if (tokenKind(s + pos, end - pos) == kind)
+            {
+                *len = end - pos;
+                return pos;
+            }
+        }
+        ++pos;
+    }
+    return pos;
+}
+
 /*
  Parse the given expression into a left statement, operator, and right expression
  expr: Expression to be parsed
@@ -228,9 +342,7 @@ bool parseExpr(char *expr, char *s, char *op, char *e)
     int opPos1 = INVALID_POS; /* Start and end positions for operator */
     int opPos2 = INVALID_POS;
     int expStart = INVALID_POS;
-    char token[BUFF_MAX] = ""; /* The space delineated token we are considering */
-    int tokPos1 = INVALID_POS;
-    int tokPos2 = INVALID_POS;
+    int opLen = 0;
     /* Initialize return values */
     s[0] = '\0';
     op[0] = '\0';
@@ -239,8 +351,7 @@ bool parseExpr(char *expr, char *s, char *op, char *e)
         return true;
     while (pos2 > pos1 && isspace(expr[pos2])) /* Remove trailing whitespace */
         --pos2;
-    while (pos1 <= pos2 && isspace(expr[pos1])) /* Ignore leading whitespace */
-        ++pos1;
+    pos1 = scanSkip(expr, pos1, pos2, SCAN_SPACE); /* Ignore leading whitespace */
     if (pos1 > pos2) /* Expression consisted of all white space */
         return true; /* Do nothing */
     i = pos1;
@@ -255,29 +366,16 @@ bool parseExpr(char *expr, char *s, char *op, char *e)
         ++i; /* Move past the matched brace */
     }
     /* Move to the operator */
-    while (i <= pos2)
-    {
-        while (i <= pos2 && isspace(expr[i])) /* Move until not whitespace */
-            ++i;
-        tokPos1 = i;
-        while (i <= pos2 && !isspace(expr[i])) /* Move until whitespace */
-            ++i;
-        tokPos2 = i - 1;
-        strncpy(token, expr + tokPos1, tokPos2 - tokPos1 + 1);
-        token[tokPos2 - tokPos1 + 1] = '\0';
-        if (isOp(token)) /* Found the operator */
-        {
-            opPos1 = tokPos1;
-            opPos2 = tokPos2;
-            break;
-        }
-    }
-    if (opPos1 == INVALID_POS) /* No operator, just a statement */
+    i = findOp(expr, i, pos2, TOKEN_OP, &opLen);
+    if (i > pos2) /* No operator, just a statement */
     {
         strncpy(s, expr + pos1, pos2 - pos1 + 1);
         s[pos2 - pos1 + 1] = '\0';
         return true;
     }
+    opPos1 = i;
+    opPos2 = i + opLen - 1;
+    i = opPos2 + 1;
     strncpy(op, expr + opPos1, opPos2 - opPos1 + 1); /* Store the operator */
     op[opPos2 - opPos1 + 1] = '\0';
     sEnd = opPos1 - 1;
@@ -285,8 +383,7 @@ bool parseExpr(char *expr, char *s, char *op, char *e)
         --sEnd;
     strncpy(s, expr + pos1, sEnd - pos1 + 1); /* Store the statement */
     s[sEnd - pos1 + 1] = '\0';
-    while (i <= pos2 && isspace(expr[i])) /* Move past white space seperation */
-        ++i;
+    i = scanSkip(expr, i, pos2, SCAN_SPACE); /* Move past white space seperation */
     expStart = i; /* Mark the start of the right hand expression */
     strncpy(e, expr + expStart, pos2 - expStart + 1);
     e[pos2 - expStart + 1] = '\0';
@@ -299,6 +396,9 @@ bool parseExpr(char *expr, char *s, char *op, char *e)
  maxArgs: The maximum number of arguments argv can store. This includes the NULL terminator
  cmd: String to store the resulting command
  argv: Array of unallocated character pointers to store the resulting arguments
+ redirs: Array of unallocated character pointers to store the redirection operators
+ filenames: Array of unallocated character pointers to store the file name or
+ descriptor after each operator, blank if the operator names it itself (2>&1)
  numArgs: Returns the number of arguments extracted
  isBg: Returns if a & was passed to indicate a background process
 */
@@ -309,6 +409,7 @@ bool parseCmd(char *s, const unsigned int maxArgs, char *cmd, char **argv, char
     int tokPos1 = INVALID_POS;
     int tokPos2 = INVALID_POS;
     char token[BUFF_MAX] = "";
+    bool ok = true;
     /* Initialize return values */
     cmd[0] = '\0';
     *numArgs = 0;
@@ -319,8 +420,7 @@ bool parseCmd(char *s, const unsigned int maxArgs, char *cmd, char **argv, char
         return true;
     while (pos2 > pos1 && isspace(s[pos2])) /* Remove trailing whitespace */
         --pos2;
-    while (pos1 <= pos2 && isspace(s[pos1])) /* Ignore leading whitespace */
-        ++pos1;
+    pos1 = scanSkip(s, pos1, pos2, SCAN_SPACE); /* Ignore leading whitespace */
     if (pos1 > pos2) /* Expression consisted of all white space */
         return true; /* Do nothing */
     if (pos2 - pos1 > 0 && s[pos2] == '&' && s[pos2 - 1] == ' ') /* & was passed to run process in background */
@@ -333,8 +433,12 @@ bool parseCmd(char *s, const unsigned int maxArgs, char *cmd, char **argv, char
     }
     /* Extract the first space delineated token and store in cmd */
     tokPos1 = tokPos2 = pos1;
-    while (tokPos2 <= pos2 && !isspace(s[tokPos2]))
-        ++tokPos2;
+    tokPos2 = scanFind(s, tokPos2, pos2, SCAN_SPACE);
+    if (tokPos2 - tokPos1 > BUFF_MAX - 1)
+    {
+        fprintf(stderr, "parseCmd: command name exceeds BUFF_MAX\n");
+        return false;
+    }
     strncpy(cmd, s + tokPos1, tokPos2 - tokPos1);
     cmd[tokPos2 - tokPos1] = '\0';
     /* First element of argv is always the name of the command */
@@ -344,18 +448,25 @@ bool parseCmd(char *s, const unsigned int maxArgs, char *cmd, char **argv, char
     /* Parse the argument list */
     while (*numArgs < maxArgs - 1 && tokPos2 <= pos2)
     {
-        while (tokPos2 <= pos2 && isspace(s[tokPos2]))
-            ++tokPos2;
+        tokPos2 = scanSkip(s, tokPos2, pos2, SCAN_SPACE);
         tokPos1 = tokPos2;
         if (s[tokPos1] == '\"') /* Quoted argument */
         {
-            bool ok = matchQuote(s, &tokPos2, pos2);
+            ok = matchQuote(s, &tokPos2, pos2);
             if (!ok) /* Could not match quote */
             {
                 fprintf(stderr, "parseCmd: could not parse all arguments\n");
-                /* Terminate argv early */
-                argv[*numArgs] = NULL;
-                free(argv);
+                for (unsigned int i = 0; i < *numArgs; ++i)
+                    free(argv[i]);
+                *numArgs = 0;
+                return false;
+            }
+            if (tokPos2 - tokPos1 - 1 > BUFF_MAX - 1)
+            {
+                fprintf(stderr, "parseCmd: argument exceeds BUFF_MAX\n");
+                for (unsigned int i = 0; i < *numArgs; ++i)
+                    free(argv[i]);
+                *numArgs = 0;
                 return false;
             }
             argv[*numArgs] = (char*) malloc(BUFF_MAX * sizeof(char));
@@ -367,63 +478,140 @@ bool parseCmd(char *s, const unsigned int maxArgs, char *cmd, char **argv, char
         }
         else
         {
-            while (tokPos2 <= pos2 && !isspace(s[tokPos2]))
-                ++tokPos2;
+            tokPos2 = skipToken(s, tokPos2, pos2);
+            if (tokPos2 - tokPos1 > BUFF_MAX - 1)
+            {
+                fprintf(stderr, "parseCmd: argument exceeds BUFF_MAX\n");
+                for (unsigned int i = 0; i < *numArgs; ++i)
+                    free(argv[i]);
+                *numArgs = 0;
+                return false;
+            }
             strncpy(token, s + tokPos1, tokPos2 - tokPos1);
             token[tokPos2 - tokPos1] = '\0';
             if (isRedir(token)) /* Hit the end of argument list and encountered a redirection operator */
             {
-                redirs[*numRedirs] = (char*) malloc(BUFF_MAX * sizeof(char));
-                strcpy(redirs[*numRedirs], token);
-                ++(*numRedirs);
+                tokPos2 = tokPos1; /* Parsed again with the rest of the redirections */
                 break;
             }
-            argv[*numArgs] = (char*) malloc(BUFF_MAX * sizeof(char));
-            strcpy(argv[*numArgs], token);
-            evalArg(argv[*numArgs]); /* Expand any user defined constants in the arg */
+            argv[*numArgs] = evalArg(token); /* Expand any user defined constants and substitutions in the arg */
+            if (argv[*numArgs] == NULL) /* Expansion failed */
+            {
+                for (unsigned int i = 0; i < *numArgs; ++i)
+                    free(argv[i]);
+                *numArgs = 0;
+                return false;
+            }
+            if (isGlob(argv[*numArgs])) /* Replace a pattern with the paths it matches, or keep it as is if there are none */
+            {
+                size_t n = 0;
+                char **paths = globExpand(argv[*numArgs], &n);
+                if (*numArgs + n > maxArgs - 1)
+                {
+                    fprintf(stderr, "parseCmd: '%s' matches too many files\n", argv[*numArgs]);
+                    for (size_t i = 0; i < n; ++i)
+                        free(paths[i]);
+                    free(paths);
+                    for (unsigned int i = 0; i <= *numArgs; ++i)
+                        free(argv[i]);
+                    *numArgs = 0;
+                    return false;
+                }
+                if (n > 0)
+                {
+                    free(argv[*numArgs]);
+                    for (size_t i = 0; i < n; ++i)
+                        argv[(*numArgs)++] = paths[i];
+                    free(paths);
+                    continue;
+                }
+            }
             ++(*numArgs);
         }
     }
     argv[*numArgs] = NULL; /* Terminate list of args with NULL */
-    if (*numRedirs > 0) /* Command has redirection arguments */
+    /* Parse the redirections, each operator followed by its word unless it names the descriptor itself */
+    while (*numRedirs < maxArgs && tokPos2 <= pos2)
     {
-        unsigned int itr = 0; /* Track the number of iterations */
-        /* Parse the filenames and redirection */
-        while (*numRedirs < maxArgs && *numFilenames < maxArgs && tokPos2 <= pos2)
+        Redir r;
+        tokPos2 = scanSkip(s, tokPos2, pos2, SCAN_SPACE);
+        if (tokPos2 > pos2)
+            break;
+        tokPos1 = tokPos2;
+        tokPos2 = scanFind(s, tokPos2, pos2, SCAN_SPACE);
+        if (tokPos2 - tokPos1 > BUFF_MAX - 1)
         {
-            while (tokPos2 <= pos2 && isspace(s[tokPos2]))
-                ++tokPos2;
-            tokPos1 = tokPos2;
-            while (tokPos2 <= pos2 && !isspace(s[tokPos2]))
-                ++tokPos2;
-            strncpy(token, s + tokPos1, tokPos2 - tokPos1);
-            token[tokPos2 - tokPos1] = '\0';
-            if (itr % 2 == 0 && isRedir(token)) /* Expect filenames on even iterations */
+            fprintf(stderr, "parseCmd: argument exceeds BUFF_MAX\n");
+            ok = false;
+            break;
+        }
+        strncpy(token, s + tokPos1, tokPos2 - tokPos1);
+        token[tokPos2 - tokPos1] = '\0';
+        if (!redirParse(token, &r))
+        {
+            fprintf(stderr, "parseCmd: expected redirection operator near \'%s\'\n", token);
+            ok = false;
+            break;
+        }
+        redirs[*numRedirs] = strdup(token);
+        ++(*numRedirs);
+        if (!r.hasWord)
+        {
+            filenames[*numFilenames] = strdup("");
+            ++(*numFilenames);
+            continue;
+        }
+        tokPos2 = scanSkip(s, tokPos2, pos2, SCAN_SPACE);
+        tokPos1 = tokPos2;
+        if (tokPos1 > pos2) /* Left for evalCmd to report */
+            break;
+        if (s[tokPos1] == '\"') /* Quoted file name */
+        {
+            if (!matchQuote(s, &tokPos2, pos2))
             {
-                fprintf(stderr, "parseCmd: expected filename near \'%s\'\n", token);
-                free(argv);
-                return false;
+                fprintf(stderr, "parseCmd: could not parse all arguments\n");
+                ok = false;
+                break;
             }
-            if (itr % 2 == 1 && !isRedir(token)) /* Expect redirection operator on odd iterations */
+            filenames[*numFilenames] = strndup(s + tokPos1 + 1, tokPos2 - tokPos1 - 1);
+            ++tokPos2;
+        }
+        else
+        {
+            tokPos2 = skipToken(s, tokPos2, pos2);
+            if (tokPos2 - tokPos1 > BUFF_MAX - 1)
             {
-                fprintf(stderr, "parseCmd: expected redirection operator near \'%s\'\n", token);
-                free(argv);
-                return false;
+                fprintf(stderr, "parseCmd: argument exceeds BUFF_MAX\n");
+                ok = false;
+                break;
             }
-            if (itr % 2 == 0) /* Even iteration */
+            strncpy(token, s + tokPos1, tokPos2 - tokPos1);
+            token[tokPos2 - tokPos1] = '\0';
+            if (isRedir(token))
             {
-                filenames[*numFilenames] = (char*) malloc(BUFF_MAX * sizeof(char));
-                strcpy(filenames[*numFilenames], token);
-                ++(*numFilenames);
+                fprintf(stderr, "parseCmd: expected filename near \'%s\'\n", token);
+                ok = false;
+                break;
             }
-            else
+            filenames[*numFilenames] = evalArg(token); /* File names are expanded like arguments */
+            if (filenames[*numFilenames] == NULL)
             {
-                redirs[*numRedirs] = (char*) malloc(BUFF_MAX * sizeof(char));
-                strcpy(redirs[*numRedirs], token);
-                ++(*numRedirs);
+                ok = false;
+                break;
             }
-            ++itr;
         }
+        ++(*numFilenames);
+    }
+    if (!ok)
+    {
+        for (unsigned int i = 0; i < *numArgs; ++i)
+            free(argv[i]);
+        for (unsigned int i = 0; i < *numRedirs; ++i)
+            free(redirs[i]);
+        for (unsigned int i = 0; i < *numFilenames; ++i)
+            free(filenames[i]);
+        *numArgs = *numRedirs = *numFilenames = 0;
+        return false;
     }
     return true;
 }
@@ -446,8 +634,7 @@ bool parseS(char *s, char *e, char *inv)
         return false;
     while (pos2 > pos1 && isspace(s[pos2])) /* Remove trailing whitespace */
         --pos2;
-    while (pos1 <= pos2 && isspace(s[pos1])) /* Ignore leading whitespace */
-        ++pos1;
+    pos1 = scanSkip(s, pos1, pos2, SCAN_SPACE); /* Ignore leading whitespace */
     if (s[pos1] == '{') /* Statement is an expression enclosed in braces */
     {
         if (s[pos2] != '}')
@@ -461,12 +648,12 @@ bool parseS(char *s, char *e, char *inv)
             --pos2;
         /* Return the expression */
         strncpy(e, s + pos1, pos2 - pos1 + 1);
-        s[pos2 - pos1 + 1] = '\0';
+        e[pos2 - pos1 + 1] = '\0';
         return true;
     }
     /* Statement is a invocation */
     strncpy(inv, s + pos1, pos2 - pos1 + 1);
-    s[pos2 - pos1 + 1] = '\0';
+    inv[pos2 - pos1 + 1] = '\0';
     return true;
 }
 
@@ -483,55 +670,40 @@ bool parseInvoke(char *s, char **cmds, unsigned int *numCmds, unsigned int *numP
     int pos2 = strlen(s) - 1;
     int tokPos1 = INVALID_POS;
     int tokPos2 = INVALID_POS;
-    char token[BUFF_MAX] = {};
     int i = 0;
+    int len = 0;
     /* Initialize return values */
     *numCmds = 0;
     if (strlen(s) == 0) /* Empty expression passed */
         return true;
     while (pos2 > pos1 && isspace(s[pos2])) /* Remove trailing whitespace */
         --pos2;
-    while (pos1 <= pos2 && isspace(s[pos1])) /* Ignore leading whitespace */
-        ++pos1;
+    pos1 = scanSkip(s, pos1, pos2, SCAN_SPACE); /* Ignore leading whitespace */
     if (pos1 > pos2) /* Expression consisted of all white space */
         return true; /* Do nothing */
     i = pos1;
-    while (i <= pos2)
+    while ((tokPos1 = findOp(s, i, pos2, TOKEN_PIPE, &len)) <= pos2) /* Found a pipe */
     {
-        while (i <= pos2 && isspace(s[i]))
-            ++i;
-        tokPos1 = i;
-        while (i <= pos2 && !isspace(s[i]))
-            ++i;
-        tokPos2 = i;
-        strncpy(token, s + tokPos1, tokPos2 - tokPos1);
-        token[tokPos2 - tokPos1] = '\0';
-        if (isPipe(token)) /* Found a redirection operator */
+        tokPos2 = tokPos1 + len;
+        if (tokPos1 == pos1)
         {
-            i = tokPos1 - 1;
-            if (i == -1)
-            {
-                fprintf(stderr, "parseInvoke: expected left command for redirection operator\n");
-                return false;
-            }
-            while (i > 0 && isspace(s[i]))
-                --i;
-            /* Save the command */
-            cmds[*numCmds] = (char*) malloc(BUFF_MAX * sizeof(char));
-            strncpy(cmds[*numCmds], s + pos1, i - pos1 + 1);
-            cmds[*numCmds][i - pos1 + 1] = '\0';
-            ++(*numCmds);
-            ++(*numPipes);
-            pos1 = tokPos2;
-            while (pos1 <= pos2 && isspace(s[pos1]))
-                ++pos1;
-        }
-        i = tokPos2;
-        while (i <= pos2 && isspace(s[i]))
-            ++i;
+            fprintf(stderr, "parseInvoke: expected left command for redirection operator\n");
+            return false;
+        }
+        i = tokPos1 - 1;
+        while (i > 0 && isspace(s[i]))
+            --i;
+        /* Save the command */
+        cmds[*numCmds] = (char*) malloc(i - pos1 + 2);
+        strncpy(cmds[*numCmds], s + pos1, i - pos1 + 1);
+        cmds[*numCmds][i - pos1 + 1] = '\0';
+        ++(*numCmds);
+        ++(*numPipes);
+        pos1 = scanSkip(s, tokPos2, pos2, SCAN_SPACE);
+        i = pos1;
     }
     /* Add the remaining cmd */
-    cmds[*numCmds] = (char*) malloc(BUFF_MAX * sizeof(char));
+    cmds[*numCmds] = (char*) malloc(strlen(s + pos1) + 1);
     strcpy(cmds[*numCmds], s + pos1);
     ++(*numCmds);
     /* Terminate with NULL */
@@ -539,13 +711,27 @@ bool parseInvoke(char *s, char **cmds, unsigned int *numCmds, unsigned int *numP
     return true;
 }
 
-/* Evaluate the invocation */
+/* Check if the command ends with a separate &, which runs it in the background */
+static bool isBackground(char *s)
+{
+    int pos = strlen(s) - 1;
+    while (pos > 0 && isspace(s[pos]))
+        --pos;
+    return pos > 0 && s[pos] == '&' && isspace(s[pos - 1]);
+}
+
+/*
+  Evaluate the invocation
+  All stages of a pipeline are started before any of them is waited for, so
+  stages stream into each other instead of filling the pipe and stalling
+*/
 int evalInvoke(char *s)
 {
     /* For parseInvoke */
     char *cmds[MAX_ARGS]; /* Array to store the commands parsed */
     unsigned int numCmds = 0; /* Number of commands extracted */
     unsigned int numPipes = 0; /* Number of pipes extracted */
+    pid_t pids[MAX_ARGS]; /* Children started for each stage */
     /* File descriptors to handle forking */
     int in = 0;
     int fd[2];
@@ -557,27 +743,52 @@ int evalInvoke(char *s)
     if (!ok) /* Failed to parse */
         return 1;
     if (numPipes == 0) /* No pipes, just a single command */
-        r = evalCmd(0, 1, cmds[0]);
+        r = evalCmd(0, 1, cmds[0], NULL);
     /* Process pipes */
     else
     {
+        unsigned int numStarted = 0;
+        unsigned int numStages = numCmds; /* Stages that may have started */
+        jobsNewGroup(!isBackground(cmds[numCmds - 1])); /* Every stage goes in one job */
+        placeNewGroup();
+        for (unsigned int i = 0; i < numCmds; ++i)
+            pids[i] = 0;
         for (unsigned int i = 0; i < numCmds - 1; ++i)
         {
-            r = pipe(fd);
+            r = pipe2(fd, O_CLOEXEC); /* Only the dup'd copies should survive exec */
             if (r == -1) /* Failed to pipe */
             {
                 fprintf(stderr, "evalInvoke: failed to create pipe\n");
-                /* Free cmds */
-                for (unsigned int i = 0; i < numCmds; ++i)
-                    free(cmds[i]);
-                return 1;
+                if (in != 0)
+                    close(in);
+                numStages = i; /* Only wait for the stages already started */
+                break;
             }
-            evalCmd(in, fd[1], cmds[i]);
+            evalCmd(in, fd[1], cmds[i], &pids[i]);
             close(fd[1]); /* No longer need write end of pipe */
+            if (in != 0)
+                close(in); /* The stage has its own copy of the read end */
             in = fd[0]; /* Keep read end of pipe */
         }
         /* Handle last stage of pipe */
-        r = evalCmd(in, 1, cmds[numCmds - 1]);
+        if (r != -1)
+        {
+            r = evalCmd(in, 1, cmds[numCmds - 1], &pids[numCmds - 1]);
+            if (in != 0)
+                close(in);
+        }
+        else
+            r = 1;
+        for (unsigned int i = 0; i < numStages; ++i)
+        {
+            if (pids[i] > 0)
+                pids[numStarted++] = pids[i];
+        }
+        if (numStarted > 0)
+        {
+            int id = jobsAdd(pids, numStarted, s, isBackground(cmds[numCmds - 1]));
+            r = isBackground(cmds[numCmds - 1]) ? 0 : jobsWait(id);
+        }
     }
     /* Free cmds */
     for (unsigned int i = 0; i < numCmds; ++i)
@@ -585,6 +796,11 @@ int evalInvoke(char *s)
     return r;
 }
 
+/*
+  Find the executable for cmd, storing its path in execPath
+  The PATH trie is consulted first when it has been built. Otherwise, or if it
+  is out of date, every directory in PATH is checked in order
+*/
 bool getExecPath(char *cmd, char *execPath)
 {
     char path[BUFF_MAX]; /* String to store the current value of PATH */
@@ -601,6 +817,8 @@ bool getExecPath(char *cmd, char *execPath)
     }
     if (isPath)
         strcpy(execPath, cmd);
+    else if (pathLookup(cmd, execPath) && access(execPath, X_OK) != -1) /* Trie already knows where it is */
+        return true;
     else
     {
         tok = strtok(path, ":");
@@ -620,93 +838,455 @@ bool getExecPath(char *cmd, char *execPath)
     return false;
 }
 
+/* Check if c can be part of the name of a constant */
+static bool isNameChar(char c)
+{ return isalnum((unsigned char) c); }
+
 /*
-  Evaluate the argument
-  This just expands any user defined constants preceeded by a $
+  Get the value of the constant named by the len characters at key, or of the
+  special parameter ? (status of the last statement)
+  Returns NULL if it is not defined
 */
-char* evalArg(char *arg)
+static const char* lookupConst(const char *key, size_t len, char *num)
 {
-    int pos1 = 0;
-    int pos2 = strlen(arg);
-    int keyPos1 = INVALID_POS;
-    int keyPos2 = INVALID_POS;
+    if (len == 1 && key[0] == '?')
+    {
+        sprintf(num, "%d", lastStatus);
+        return num;
+    }
+    for (unsigned int i = 0; i < numConsts; ++i)
+    {
+        if (strncmp(key, consts[i][0], len) == 0 && consts[i][0][len] == '\0')
+            return consts[i][1];
+    }
+    return NULL;
+}
+
+static bool expandInto(Buffer *out, char *arg, int end);
+
+/*
+  Expand the text between the braces of ${...} at arg[start..end) into out
+  Supported forms: NAME, #NAME (length), NAME:-WORD and NAME-WORD (default
+  when empty or unset / unset), NAME#PAT and NAME##PAT (remove the shortest
+  or longest matching prefix), NAME%PAT and NAME%%PAT (same for a suffix)
+  WORD and PAT are expanded themselves before being used
+*/
+static bool expandBraced(Buffer *out, char *arg, int start, int end)
+{
+    char num[24];
+    const char *val = NULL;
+    int name = start;
+    int pos = start;
+    bool length = false;
+    Buffer word;
+    bool ok = true;
+    if (pos < end && arg[pos] == '#' && pos + 1 < end) /* ${#NAME} */
+    {
+        length = true;
+        name = ++pos;
+    }
+    if (pos < end && arg[pos] == '?')
+        ++pos;
+    else
+    {
+        while (pos < end && isNameChar(arg[pos]))
+            ++pos;
+    }
+    if (pos == name || (length && pos != end))
+    {
+        fprintf(stderr, "evalArg: bad substitution '${%.*s}'\n", end - start, arg + start);
+        return false;
+    }
+    val = lookupConst(arg + name, pos - name, num);
+    if (length)
+    {
+        sprintf(num, "%zu", val == NULL ? (size_t) 0 : strlen(val));
+        return bufAppendStr(out, num);
+    }
+    if (pos == end) /* ${NAME} */
+        return val == NULL || bufAppendStr(out, val);
+    if (arg[pos] == '-' || (arg[pos] == ':' && pos + 1 < end && arg[pos + 1] == '-'))
+    {
+        bool colon = arg[pos] == ':';
+        pos += colon ? 2 : 1;
+        if (val != NULL && (!colon || val[0] != '\0'))
+            return bufAppendStr(out, val);
+        return expandInto(out, arg + pos, end - pos);
+    }
+    if (arg[pos] == '#' || arg[pos] == '%')
+    {
+        bool prefix = arg[pos] == '#';
+        bool longest = pos + 1 < end && arg[pos + 1] == arg[pos];
+        size_t n = val == NULL ? 0 : strlen(val);
+        size_t cut = 0; /* Number of characters to remove */
+        char *copy = NULL;
+        pos += longest ? 2 : 1;
+        bufInit(&word);
+        if (!expandInto(&word, arg + pos, end - pos) || !bufAppend(&word, "", 0))
+        {
+            bufFree(&word);
+            return false;
+        }
+        copy = (char*) malloc(n + 1);
+        if (copy == NULL)
+        {
+            bufFree(&word);
+            return false;
+        }
+        /* Try the candidate lengths in the order that makes the first match the answer */
+        for (size_t k = 0; k <= n; ++k)
+        {
+            size_t len = longest ? n - k : k;
+            if (prefix)
+            {
+                memcpy(copy, val, len);
+                copy[len] = '\0';
+            }
+            else
+                memcpy(copy, val + n - len, len + 1);
+            if (fnmatch(word.data, copy, 0) == 0)
+            {
+                cut = len;
+                break;
+            }
+        }
+        if (n > 0)
+            ok = bufAppend(out, prefix ? val + cut : val, n - cut);
+        free(copy);
+        bufFree(&word);
+        return ok;
+    }
+    fprintf(stderr, "evalArg: bad substitution '${%.*s}'\n", end - start, arg + start);
+    return false;
+}
+
+/*
+  Expand the arithmetic expression at arg[start..end) into out
+  Constants and substitutions in it are expanded first. Without any $ the
+  text is evaluated where it is, without copying it
+*/
+static bool expandArith(Buffer *out, char *arg, int start, int end)
+{
+    char num[24];
+    long long v = 0;
+    Buffer expr;
+    bool ok = true;
+    if (memchr(arg + start, '$', end - start) == NULL)
+        ok = arithEval(arg + start, end - start, &v);
+    else
+    {
+        bufInit(&expr);
+        ok = expandInto(&expr, arg + start, end - start) && arithEval(expr.data, expr.len, &v);
+        bufFree(&expr);
+    }
+    if (!ok)
+        return false;
+    sprintf(num, "%lld", v);
+    return bufAppendStr(out, num);
+}
+
+/*
+  Expand arg[0..end) into out in one left to right pass: the text between
+  expansions is copied in whole runs, and keys are looked up in place
+*/
+static bool expandInto(Buffer *out, char *arg, int end)
+{
+    char num[24];
+    const char *val = NULL;
+    int pos1 = 0; /* Start of the text not yet copied to the result */
     int i = 0;
-    char key[BUFF_MAX] = "";
-    char *val = NULL;
-    char temp[BUFF_MAX] = "";
-    temp[0] = '\0';
-    while (pos1 < pos2)
+    int j = 0;
+    int k = 0;
+    while (i < end)
     {
-        while (i < pos2 && arg[i] != '$')
-            ++i;
-        if (i == pos2) /* No $ in arg */
+        i = scanFind(arg, i, end - 1, SCAN_DOLLAR);
+        if (i >= end) /* No more $ in arg */
             break;
-        /* Else found a $ */
-        keyPos1 = keyPos2 = i + 1;
-        while (keyPos2 <= pos2 && isalnum(arg[keyPos2])) /* Read key until we hit a non-alnum character or end of string */
-            ++keyPos2;
-        if (keyPos2 - keyPos1 > BUFF_MAX - 1)
-        {
-            fprintf(stderr, "evalArg: key length exceeds BUFF_MAX\n");
-            return arg;
-        }
-        strncpy(key, arg + keyPos1, keyPos2 - keyPos1);
-        key[keyPos2 - keyPos1] = '\0';
-        val = getConst(key);
-        strncpy(temp + pos1, arg + pos1, i - pos1);
-        temp[i] = '\0';
-        strcat(temp, val);
-        pos1 = i = keyPos2;
-    }
-    if (pos1 < pos2)
-        strcat(temp, arg + pos1); /* Add the remainder of the arg */
-    strcpy(arg, temp);
-    return arg;
+        bufAppend(out, arg + pos1, i - pos1);
+        if (i + 1 < end && arg[i + 1] == '(') /* Command substitution or arithmetic expansion */
+        {
+            j = i + 1;
+            if (!matchParen(arg, &j, end - 1))
+            {
+                fprintf(stderr, "evalArg: unterminated command substitution\n");
+                return false;
+            }
+            k = i + 2;
+            if (arg[k] == '(' && matchParen(arg, &k, j) && k == j - 1) /* $(( EXPR )) rather than $( (...) ... ) */
+            {
+                if (!expandArith(out, arg, i + 3, k))
+                    return false;
+            }
+            else
+            {
+                arg[j] = '\0'; /* Temporarily terminate the inner expression */
+                captureExpr(arg + i + 2, out);
+                arg[j] = ')';
+            }
+            pos1 = i = j + 1;
+            continue;
+        }
+        if (i + 1 < end && arg[i + 1] == '{') /* ${...}, find the closing brace, skipping nested ones */
+        {
+            unsigned int depth = 1;
+            j = i + 1;
+            while (depth > 0)
+            {
+                j = scanFind(arg, j + 1, end - 1, SCAN_BRACE);
+                if (j >= end)
+                {
+                    fprintf(stderr, "evalArg: unterminated ${\n");
+                    return false;
+                }
+                depth += arg[j] == '{' ? 1 : -1;
+            }
+            if (!expandBraced(out, arg, i + 2, j))
+                return false;
+            pos1 = i = j + 1;
+            continue;
+        }
+        /* Else expand a constant */
+        j = i + 1;
+        if (j < end && arg[j] == '?')
+            ++j;
+        else
+        {
+            while (j < end && isNameChar(arg[j])) /* Read key until we hit a non-alnum character or end of string */
+                ++j;
+        }
+        if (j == i + 1) /* Lone $, keep it */
+        {
+            pos1 = i;
+            ++i;
+            continue;
+        }
+        val = lookupConst(arg + i + 1, j - i - 1, num);
+        if (val != NULL)
+            bufAppendStr(out, val);
+        pos1 = i = j;
+    }
+    return bufAppend(out, arg + pos1, end - pos1); /* Add the remainder of the arg */
 }
 
-/* Evaluate the command and run the executable */
-int evalCmd(int in, int out, char* s)
+/*
+  Evaluate the argument
+  Expands $NAME, ${...}, $? and $((arithmetic)) and substitutes the output of
+  any $(expr) in a single left to right pass
+  Returns a newly allocated string holding the result or NULL on failure
+*/
+char* evalArg(char *arg)
 {
-    char cmd[BUFF_MAX]; /* Command name */
-    char *argv[MAX_ARGS]; /* Argument list */
-    char *redirs[MAX_ARGS]; /* List of redirection operators */
-    char *filenames[MAX_ARGS]; /* List of filenames associated with redirection operators */
-    char exec[BUFF_MAX]; /* Path to executable associated with command name */
-    unsigned int numArgs;
-    unsigned int numRedirs;
-    unsigned int numFilenames;
-    bool isBg; /* Was a & passed to indicate a background process */
-    bool ok;
-    int fd; /* File descriptor returned by open */
+    Buffer temp;
+    bufInit(&temp);
+    if (!expandInto(&temp, arg, strlen(arg)))
+    {
+        bufFree(&temp);
+        return NULL;
+    }
+    return bufRelease(&temp);
+}
+
+/*
+  Check if the expression is a single command naming a builtin that is safe to
+  run in-process (no operators, braces or pipes)
+*/
+static bool isPureBuiltin(char *expr)
+{
+    char s[BUFF_MAX];
+    char op[BUFF_MAX];
+    char e[BUFF_MAX];
+    char inv[BUFF_MAX];
+    char *cmds[MAX_ARGS];
+    char name[BUFF_MAX];
+    unsigned int numCmds = 0;
+    unsigned int numPipes = 0;
+    const Builtin *b = NULL;
+    int end = 0;
+    if (strlen(expr) > BUFF_MAX - 1)
+        return false;
+    if (!parseExpr(expr, s, op, e) || strlen(op) != 0)
+        return false;
+    if (!parseS(s, e, inv) || strlen(inv) == 0)
+        return false;
+    if (!parseInvoke(inv, cmds, &numCmds, &numPipes))
+        return false;
+    for (unsigned int i = 0; i < numCmds; ++i)
+        free(cmds[i]);
+    if (numPipes != 0)
+        return false;
+    end = skipToken(inv, 0, strlen(inv) - 1);
+    strncpy(name, inv, end);
+    name[end] = '\0';
+    b = getBuiltin(name);
+    return b != NULL && b->pure;
+}
+
+/*
+  Evaluate the expression with its standard output appended to out, as for $(expr)
+  Trailing newlines are removed from the captured text
+  A lone output-only builtin writes straight into out without forking. Anything
+  else is run in a subshell whose stdout is a pipe read back by the shell
+  Returns the exit code of the expression
+*/
+int captureExpr(char *expr, Buffer *out)
+{
+    size_t start = out->len; /* Trailing newline trimming must not reach text before the capture */
+    int fd[2];
+    int status = 0;
+    ssize_t n = 0;
     pid_t pid;
-    ok = parseCmd(s, MAX_ARGS, cmd, argv, redirs, filenames, &numArgs, &numRedirs, &numFilenames, &isBg);
-    if (!ok) /* Failed to parse */
-        return 1;
-    if (numRedirs != numFilenames)
+    if (isPureBuiltin(expr))
     {
-        fprintf(stderr, "evalCmd: expected filename after \'%s\'\n", redirs[numRedirs - 1]);
-        /* Clean up */
-        for (unsigned int i = 0; i < numArgs; ++i)
-            free(argv[i]);
-        for (unsigned int i = 0; i < numRedirs; ++i)
-            free(redirs[i]);
-        for (unsigned int i = 0; i < numFilenames; ++i)
-            free(filenames[i]);
-        return 1;
+        Buffer *prev = setCapture(out);
+        status = evalCmd(0, CAPTURE_FD, expr, NULL);
+        setCapture(prev);
     }
-    if (strcmp(cmd, "cd") == 0) /* Special case for cd */
+    else
+    {
+        if (pipe(fd) == -1)
+        {
+            fprintf(stderr, "captureExpr: failed to create pipe\n");
+            return 1;
+        }
+        fflush(stdout); /* Don't let the subshell inherit pending output */
+        fflush(stderr);
+        pid = fork();
+        if (pid == -1)
+        {
+            fprintf(stderr, "captureExpr: failed to fork\n");
+            close(fd[0]);
+            close(fd[1]);
+            return 1;
+        }
+        if (pid == 0) /* Subshell */
+        {
+            jobsReset();
+            close(fd[0]);
+            dup2(fd[1], 1);
+            close(fd[1]);
+            status = evalExpr(expr);
+            fflush(stdout);
+            _exit(status); /* exit() would seek the shared stdin back to what this copy of the shell has read */
+        }
+        close(fd[1]);
+        while (bufReserve(out, BUFF_MAX))
+        {
+            n = read(fd[0], out->data + out->len, out->cap - out->len - 1);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            out->len += n;
+        }
+        out->data[out->len] = '\0';
+        close(fd[0]);
+        if (waitpid(pid, &status, 0) == -1)
+            status = 1;
+        else
+            status = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+    }
+    while (out->len > start && out->data[out->len - 1] == '\n')
+        --out->len;
+    if (out->data != NULL)
+        out->data[out->len] = '\0';
+    return status;
+}
+
+/*
+  Set up the job of a command about to fork: a new one unless the command is
+  a pipeline stage, with the deadline of the first stage or the TIMEOUT
+  constant
+*/
+static void beginJob(pid_t *pid, bool isBg, const Deadline *deadline)
+{
+    Deadline d = *deadline;
+    if (pid == NULL)
+        jobsNewGroup(!isBg);
+    else if (!placeIsFirst()) /* The job's process group is already set */
+        return;
+    if (d.ns == 0)
+        timeoutDefault(&d);
+    jobsSetDeadline(&d);
+}
+
+/*
+  Run a parsed command, freeing its argument, redirection and filename lists
+  in, out, s, pid: As for evalCmd
+  place: CPUs and scheduling asked for with a place prefix
+  deadline: Deadline asked for with a timeout prefix, 0 ns for none
+*/
+static int runCmd(int in, int out, char *s, pid_t *pid, char *cmd, char **argv, unsigned int numArgs, char **redirs, char **filenames, unsigned int numRedirs, bool isBg, const Placement *place, const Deadline *deadline)
+{
+    char exec[BUFF_MAX]; /* Path to executable associated with command name */
+    unsigned int numFilenames = numRedirs;
+    bool ok;
+    int cached[MAX_ARGS]; /* Cached append descriptors of the redirections */
+    pid_t child;
+    redirPrepare(redirs, filenames, numRedirs, cached);
+    if (isBuiltin(cmd)) /* Run builtins in the shell process */
     {
         int retVal = 0;
-        if (numArgs != 2)
+        /*
+          A pipeline stage must not hold up the other stages, a timed builtin
+          must be killable and a placed one must not move the shell, run them
+          in a subshell
+        */
+        if (pid != NULL || deadline->ns > 0 || !placeIsEmpty(place))
         {
-            fprintf(stderr, "cd: invalid number of arguments\n");
-            retVal = 1;
+            beginJob(pid, isBg, deadline);
+            fflush(stdout);
+            child = fork();
+            if (child == 0)
+            {
+                jobsChild();
+                if (!placeChild(place))
+                    _exit(126);
+                if (in != 0)
+                {
+                    dup2(in, 0);
+                    close(in);
+                }
+                if (out != 1)
+                {
+                    dup2(out, 1);
+                    close(out);
+                }
+                if (!redirApply(redirs, filenames, numRedirs, cached, NULL))
+                    _exit(1);
+                retVal = runBuiltin(numArgs, argv, 0, 1);
+                fflush(stdout);
+                _exit(retVal);
+            }
+            if (child == -1)
+            {
+                fprintf(stderr, "evalCmd: failed to fork\n");
+                retVal = 1;
+            }
+            else
+            {
+                jobsForked(child);
+                placeForked();
+                if (pid != NULL)
+                    *pid = child;
+                else
+                {
+                    int id = jobsAdd(&child, 1, s, isBg);
+                    retVal = isBg ? 0 : jobsWait(id);
+                }
+            }
         }
-        else if (chdir(argv[1]) == -1)
+        else if (numRedirs > 0) /* Point the shell's own descriptors at the files while the builtin runs */
         {
-            fprintf(stderr, "cd: failed to change directory\n");
-            retVal = 1;
+            RedirSaved saved;
+            saved.n = 0;
+            if (redirApply(redirs, filenames, numRedirs, cached, &saved))
+                retVal = runBuiltin(numArgs, argv, redirHas(redirs, numRedirs, 0) ? 0 : in, redirHas(redirs, numRedirs, 1) ? 1 : out);
+            else
+                retVal = 1;
+            redirRestore(&saved);
         }
+        else
+            retVal = runBuiltin(numArgs, argv, in, out);
         /* Clean up */
         for (unsigned int i = 0; i < numArgs; ++i)
             free(argv[i]);
@@ -716,8 +1296,6 @@ int evalCmd(int in, int out, char* s)
             free(filenames[i]);
         return retVal;
     }
-    if (strcmp(cmd, "exit") == 0) /* Special case for exit */
-        exit(0); /* Just quit */
     ok = getExecPath(cmd, exec);
     if (!ok) /* Failed to get valid path to executable */
     {
@@ -731,71 +1309,15 @@ int evalCmd(int in, int out, char* s)
             free(filenames[i]);
         return 1;
     }
-    pid = fork();
-    if (pid == 0) /* Child process */
+    beginJob(pid, isBg, deadline);
+    fflush(stdout);
+    child = fork();
+    if (child == 0) /* Child process */
     {
-        for (unsigned int i = 0; i < numRedirs; ++i)
-        {
-            if (strcmp(redirs[i], "<") == 0) /* Input redirection */
-            {
-                fd = open(filenames[i], O_RDONLY);
-                if (fd == -1)
-                {
-                    
-                    fprintf(stderr, "evalCmd: could not open file \'%s\' for reading\n", filenames[i]);
-                    dup2(fd, 0);
-                    close(fd);
-                    for (unsigned int i = 0; i < numArgs; ++i)
-                        free(argv[i]);
-                    for (unsigned int i = 0; i < numRedirs; ++i)
-                        free(redirs[i]);
-                    for (unsigned int i = 0; i < numFilenames; ++i)
-                        free(filenames[i]);
-                    return 1;
-                }
-                dup2(fd, 0);
-                close(fd);
-            }
-            if (strcmp(redirs[i], ">") == 0) /* Output redirection */
-            {
-                fd = open(filenames[i], O_WRONLY | O_CREAT, 0666);
-                if (fd == -1)
-                {
-                    fprintf(stderr, "evalCmd: could not open file \'%s\' for writing\n", filenames[i]);
-                    dup2(fd, 1);
-                    close(fd);
-                    for (unsigned int i = 0; i < numArgs; ++i)
-                        free(argv[i]);
-                    for (unsigned int i = 0; i < numRedirs; ++i)
-                        free(redirs[i]);
-                    for (unsigned int i = 0; i < numFilenames; ++i)
-                        free(filenames[i]);
-                    return 1;
-                }
-                dup2(fd, 1);
-                close(fd);
-            }
-            if (strcmp(redirs[i], ">>") == 0) /* Output with append */
-            {
-                fd = open(filenames[i], O_WRONLY | O_APPEND | O_CREAT, 0666);
-                if (fd == -1)
-                {
-                    fprintf(stderr, "evalCmd: could not open file \'%s\' for writing\n", filenames[i]);
-                    dup2(fd, 1);
-                    close(fd);
-                    for (unsigned int i = 0; i < numArgs; ++i)
-                        free(argv[i]);
-                    for (unsigned int i = 0; i < numRedirs; ++i)
-                        free(redirs[i]);
-                    for (unsigned int i = 0; i < numFilenames; ++i)
-                        free(filenames[i]);
-                    return 1;
-                }
-                dup2(fd, 1);
-                close(fd);
-            }
-        }
-        /* Deal with specified piping */
+        jobsChild();
+        if (!placeChild(place))
+            _exit(126); /* Found but could not be run as asked */
+        /* Deal with specified piping, then the redirections which take precedence */
         if (in != 0) /* in is not stdin */
         {
             dup2(in, 0); /* Use it as stdin */
@@ -806,10 +1328,14 @@ int evalCmd(int in, int out, char* s)
             dup2(out, 1); /* Use it as stdout */
             close(out);
         }
-        execvp(exec, argv);
+        if (!redirApply(redirs, filenames, numRedirs, cached, NULL))
+            _exit(1);
+        execvpe(exec, argv, envGet());
+        fprintf(stderr, "evalCmd: failed to execute \'%s\'\n", exec);
+        _exit(127); /* Never fall back into the shell loop from the child */
     }
     /* Parent process */
-    pid_t r = 0;
+    int id = 0;
     /* Clean up */
     for (unsigned int i = 0; i < numArgs; ++i)
         free(argv[i]);
@@ -817,37 +1343,180 @@ int evalCmd(int in, int out, char* s)
         free(redirs[i]);
     for (unsigned int i = 0; i < numFilenames; ++i)
         free(filenames[i]);
+    if (child == -1)
+    {
+        fprintf(stderr, "evalCmd: failed to fork\n");
+        return 1;
+    }
+    jobsForked(child);
+    placeForked();
+    if (pid != NULL) /* Pipeline stage, the caller makes the job once every stage is running */
+    {
+        *pid = child;
+        return 0;
+    }
+    id = jobsAdd(&child, 1, s, isBg);
     if (isBg) /* Don't wait for background process */
         return 0;
-    r = waitpid(pid, 0, 0);
-    if (r == -1)
+    return jobsWait(id);
+}
+
+/*
+  Evaluate the command and run the executable
+  in, out: File descriptors to use as stdin and stdout
+  s: The command to evaluate
+  pid: If not NULL, the command is a pipeline stage. The child is not waited for
+  and its pid is stored here instead (0 if no child needs waiting for)
+*/
+int evalCmd(int in, int out, char* s, pid_t *pid)
+{
+    char cmd[BUFF_MAX]; /* Command name */
+    char *argv[MAX_ARGS]; /* Argument list */
+    char *redirs[MAX_ARGS]; /* List of redirection operators */
+    char *filenames[MAX_ARGS]; /* List of filenames associated with redirection operators */
+    unsigned int numArgs;
+    unsigned int numRedirs;
+    unsigned int numFilenames;
+    bool isBg; /* Was a & passed to indicate a background process */
+    bool ok;
+    Placement place; /* CPUs and scheduling asked for with a place prefix */
+    CacheSpec cache; /* Inputs and outputs declared with a cache prefix */
+    int cacheFd = -1; /* Store file receiving the output of a command that missed the cache */
+    Deadline deadline = { 0, 0, 0 }; /* Asked for with a timeout prefix */
+    int status;
+    unsigned int skip = 0;
+    if (pid != NULL)
+        *pid = 0;
+    else
+        placeNewGroup();
+    placeClear(&place);
+    ok = parseCmd(s, MAX_ARGS, cmd, argv, redirs, filenames, &numArgs, &numRedirs, &numFilenames, &isBg);
+    if (!ok) /* Failed to parse */
         return 1;
-    return 0;
+    if (numRedirs != numFilenames)
+    {
+        fprintf(stderr, "evalCmd: expected filename after \'%s\'\n", redirs[numRedirs - 1]);
+        /* Clean up */
+        for (unsigned int i = 0; i < numArgs; ++i)
+            free(argv[i]);
+        for (unsigned int i = 0; i < numRedirs; ++i)
+            free(redirs[i]);
+        for (unsigned int i = 0; i < numFilenames; ++i)
+            free(filenames[i]);
+        return 1;
+    }
+    if (strcmp(cmd, "cache") == 0) /* Cache prefix, replay the rest of the arguments if they ran before */
+    {
+        if (!cacheParse(argv, numArgs, &cache, &skip))
+        {
+            /* Clean up */
+            for (unsigned int i = 0; i < numArgs; ++i)
+                free(argv[i]);
+            for (unsigned int i = 0; i < numRedirs; ++i)
+                free(redirs[i]);
+            for (unsigned int i = 0; i < numFilenames; ++i)
+                free(filenames[i]);
+            return 1;
+        }
+        /* Pipeline stages and background jobs don't finish here, they always run */
+        if (pid == NULL && !isBg && cacheLookup(&cache, argv + skip, numArgs - skip, redirs, filenames, numRedirs, out, &status))
+        {
+            /* Clean up */
+            for (unsigned int i = 0; i < numArgs; ++i)
+                free(argv[i]);
+            for (unsigned int i = 0; i < numRedirs; ++i)
+                free(redirs[i]);
+            for (unsigned int i = 0; i < numFilenames; ++i)
+                free(filenames[i]);
+            cacheClear(&cache);
+            return status;
+        }
+        if (pid == NULL && !isBg)
+            cacheFd = cacheBegin(&cache);
+        for (unsigned int i = 0; i < skip; ++i)
+            free(argv[i]);
+        memmove(argv, argv + skip, (numArgs - skip + 1) * sizeof(char*));
+        numArgs -= skip;
+        strcpy(cmd, argv[0]);
+    }
+    if (strcmp(cmd, "timeout") == 0) /* Timeout prefix, give the rest of the arguments a deadline */
+    {
+        if (!timeoutParse(argv, numArgs, &deadline, &skip))
+        {
+            if (cacheFd != -1)
+                cacheAbort(&cache, cacheFd);
+            /* Clean up */
+            for (unsigned int i = 0; i < numArgs; ++i)
+                free(argv[i]);
+            for (unsigned int i = 0; i < numRedirs; ++i)
+                free(redirs[i]);
+            for (unsigned int i = 0; i < numFilenames; ++i)
+                free(filenames[i]);
+            return 1;
+        }
+        for (unsigned int i = 0; i < skip; ++i)
+            free(argv[i]);
+        memmove(argv, argv + skip, (numArgs - skip + 1) * sizeof(char*));
+        numArgs -= skip;
+        strcpy(cmd, argv[0]);
+    }
+    if (strcmp(cmd, "place") == 0) /* Placement prefix, run the rest of the arguments as the command */
+    {
+        if (!placeParse(argv, numArgs, &place, &skip))
+        {
+            if (cacheFd != -1)
+                cacheAbort(&cache, cacheFd);
+            /* Clean up */
+            for (unsigned int i = 0; i < numArgs; ++i)
+                free(argv[i]);
+            for (unsigned int i = 0; i < numRedirs; ++i)
+                free(redirs[i]);
+            for (unsigned int i = 0; i < numFilenames; ++i)
+                free(filenames[i]);
+            return 1;
+        }
+        for (unsigned int i = 0; i < skip; ++i)
+            free(argv[i]);
+        memmove(argv, argv + skip, (numArgs - skip + 1) * sizeof(char*)); /* Keep the NULL terminator */
+        numArgs -= skip;
+        strcpy(cmd, argv[0]);
+        if (placeIsFirst()) /* Placement of the first stage covers the whole pipeline */
+            placeSetGroup(&place);
+    }
+    if (cacheFd == -1)
+        return runCmd(in, out, s, pid, cmd, argv, numArgs, redirs, filenames, numRedirs, isBg, &place, &deadline);
+    status = runCmd(in, cacheFd, s, pid, cmd, argv, numArgs, redirs, filenames, numRedirs, isBg, &place, &deadline);
+    cacheFinish(&cache, cacheFd, status, out);
+    return status;
 }
 
 /* Evaluate the statement */
 int evalS(char *s)
 {
-    char e[BUFF_MAX] = "";
-    char inv[BUFF_MAX] = "";
-    bool ok = parseS(s, e, inv);
-    if (!ok)
+    size_t len = strlen(s);
+    char *e = (char*) malloc(2 * (len + 1)); /* Parts are never longer than the statement */
+    char *inv = e + len + 1;
+    int r;
+    if (e == NULL)
+    {
+        fprintf(stderr, "evalS: out of memory\n");
         return 1;
-    if (strlen(inv) == 0) /* Statement is a braced expression */
-        return evalExpr(e);
-    /* Else statement is an invocation */
-    return evalInvoke(inv);
+    }
+    if (!parseS(s, e, inv))
+        r = 1;
+    else if (strlen(inv) == 0) /* Statement is a braced expression */
+        r = evalExpr(e);
+    else /* Else statement is an invocation */
+        r = evalInvoke(inv);
+    free(e);
+    lastStatus = r;
+    return r;
 }
 
-/* Evaluate the expression. Assume that there are no trailing whitespaces */
-int evalExpr(char *expr)
+/* Evaluate the expression using the buffers left, op and right, each as long as the expression */
+static int evalParts(char *expr, char *left, char *op, char *right)
 {
-    char left[BUFF_MAX];
-    char op[BUFF_MAX];
-    char right[BUFF_MAX];
     int l_code;
-    if (strlen(expr) == 0) /* Empty expression */
-        return 0;
     parseExpr(expr,left,op,right);
     if (strlen(op) == 0) /* No operator, just a statement */
         return evalS(expr);
@@ -859,8 +1528,11 @@ int evalExpr(char *expr)
     if (strcmp(op, "=") == 0) /* Assignment operator */
     {
         /* Left is the key, right is the val */
-        evalArg(right);
-        bool ok = addConst(left, right);
+        char *val = evalArg(right);
+        if (val == NULL)
+            return 1;
+        bool ok = addConst(left, val);
+        free(val);
         if (!ok)
             return 1;
         return 0;
@@ -890,3 +1562,22 @@ int evalExpr(char *expr)
     }
     return 0;
 }
+
+/* Evaluate the expression. Assume that there are no trailing whitespaces */
+int evalExpr(char *expr)
+{
+    size_t len = strlen(expr);
+    char *left;
+    int r;
+    if (len == 0) /* Empty expression */
+        return 0;
+    left = (char*) malloc(3 * (len + 1)); /* Parts are never longer than the expression */
+    if (left == NULL)
+    {
+        fprintf(stderr, "evalExpr: out of memory\n");
+        return 1;
+    }
+    r = evalParts(expr, left, left + len + 1, left + 2 * (len + 1));
+    free(left);
+    return r;
+}
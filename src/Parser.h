@@ -5,13 +5,20 @@
   s: {expr} / invoke
   invoke: cmd [ + | + cmd ]...
   op: && / || / ; / =
-  redir: < / > / >>
-  cmd: EXECUTABLE [+ arg]... [+ redir + FILE_NAME/DELIM] [ + &]
-  arg: $NAMED_CONSTANT / LITERAL
+  redir: [N]< / [N]> / [N]>| / [N]>> / [N]<> / [N]<& / [N]>& / &> / &>>
+  dup: [N]<&M / [N]>&M / [N]<&- / [N]>&-
+  cmd: [cache + [OPTION + ]...][timeout + [OPTION + ]...DURATION + ][place + [OPTION + ]...]EXECUTABLE [+ arg]... [+ redir + FILE_NAME/FD / + dup]... [ + &]
+  arg: $NAMED_CONSTANT / ${PARAMETER} / $? / $(expr) / $((arithmetic)) / PATTERN / LITERAL
 
   IMPORTANT: Don't forget to call init() to intialize the array of user
   defined constants and finish() to cleanup the array
 */
+#ifndef PARSER_H
+#define PARSER_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* pipe2, splice and the other Linux specific calls */
+#endif
 #include <stdbool.h>
 #include <string.h>
 #include <stdio.h>
@@ -24,28 +31,38 @@
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <limits.h>
+#include "Buffer.h"
 
 #define BUFF_MAX 1024 /* Maximum number of characters in the character buffer */
 #define INVALID_POS -1
 #define INIT_CONSTS 8 /* Initial number of constants to allocate memory for */
 #define MAX_ARGS 1024 /* Maximum number of arguments in argv */
 
+extern char ***consts; /* User defined constants, see Parser.c */
+extern unsigned int numConsts;
+extern bool *exported;
+extern int lastStatus;
+
 void init();
 void finish();
 bool addConst(char*, char*);
 char* getConst(char*);
-bool isOp(char*);
-bool isPipe(char*);
+bool exportConst(char*);
 bool isRedir(char*);
 bool matchBrace(char*, int*, const unsigned int);
 bool matchQuote(char*, int*, const unsigned int);
+bool matchParen(char*, int*, const unsigned int);
+int skipToken(char*, int, const int);
 bool parseExpr(char*, char*, char*, char*);
 bool parseCmd(char*, const unsigned int, char*, char**, char**, char**, unsigned int*, unsigned int*, unsigned int*, bool*);
 bool parseInvoke(char*, char**, unsigned int*, unsigned int*);
 bool parseS(char*, char*, char*);
 char* evalArg(char*);
 bool getExecPath(char*, char*);
-int evalCmd(int, int, char*);
+int evalCmd(int, int, char*, pid_t*);
 int evalInvoke(char*);
 int evalS(char*);
 int evalExpr(char*);
+int captureExpr(char*, Buffer*);
+
+#endif
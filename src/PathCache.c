@@ -0,0 +1,358 @@
+/*
+  Prefix trie of the executables in PATH
+
+  The trie is built from one scan of every PATH directory and is only rebuilt
+  when PATH changes or, when completing, when one of the directories has been
+  modified since the scan. Nodes live in one flat array and refer to each
+  other by index so the whole trie can be copied or saved as a block
+*/
+#include "Parser.h"
+#include "PathCache.h"
+#include "DirScan.h"
+
+static TrieNode *nodes = NULL;
+static uint32_t numNodes = 0;
+static uint32_t maxNodes = 0;
+static char *pathValue = NULL; /* Value of PATH the trie was built from */
+static char **dirs = NULL; /* The directories of pathValue */
+static struct timespec *mtimes = NULL; /* Modification time of each directory when it was scanned */
+static unsigned int numDirs = 0;
+static char *builtCwd = NULL; /* Working directory at build time if PATH has relative directories */
+
+/* Release the trie */
+void pathFree()
+{
+    for (unsigned int i = 0; i < numDirs; ++i)
+        free(dirs[i]);
+    free(dirs);
+    free(mtimes);
+    free(nodes);
+    free(pathValue);
+    free(builtCwd);
+    dirs = NULL;
+    mtimes = NULL;
+    nodes = NULL;
+    pathValue = NULL;
+    builtCwd = NULL;
+    numDirs = 0;
+    numNodes = 0;
+    maxNodes = 0;
+}
+
+/* Allocate a node for character c. Returns 0 on failure */
+static uint32_t newNode(uint32_t c)
+{
+    if (numNodes == maxNodes)
+    {
+        uint32_t max = maxNodes == 0 ? INIT_NODES : maxNodes * 2;
+        TrieNode *grown = (TrieNode*) realloc(nodes, max * sizeof(TrieNode));
+        if (grown == NULL)
+            return 0;
+        nodes = grown;
+        maxNodes = max;
+    }
+    nodes[numNodes].child = 0;
+    nodes[numNodes].next = 0;
+    nodes[numNodes].dir = 0;
+    nodes[numNodes].c = c;
+    return numNodes++;
+}
+
+/* Find the child of node for character c, creating it if asked to */
+static uint32_t getChild(uint32_t node, unsigned char c, bool create)
+{
+    uint32_t prev = 0;
+    uint32_t cur = nodes[node].child;
+    uint32_t n = 0;
+    while (cur != 0 && nodes[cur].c < c)
+    {
+        prev = cur;
+        cur = nodes[cur].next;
+    }
+    if (cur != 0 && nodes[cur].c == c)
+        return cur;
+    if (!create)
+        return 0;
+    n = newNode(c); /* May move the array, so only use indexes from here on */
+    if (n == 0)
+        return 0;
+    nodes[n].next = cur;
+    if (prev == 0)
+        nodes[node].child = n;
+    else
+        nodes[prev].next = n;
+    return n;
+}
+
+/* Add a command found in directory number dir. The first directory in PATH wins */
+static void insert(const char *name, uint32_t dir)
+{
+    uint32_t node = 0;
+    for (const char *p = name; *p != '\0'; ++p)
+    {
+        node = getChild(node, (unsigned char) *p, true);
+        if (node == 0)
+            return;
+    }
+    if (nodes[node].dir == 0)
+        nodes[node].dir = dir + 1;
+}
+
+/* Check if the trie no longer matches PATH (and the directory contents if checkMtimes) */
+static bool isStale(bool checkMtimes)
+{
+    char cwd[PATH_MAX];
+    struct stat st;
+    if (pathValue == NULL || strcmp(pathValue, consts[0][1]) != 0)
+        return true;
+    if (builtCwd != NULL && (getcwd(cwd, sizeof(cwd)) == NULL || strcmp(cwd, builtCwd) != 0))
+        return true;
+    if (!checkMtimes)
+        return false;
+    for (unsigned int i = 0; i < numDirs; ++i)
+    {
+        if (stat(dirs[i], &st) == -1)
+        {
+            if (mtimes[i].tv_sec != 0 || mtimes[i].tv_nsec != 0)
+                return true;
+            continue;
+        }
+        if (st.st_mtim.tv_sec != mtimes[i].tv_sec || st.st_mtim.tv_nsec != mtimes[i].tv_nsec)
+            return true;
+    }
+    return false;
+}
+
+/* Scan every directory in PATH and rebuild the trie */
+bool pathRebuild()
+{
+    char path[BUFF_MAX];
+    char cwd[PATH_MAX];
+    char *tok = NULL;
+    char *save = NULL;
+    const char *name = NULL;
+    unsigned char type;
+    struct stat st;
+    DirScan d;
+    unsigned int maxDirs = 0;
+    pathFree();
+    strcpy(path, consts[0][1]); /* Get the current PATH value */
+    pathValue = strdup(path);
+    if (newNode(0) != 0 || numNodes != 1) /* Root */
+        return false;
+    for (tok = strtok_r(path, ":", &save); tok != NULL; tok = strtok_r(NULL, ":", &save))
+    {
+        if (numDirs == maxDirs)
+        {
+            maxDirs = maxDirs == 0 ? 8 : maxDirs * 2;
+            dirs = (char**) realloc(dirs, maxDirs * sizeof(char*));
+            mtimes = (struct timespec*) realloc(mtimes, maxDirs * sizeof(struct timespec));
+        }
+        if (tok[0] != '/' && builtCwd == NULL && getcwd(cwd, sizeof(cwd)) != NULL)
+            builtCwd = strdup(cwd);
+        dirs[numDirs] = strdup(tok);
+        mtimes[numDirs].tv_sec = 0;
+        mtimes[numDirs].tv_nsec = 0;
+        if (stat(tok, &st) == 0)
+            mtimes[numDirs] = st.st_mtim;
+        if (dirOpen(&d, tok))
+        {
+            while (dirNext(&d, &name, &type))
+            {
+                if (type != DT_DIR)
+                    insert(name, numDirs);
+            }
+            dirClose(&d);
+        }
+        ++numDirs;
+    }
+    return true;
+}
+
+/*
+  Find the directory holding cmd using the trie and store the full path in
+  execPath (BUFF_MAX characters). The trie is only used if it has already been
+  built for the current PATH; a miss means the caller should search PATH itself
+*/
+bool pathLookup(const char *cmd, char *execPath)
+{
+    uint32_t node = 0;
+    if (numNodes == 0 || isStale(false))
+        return false;
+    for (const char *p = cmd; *p != '\0'; ++p)
+    {
+        node = getChild(node, (unsigned char) *p, false);
+        if (node == 0)
+            return false;
+    }
+    if (nodes[node].dir == 0)
+        return false;
+    return snprintf(execPath, BUFF_MAX, "%s/%s", dirs[nodes[node].dir - 1], cmd) < BUFF_MAX;
+}
+
+/* Append every command below node to list, name holding the characters on the way to it */
+static void collect(uint32_t node, char *name, size_t len, char ***list, size_t *n, size_t *max)
+{
+    if (len >= BUFF_MAX - 1)
+        return;
+    if (nodes[node].dir != 0)
+    {
+        if (*n == *max)
+        {
+            *max = *max == 0 ? 16 : *max * 2;
+            *list = (char**) realloc(*list, *max * sizeof(char*));
+        }
+        name[len] = '\0';
+        (*list)[(*n)++] = strdup(name);
+    }
+    for (uint32_t c = nodes[node].child; c != 0; c = nodes[c].next)
+    {
+        name[len] = (char) nodes[c].c;
+        collect(c, name, len + 1, list, n, max);
+    }
+}
+
+/*
+  List every command in PATH starting with prefix in sorted order
+  Rebuilds the trie first if PATH or one of its directories changed
+  Returns an allocated array of allocated strings and stores its size in n
+*/
+char** pathComplete(const char *prefix, size_t *n)
+{
+    char name[BUFF_MAX];
+    char **list = NULL;
+    size_t max = 0;
+    uint32_t node = 0;
+    size_t len = strlen(prefix);
+    *n = 0;
+    if ((numNodes == 0 || isStale(true)) && !pathRebuild())
+        return NULL;
+    if (len >= BUFF_MAX)
+        return NULL;
+    for (size_t i = 0; i < len; ++i)
+    {
+        node = getChild(node, (unsigned char) prefix[i], false);
+        if (node == 0)
+            return NULL;
+    }
+    strcpy(name, prefix);
+    collect(node, name, len, &list, n, &max);
+    return list;
+}
+
+/*
+  Append the trie to buf so it can be restored with pathLoad, building it first
+  if it is missing or out of date
+  Layout: uint32 numNodes, uint32 numDirs, the nodes, the directory mtimes as
+  int64 pairs, then the null terminated PATH value, build directory and PATH
+  directories
+*/
+bool pathSave(Buffer *buf)
+{
+    uint32_t counts[2];
+    int64_t t[2];
+    if ((numNodes == 0 || isStale(true)) && !pathRebuild())
+        return false;
+    counts[0] = numNodes;
+    counts[1] = numDirs;
+    if (!bufAppend(buf, (const char*) counts, sizeof(counts))
+        || !bufAppend(buf, (const char*) nodes, numNodes * sizeof(TrieNode)))
+        return false;
+    for (unsigned int i = 0; i < numDirs; ++i)
+    {
+        t[0] = mtimes[i].tv_sec;
+        t[1] = mtimes[i].tv_nsec;
+        if (!bufAppend(buf, (const char*) t, sizeof(t)))
+            return false;
+    }
+    if (!bufAppend(buf, pathValue, strlen(pathValue) + 1)
+        || !bufAppend(buf, builtCwd == NULL ? "" : builtCwd, builtCwd == NULL ? 1 : strlen(builtCwd) + 1))
+        return false;
+    for (unsigned int i = 0; i < numDirs; ++i)
+    {
+        if (!bufAppend(buf, dirs[i], strlen(dirs[i]) + 1))
+            return false;
+    }
+    return true;
+}
+
+/* Read a null terminated string at p that must end before end. Returns NULL if it doesn't */
+static const char* readStr(const char *p, const char *end)
+{
+    const char *z = (const char*) memchr(p, '\0', end - p);
+    return z == NULL ? NULL : z + 1;
+}
+
+/*
+  Replace the trie with one written by pathSave, stored in the len bytes at p
+  The data does not need to be aligned. Returns false if it is malformed
+*/
+bool pathLoad(const char *p, size_t len)
+{
+    const char *end = p + len;
+    const char *next = NULL;
+    uint32_t counts[2];
+    int64_t t[2];
+    pathFree();
+    if (len < sizeof(counts))
+        return false;
+    memcpy(counts, p, sizeof(counts));
+    p += sizeof(counts);
+    if (counts[0] == 0 || (size_t) (end - p) / sizeof(TrieNode) < counts[0])
+        return false;
+    nodes = (TrieNode*) malloc(counts[0] * sizeof(TrieNode));
+    if (nodes == NULL)
+        return false;
+    memcpy(nodes, p, counts[0] * sizeof(TrieNode));
+    numNodes = maxNodes = counts[0];
+    p += counts[0] * sizeof(TrieNode);
+    if ((size_t) (end - p) / sizeof(t) < counts[1])
+    {
+        pathFree();
+        return false;
+    }
+    dirs = (char**) calloc(counts[1] + 1, sizeof(char*));
+    mtimes = (struct timespec*) malloc((counts[1] + 1) * sizeof(struct timespec));
+    for (unsigned int i = 0; i < counts[1]; ++i)
+    {
+        memcpy(t, p, sizeof(t));
+        mtimes[i].tv_sec = t[0];
+        mtimes[i].tv_nsec = t[1];
+        p += sizeof(t);
+    }
+    if ((next = readStr(p, end)) == NULL)
+    {
+        pathFree();
+        return false;
+    }
+    pathValue = strdup(p);
+    p = next;
+    if ((next = readStr(p, end)) == NULL)
+    {
+        pathFree();
+        return false;
+    }
+    if (*p != '\0')
+        builtCwd = strdup(p);
+    p = next;
+    for (; numDirs < counts[1]; ++numDirs)
+    {
+        if ((next = readStr(p, end)) == NULL)
+        {
+            pathFree();
+            return false;
+        }
+        dirs[numDirs] = strdup(p);
+        p = next;
+    }
+    /* Every node must point inside the array for lookups to be safe */
+    for (uint32_t i = 0; i < numNodes; ++i)
+    {
+        if (nodes[i].child >= numNodes || nodes[i].next >= numNodes || nodes[i].dir > numDirs)
+        {
+            pathFree();
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,30 @@
+/*
+  Cache of the executables found in the PATH directories, stored as a prefix
+  trie so command names can be completed and resolved without walking PATH
+*/
+#ifndef PATHCACHE_H
+#define PATHCACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "Buffer.h"
+
+#define INIT_NODES 1024 /* Initial number of trie nodes to allocate */
+
+typedef struct
+{
+    uint32_t child; /* First child, 0 if none (the root is never a child) */
+    uint32_t next; /* Next sibling, 0 if none. Siblings are kept in character order */
+    uint32_t dir; /* 1 + index of the PATH directory holding the command that ends here, 0 if none */
+    uint32_t c; /* Character on the edge leading to this node */
+} TrieNode;
+
+bool pathRebuild();
+bool pathLookup(const char*, char*);
+char** pathComplete(const char*, size_t*);
+void pathFree();
+bool pathSave(Buffer*);
+bool pathLoad(const char*, size_t);
+
+#endif
@@ -0,0 +1,403 @@
+/*
+  CPU affinity, scheduling and NUMA placement of started commands
+*/
+#include "Parser.h"
+#include "Place.h"
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+
+typedef struct
+{
+    int cpu;
+    int package;
+    int die;
+    int cluster;
+    int core;
+} CoreInfo;
+
+static Placement group; /* Placement given to the first stage, applied to the whole pipeline */
+static unsigned int stage = 0; /* Index of the next stage forked for the pipeline */
+static int *coreOrder = NULL; /* One CPU per core, cores sharing caches next to each other */
+static unsigned int numCores = 0;
+static bool coresBuilt = false;
+
+/* Reset a placement so it changes nothing */
+void placeClear(Placement *p)
+{
+    p->hasCpus = false;
+    CPU_ZERO(&p->cpus);
+    p->node = -1;
+    p->hasNice = false;
+    p->nice = 0;
+    p->policy = -1;
+    p->priority = 0;
+    p->autoPin = false;
+}
+
+/* Check if a placement changes nothing */
+bool placeIsEmpty(const Placement *p)
+{ return !p->hasCpus && p->node == -1 && !p->hasNice && p->policy == -1 && !p->autoPin; }
+
+/* Parse a CPU list such as 0-3,8,10-11 into set. Returns false if it is malformed */
+static bool parseCpuList(const char *s, cpu_set_t *set)
+{
+    char *end = NULL;
+    long lo;
+    long hi;
+    CPU_ZERO(set);
+    while (*s != '\0' && *s != '\n')
+    {
+        lo = strtol(s, &end, 10);
+        if (end == s || lo < 0 || lo >= CPU_SETSIZE)
+            return false;
+        hi = lo;
+        s = end;
+        if (*s == '-')
+        {
+            ++s;
+            hi = strtol(s, &end, 10);
+            if (end == s || hi < lo || hi >= CPU_SETSIZE)
+                return false;
+            s = end;
+        }
+        for (long c = lo; c <= hi; ++c)
+            CPU_SET(c, set);
+        if (*s == ',')
+            ++s;
+        else if (*s != '\0' && *s != '\n')
+            return false;
+    }
+    return true;
+}
+
+/* Read the first line of a sysfs file into buf. Returns false if it can't be read */
+static bool readSys(const char *path, char *buf, size_t size)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t n;
+    if (fd == -1)
+        return false;
+    n = read(fd, buf, size - 1);
+    close(fd);
+    if (n <= 0)
+        return false;
+    buf[n] = '\0';
+    return true;
+}
+
+/* Read an integer topology attribute of cpu, -1 if the kernel doesn't report it */
+static int readTopology(int cpu, const char *name)
+{
+    char path[PATH_MAX];
+    char buf[32];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+    return readSys(path, buf, sizeof(buf)) ? atoi(buf) : -1;
+}
+
+/* Get the CPUs of a NUMA node */
+static bool nodeCpus(int node, cpu_set_t *set)
+{
+    char path[PATH_MAX];
+    char buf[BUFF_MAX];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    return readSys(path, buf, sizeof(buf)) && parseCpuList(buf, set);
+}
+
+/* Order cores by package, die, cluster and core id so that neighbours share as much cache as possible */
+static int compareCores(const void *a, const void *b)
+{
+    const CoreInfo *x = (const CoreInfo*) a;
+    const CoreInfo *y = (const CoreInfo*) b;
+    if (x->package != y->package)
+        return x->package - y->package;
+    if (x->die != y->die)
+        return x->die - y->die;
+    if (x->cluster != y->cluster)
+        return x->cluster - y->cluster;
+    if (x->core != y->core)
+        return x->core - y->core;
+    return x->cpu - y->cpu;
+}
+
+/*
+  Build the order stages are pinned in from the CPUs the shell may run on,
+  keeping only the first hardware thread of each core. Done once in the shell
+  so children don't have to walk sysfs
+*/
+static void buildCores()
+{
+    cpu_set_t allowed;
+    CoreInfo *info = NULL;
+    unsigned int n = 0;
+    coresBuilt = true;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+        return;
+    info = (CoreInfo*) malloc(CPU_COUNT(&allowed) * sizeof(CoreInfo));
+    coreOrder = (int*) malloc(CPU_COUNT(&allowed) * sizeof(int));
+    if (info == NULL || coreOrder == NULL)
+    {
+        free(info);
+        free(coreOrder);
+        coreOrder = NULL;
+        return;
+    }
+    for (int c = 0; c < CPU_SETSIZE; ++c)
+    {
+        if (!CPU_ISSET(c, &allowed))
+            continue;
+        info[n].cpu = c;
+        info[n].package = readTopology(c, "physical_package_id");
+        info[n].die = readTopology(c, "die_id");
+        info[n].cluster = readTopology(c, "cluster_id");
+        info[n].core = readTopology(c, "core_id");
+        ++n;
+    }
+    qsort(info, n, sizeof(CoreInfo), compareCores);
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        if (i > 0 && info[i].package == info[i - 1].package && info[i].die == info[i - 1].die
+            && info[i].cluster == info[i - 1].cluster && info[i].core == info[i - 1].core && info[i].core != -1)
+            continue; /* Another thread of the same core */
+        coreOrder[numCores++] = info[i].cpu;
+    }
+    free(info);
+}
+
+/* Parse a scheduling policy written as NAME[:PRIORITY] */
+static bool parsePolicy(const char *s, Placement *p)
+{
+    static const struct { const char *name; int policy; } policies[] = {
+        { "other", SCHED_OTHER },
+        { "batch", SCHED_BATCH },
+        { "idle", SCHED_IDLE },
+        { "fifo", SCHED_FIFO },
+        { "rr", SCHED_RR },
+    };
+    const char *colon = strchr(s, ':');
+    size_t len = colon == NULL ? strlen(s) : (size_t) (colon - s);
+    p->policy = -1;
+    for (unsigned int i = 0; i < sizeof(policies) / sizeof(policies[0]); ++i)
+    {
+        if (strlen(policies[i].name) == len && strncmp(s, policies[i].name, len) == 0)
+            p->policy = policies[i].policy;
+    }
+    if (p->policy == -1)
+        return false;
+    if (colon != NULL)
+        p->priority = atoi(colon + 1);
+    else if (p->policy == SCHED_FIFO || p->policy == SCHED_RR)
+        p->priority = sched_get_priority_min(p->policy);
+    else
+        p->priority = 0;
+    return true;
+}
+
+/*
+  Parse the options of a place prefix. argv[0] is "place"
+  used: Set to the index of the first word of the command being placed
+  Returns false (after printing why) if the options are invalid or there is no command
+*/
+bool placeParse(char **argv, unsigned int numArgs, Placement *p, unsigned int *used)
+{
+    unsigned int i = 1;
+    char *end = NULL;
+    placeClear(p);
+    while (i < numArgs && argv[i][0] == '-')
+    {
+        char opt = argv[i][1];
+        if (strcmp(argv[i], "--") == 0)
+        {
+            ++i;
+            break;
+        }
+        if (argv[i][2] != '\0')
+        {
+            fprintf(stderr, "place: invalid option \'%s\'\n", argv[i]);
+            return false;
+        }
+        if (opt == 'a')
+        {
+            p->autoPin = true;
+            ++i;
+            continue;
+        }
+        if (opt != 'c' && opt != 'm' && opt != 'n' && opt != 's')
+        {
+            fprintf(stderr, "place: invalid option \'%s\'\n", argv[i]);
+            return false;
+        }
+        if (i + 1 >= numArgs)
+        {
+            fprintf(stderr, "place: option \'%s\' needs a value\n", argv[i]);
+            return false;
+        }
+        if (opt == 'c')
+        {
+            if (!parseCpuList(argv[i + 1], &p->cpus) || CPU_COUNT(&p->cpus) == 0)
+            {
+                fprintf(stderr, "place: invalid CPU list \'%s\'\n", argv[i + 1]);
+                return false;
+            }
+            p->hasCpus = true;
+        }
+        else if (opt == 'm')
+        {
+            p->node = strtol(argv[i + 1], &end, 10);
+            if (*end != '\0' || end == argv[i + 1] || p->node < 0 || p->node >= PLACE_MAX_NODES)
+            {
+                fprintf(stderr, "place: invalid NUMA node \'%s\'\n", argv[i + 1]);
+                return false;
+            }
+        }
+        else if (opt == 'n')
+        {
+            p->nice = strtol(argv[i + 1], &end, 10);
+            if (*end != '\0' || end == argv[i + 1])
+            {
+                fprintf(stderr, "place: invalid nice value \'%s\'\n", argv[i + 1]);
+                return false;
+            }
+            p->hasNice = true;
+        }
+        else if (!parsePolicy(argv[i + 1], p))
+        {
+            fprintf(stderr, "place: invalid scheduling policy \'%s\'\n", argv[i + 1]);
+            return false;
+        }
+        i += 2;
+    }
+    if (i >= numArgs)
+    {
+        fprintf(stderr, "place: no command given\n");
+        return false;
+    }
+    *used = i;
+    return true;
+}
+
+/* Start placing a new command or pipeline */
+void placeNewGroup()
+{
+    placeClear(&group);
+    stage = 0;
+}
+
+/* Use p for every stage of the pipeline being started */
+void placeSetGroup(const Placement *p)
+{
+    group = *p;
+    if (group.autoPin && !coresBuilt)
+        buildCores();
+}
+
+/* Check if no stage of the pipeline has been started yet */
+bool placeIsFirst()
+{ return stage == 0; }
+
+/* Record that a stage was started, called by the shell after forking */
+void placeForked()
+{ ++stage; }
+
+/*
+  Apply the pipeline's placement, overridden by the stage's own placement p,
+  to the calling process. Called in the child before exec
+  Returns false (after printing why) if the placement could not be applied
+*/
+bool placeChild(const Placement *p)
+{
+    Placement eff = group;
+    cpu_set_t set;
+    bool hasSet = false;
+    if (p->hasCpus)
+    {
+        eff.hasCpus = true;
+        eff.cpus = p->cpus;
+        eff.autoPin = p->autoPin;
+    }
+    else if (p->autoPin)
+        eff.autoPin = true;
+    if (p->node != -1)
+        eff.node = p->node;
+    if (p->hasNice)
+    {
+        eff.hasNice = true;
+        eff.nice = p->nice;
+    }
+    if (p->policy != -1)
+    {
+        eff.policy = p->policy;
+        eff.priority = p->priority;
+    }
+    if (eff.hasCpus)
+    {
+        set = eff.cpus;
+        hasSet = true;
+    }
+    if (eff.node != -1)
+    {
+        cpu_set_t nodeSet;
+        unsigned long mask[PLACE_MAX_NODES / (8 * sizeof(unsigned long))] = { 0 };
+        if (!nodeCpus(eff.node, &nodeSet))
+        {
+            fprintf(stderr, "place: no NUMA node %d\n", eff.node);
+            return false;
+        }
+        if (hasSet)
+            CPU_AND(&set, &set, &nodeSet);
+        else
+            set = nodeSet;
+        hasSet = true;
+        mask[eff.node / (8 * sizeof(unsigned long))] = 1UL << (eff.node % (8 * sizeof(unsigned long)));
+        if (syscall(SYS_set_mempolicy, MPOL_BIND, mask, (unsigned long) PLACE_MAX_NODES) == -1)
+        {
+            fprintf(stderr, "place: failed to bind memory to NUMA node %d\n", eff.node);
+            return false;
+        }
+    }
+    if (eff.autoPin && numCores > 0) /* Take the stage's core among the allowed ones */
+    {
+        unsigned int n = 0;
+        for (unsigned int i = 0; i < numCores; ++i)
+        {
+            if (!hasSet || CPU_ISSET(coreOrder[i], &set))
+                ++n;
+        }
+        for (unsigned int i = 0, k = 0; n > 0 && i < numCores; ++i)
+        {
+            if (hasSet && !CPU_ISSET(coreOrder[i], &set))
+                continue;
+            if (k++ == stage % n)
+            {
+                CPU_ZERO(&set);
+                CPU_SET(coreOrder[i], &set);
+                hasSet = true;
+                break;
+            }
+        }
+    }
+    if (hasSet && (CPU_COUNT(&set) == 0 || sched_setaffinity(0, sizeof(set), &set) == -1))
+    {
+        fprintf(stderr, "place: failed to set the CPU affinity\n");
+        return false;
+    }
+    if (eff.policy != -1)
+    {
+        struct sched_param param;
+        param.sched_priority = eff.priority;
+        if (sched_setscheduler(0, eff.policy, &param) == -1)
+        {
+            fprintf(stderr, "place: failed to set the scheduling policy\n");
+            return false;
+        }
+    }
+    if (eff.hasNice && setpriority(PRIO_PROCESS, 0, eff.nice) == -1)
+    {
+        fprintf(stderr, "place: failed to set the nice value\n");
+        return false;
+    }
+    return true;
+}
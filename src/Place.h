@@ -0,0 +1,42 @@
+/*
+  Placement of commands on CPUs and NUMA nodes
+
+  A command line can start with the place prefix to control where the
+  processes it starts run:
+    place [-c CPUS] [-m NODE] [-n NICE] [-s POLICY[:PRIORITY]] [-a] COMMAND...
+  On the first stage of a pipeline the options apply to every stage, and a
+  later stage can add its own prefix to override them. -a pins consecutive
+  stages to neighbouring cores so data passed through the pipes stays in a
+  shared cache. Placement is applied in the child just before exec, and a
+  placed builtin runs in a subshell so the shell itself isn't moved
+*/
+#ifndef PLACE_H
+#define PLACE_H
+
+#include <stdbool.h>
+#include <sched.h>
+
+#define PLACE_MAX_NODES 1024 /* Highest NUMA node number + 1 that can be bound to */
+
+typedef struct
+{
+    bool hasCpus;
+    cpu_set_t cpus;
+    int node; /* NUMA node to take memory and CPUs from, -1 for none */
+    bool hasNice;
+    int nice;
+    int policy; /* SCHED_* policy, -1 to leave it alone */
+    int priority; /* Static priority for SCHED_FIFO and SCHED_RR */
+    bool autoPin; /* Pin each pipeline stage to its own core, neighbours next to each other */
+} Placement;
+
+void placeClear(Placement*);
+bool placeIsEmpty(const Placement*);
+bool placeParse(char**, unsigned int, Placement*, unsigned int*);
+void placeNewGroup();
+void placeSetGroup(const Placement*);
+bool placeIsFirst();
+void placeForked();
+bool placeChild(const Placement*);
+
+#endif
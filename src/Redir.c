@@ -0,0 +1,364 @@
+/*
+  Redirections and the cache of append descriptors
+*/
+#include "Parser.h"
+#include "Redir.h"
+
+typedef struct
+{
+    char *path; /* As written in the command, validated by the inode it names */
+    dev_t dev;
+    ino_t ino;
+    mode_t mode;
+    uid_t uid;
+    int fd;
+} CachedFd;
+
+static CachedFd cache[REDIR_CACHE_MAX]; /* Oldest first */
+static unsigned int numCached = 0;
+
+/*
+  Parse a redirection operator into r, which may be NULL to only check op
+  Returns false if op is not a redirection operator
+*/
+bool redirParse(const char *op, Redir *r)
+{
+    Redir tmp;
+    const char *p = op;
+    if (r == NULL)
+        r = &tmp;
+    r->fd = -1;
+    r->both = false;
+    r->hasWord = true;
+    r->target = -1;
+    if (p[0] == '&' && p[1] == '>') /* &> and &>> */
+    {
+        p += 2;
+        r->fd = 1;
+        r->both = true;
+        r->kind = REDIR_OUT;
+        if (*p == '>')
+        {
+            r->kind = REDIR_APPEND;
+            ++p;
+        }
+        return *p == '\0';
+    }
+    if (isdigit(*p))
+        r->fd = *p++ - '0';
+    if (*p == '<')
+    {
+        ++p;
+        r->kind = REDIR_IN;
+        if (*p == '>')
+            r->kind = REDIR_RDWR;
+        else if (*p == '&')
+            r->kind = REDIR_DUP;
+        if (r->kind != REDIR_IN)
+            ++p;
+        if (r->fd == -1)
+            r->fd = 0;
+    }
+    else if (*p == '>')
+    {
+        ++p;
+        r->kind = REDIR_OUT;
+        if (*p == '>')
+            r->kind = REDIR_APPEND;
+        else if (*p == '&')
+            r->kind = REDIR_DUP;
+        if (*p == '>' || *p == '&' || *p == '|') /* >| is > as there is no noclobber */
+            ++p;
+        if (r->fd == -1)
+            r->fd = 1;
+    }
+    else
+        return false;
+    if (r->kind == REDIR_DUP && *p != '\0') /* Descriptor in the same word */
+    {
+        r->hasWord = false;
+        if (p[1] != '\0')
+            return false;
+        if (*p == '-')
+            r->kind = REDIR_CLOSE;
+        else if (isdigit(*p))
+            r->target = *p - '0';
+        else
+            return false;
+        return true;
+    }
+    return *p == '\0';
+}
+
+/* Check if any of the n operators redirects fd */
+bool redirHas(char **ops, unsigned int n, int fd)
+{
+    Redir r;
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        if (redirParse(ops[i], &r) && (r.fd == fd || (r.both && fd == 2)))
+            return true;
+    }
+    return false;
+}
+
+/* Close a cached descriptor and forget it */
+static void dropCached(unsigned int i)
+{
+    close(cache[i].fd);
+    free(cache[i].path);
+    --numCached;
+    memmove(cache + i, cache + i + 1, (numCached - i) * sizeof(CachedFd));
+}
+
+/* Check if the cache is turned on, emptying it when it was turned off */
+static bool cacheOn()
+{
+    char *val = getConst("FDCACHE");
+    if (strlen(val) > 0 && strcmp(val, "0") != 0)
+        return true;
+    while (numCached > 0)
+        dropCached(numCached - 1);
+    return false;
+}
+
+/*
+  Get a descriptor appending to the regular file at path, opening and keeping
+  it if the cache doesn't hold one for the file the path names now
+  Returns -1 if the file can't be cached, the redirection then opens it itself
+*/
+static int cachedAppend(const char *path)
+{
+    struct stat st;
+    int fd;
+    int high;
+    bool exists = stat(path, &st) == 0;
+    for (unsigned int i = 0; i < numCached; ++i)
+    {
+        if (strcmp(cache[i].path, path) != 0)
+            continue;
+        if (exists && st.st_dev == cache[i].dev && st.st_ino == cache[i].ino && st.st_mode == cache[i].mode && st.st_uid == cache[i].uid)
+            return cache[i].fd;
+        dropCached(i); /* Renamed, removed, replaced or changed permissions */
+        break;
+    }
+    if (exists && !S_ISREG(st.st_mode)) /* Opening a FIFO or device could block or have side effects in the shell */
+        return -1;
+    fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if (fd == -1)
+        return -1;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+    {
+        close(fd);
+        return -1;
+    }
+    high = redirHigh(fd); /* Out of the way of the descriptors commands redirect */
+    if (high < REDIR_FD_MIN)
+    {
+        close(high);
+        return -1;
+    }
+    if (numCached == REDIR_CACHE_MAX)
+        dropCached(0);
+    cache[numCached].path = strdup(path);
+    if (cache[numCached].path == NULL)
+    {
+        close(high);
+        return -1;
+    }
+    cache[numCached].dev = st.st_dev;
+    cache[numCached].ino = st.st_ino;
+    cache[numCached].mode = st.st_mode;
+    cache[numCached].uid = st.st_uid;
+    cache[numCached].fd = high;
+    ++numCached;
+    return high;
+}
+
+/*
+  Look up the cached descriptors of the appending redirections, done in the
+  shell before forking so the cache outlives the command
+  fds: Set to a cached descriptor for each redirection, or -1
+*/
+void redirPrepare(char **ops, char **words, unsigned int n, int *fds)
+{
+    Redir r;
+    bool on = cacheOn();
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        fds[i] = -1;
+        if (on && redirParse(ops[i], &r) && r.kind == REDIR_APPEND)
+            fds[i] = cachedAppend(words[i]);
+    }
+}
+
+/*
+  Move a descriptor the shell keeps open out of the way of the descriptors
+  commands redirect, closing fd
+  Returns the close-on-exec copy at or above REDIR_FD_MIN, or fd itself if it
+  is -1, already out of the way or can't be copied
+*/
+int redirHigh(int fd)
+{
+    int high;
+    if (fd == -1 || fd >= REDIR_FD_MIN)
+        return fd;
+    high = fcntl(fd, F_DUPFD_CLOEXEC, REDIR_FD_MIN);
+    if (high == -1)
+        return fd;
+    close(fd);
+    return high;
+}
+
+/* Remember what fd refers to before it is first replaced */
+static bool save(int fd, RedirSaved *saved)
+{
+    int copy;
+    for (unsigned int i = 0; i < saved->n; ++i)
+    {
+        if (saved->fd[i] == fd)
+            return true;
+    }
+    if (saved->n == REDIR_MAX_SAVED)
+        return false;
+    copy = fcntl(fd, F_DUPFD_CLOEXEC, REDIR_FD_MIN);
+    if (copy == -1 && errno != EBADF)
+        return false;
+    saved->fd[saved->n] = fd;
+    saved->saved[saved->n] = copy;
+    ++saved->n;
+    return true;
+}
+
+/* Make fd refer to what src does, or close it if src is -1 */
+static bool redirect(int fd, int src)
+{
+    if (src == -1)
+    {
+        close(fd);
+        return true;
+    }
+    if (src == fd) /* Opened straight into place, let it survive exec */
+        return fcntl(fd, F_SETFD, 0) != -1;
+    if (dup2(src, fd) == -1)
+    {
+        fprintf(stderr, "redirApply: bad file descriptor %d\n", src);
+        return false;
+    }
+    return true;
+}
+
+/*
+  Apply the n redirections in order to the calling process
+  ops: Redirection operators
+  words: File name or descriptor following each operator, "" if it had none
+  fds: Descriptors from redirPrepare, or NULL
+  saved: Where to keep the replaced descriptors when running in the shell
+  itself, NULL in a child about to exec
+  Returns false (after printing why) if a redirection failed
+*/
+bool redirApply(char **ops, char **words, unsigned int n, const int *fds, RedirSaved *saved)
+{
+    static const int flags[] = {
+        [REDIR_IN] = O_RDONLY,
+        [REDIR_OUT] = O_WRONLY | O_CREAT | O_TRUNC,
+        [REDIR_APPEND] = O_WRONLY | O_CREAT | O_APPEND,
+        [REDIR_RDWR] = O_RDWR | O_CREAT,
+    };
+    Redir r;
+    int src;
+    bool ok;
+    fflush(stdout); /* Output so far belongs to the old descriptors */
+    fflush(stderr);
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        if (!redirParse(ops[i], &r))
+        {
+            fprintf(stderr, "redirApply: invalid redirection \'%s\'\n", ops[i]);
+            return false;
+        }
+        if (r.kind == REDIR_DUP && r.hasWord) /* N>& WORD */
+        {
+            if (strcmp(words[i], "-") == 0)
+                r.kind = REDIR_CLOSE;
+            else if (isdigit(words[i][0]) && words[i][1] == '\0')
+                r.target = words[i][0] - '0';
+            else if (strcmp(ops[i], ">&") == 0) /* >& FILE is the older spelling of &> */
+            {
+                r.kind = REDIR_OUT;
+                r.both = true;
+            }
+            else
+            {
+                fprintf(stderr, "redirApply: \'%s\' is not a file descriptor\n", words[i]);
+                return false;
+            }
+        }
+        if (saved != NULL && (!save(r.fd, saved) || (r.both && !save(2, saved))))
+        {
+            fprintf(stderr, "redirApply: could not save descriptor %d\n", r.fd);
+            return false;
+        }
+        if (r.kind == REDIR_CLOSE)
+        {
+            if (!redirect(r.fd, -1))
+                return false;
+            continue;
+        }
+        if (r.kind == REDIR_DUP)
+        {
+            if (fcntl(r.target, F_GETFD) == -1)
+            {
+                fprintf(stderr, "redirApply: bad file descriptor %d\n", r.target);
+                return false;
+            }
+            if (!redirect(r.fd, r.target))
+                return false;
+            continue;
+        }
+        if (fds != NULL && fds[i] != -1) /* Cached append descriptor, shared rather than closed */
+        {
+            ok = redirect(r.fd, fds[i]) && (!r.both || redirect(2, r.fd));
+            if (!ok)
+                return false;
+            continue;
+        }
+        src = open(words[i], flags[r.kind] | O_CLOEXEC, 0666);
+        if (src == -1)
+        {
+            fprintf(stderr, "redirApply: could not open file \'%s\'\n", words[i]);
+            return false;
+        }
+        ok = redirect(r.fd, src) && (!r.both || redirect(2, r.fd));
+        if (src != r.fd && !(r.both && src == 2))
+            close(src);
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+/* Put back the descriptors replaced by redirApply */
+void redirRestore(RedirSaved *saved)
+{
+    fflush(stdout);
+    fflush(stderr);
+    while (saved->n > 0)
+    {
+        --saved->n;
+        if (saved->saved[saved->n] == -1)
+            close(saved->fd[saved->n]);
+        else
+        {
+            dup2(saved->saved[saved->n], saved->fd[saved->n]);
+            close(saved->saved[saved->n]);
+        }
+    }
+}
+
+/* Close every cached descriptor */
+void redirFree()
+{
+    while (numCached > 0)
+        dropCached(numCached - 1);
+}
@@ -0,0 +1,60 @@
+/*
+  Redirections of a command's file descriptors
+
+  The operators follow POSIX, with the file name or descriptor as the next
+  word and N defaulting to 0 for input and 1 for output:
+    N< FILE      read FILE
+    N> FILE      write FILE, truncating it (N>| is the same)
+    N>> FILE     append to FILE
+    N<> FILE     read and write FILE
+    N<& M        make N a copy of M (N>& M too), - closes N
+    &> FILE      stdout and stderr to FILE, &>> appends
+  The descriptor copies can also be written as one word: 2>&1, 0<&-
+  Only descriptors 0 to 9 can be redirected. Every descriptor the shell keeps
+  open (history files, the job loop, cached appends) is moved at or above
+  REDIR_FD_MIN with redirHigh when it is created, so a redirection never
+  replaces one of them
+
+  With FDCACHE set to anything but 0, appending redirections reuse a
+  descriptor the shell keeps open for the path instead of opening the file
+  for every command. Each use checks that the path still names the same file
+  (same inode and permissions), so a log that was renamed, removed or
+  replaced is opened again
+*/
+#ifndef REDIR_H
+#define REDIR_H
+
+#include <stdbool.h>
+
+#define REDIR_FD_MIN 10 /* Descriptors kept by the shell are moved at or above this */
+#define REDIR_CACHE_MAX 64 /* Most append descriptors kept open at once */
+#define REDIR_MAX_SAVED 10 /* One per redirectable descriptor */
+
+typedef enum { REDIR_IN, REDIR_OUT, REDIR_APPEND, REDIR_RDWR, REDIR_DUP, REDIR_CLOSE } RedirKind;
+
+typedef struct
+{
+    int fd; /* Descriptor being redirected */
+    RedirKind kind;
+    bool both; /* &> and &>>, stderr follows stdout */
+    bool hasWord; /* The file name or descriptor is the next word */
+    int target; /* Descriptor copied by a one word N>&M */
+} Redir;
+
+/* Descriptors replaced while a builtin runs in the shell, put back by redirRestore */
+typedef struct
+{
+    int fd[REDIR_MAX_SAVED];
+    int saved[REDIR_MAX_SAVED]; /* Copy of the original, -1 if it was closed */
+    unsigned int n;
+} RedirSaved;
+
+bool redirParse(const char*, Redir*);
+bool redirHas(char**, unsigned int, int);
+void redirPrepare(char**, char**, unsigned int, int*);
+bool redirApply(char**, char**, unsigned int, const int*, RedirSaved*);
+void redirRestore(RedirSaved*);
+int redirHigh(int);
+void redirFree();
+
+#endif
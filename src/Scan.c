@@ -0,0 +1,171 @@
+/*
+  Vectorized character class scanning
+*/
+#include "Scan.h"
+#include <stdbool.h>
+#include <stdint.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+/* Classes of every byte value */
+static const unsigned char table[256] = {
+    ['\t'] = SCAN_SPACE, ['\n'] = SCAN_SPACE, ['\v'] = SCAN_SPACE, ['\f'] = SCAN_SPACE, ['\r'] = SCAN_SPACE, [' '] = SCAN_SPACE,
+    ['"'] = SCAN_QUOTE,
+    ['{'] = SCAN_BRACE, ['}'] = SCAN_BRACE,
+    ['('] = SCAN_PAREN, [')'] = SCAN_PAREN,
+    [';'] = SCAN_OP, ['='] = SCAN_OP, ['&'] = SCAN_OP, ['|'] = SCAN_OP, ['<'] = SCAN_OP, ['>'] = SCAN_OP,
+    ['$'] = SCAN_DOLLAR,
+};
+
+/*
+  Scanners return the first position in s[pos..maxPos] whose byte is (want)
+  or is not (!want) in one of classes. Only blocks lying entirely inside the
+  range are loaded, so a scan never reads past maxPos
+*/
+typedef int (*ScanFn)(const char*, int, int, unsigned int, bool);
+
+/* Finish the scan a byte at a time */
+static int scanTail(const char *s, int pos, int maxPos, unsigned int classes, bool want)
+{
+    while (pos <= maxPos && ((table[(unsigned char) s[pos]] & classes) != 0) != want)
+        ++pos;
+    return pos;
+}
+
+#ifdef SCAN_X86
+/* Bitmask of the 16 bytes at p belonging to any of classes */
+static inline uint32_t maskSse2(const char *p, unsigned int classes)
+{
+    __m128i v = _mm_loadu_si128((const __m128i*) p);
+    __m128i m = _mm_setzero_si128();
+    if (classes & SCAN_SPACE)
+    {
+        __m128i c = _mm_sub_epi8(v, _mm_set1_epi8(9)); /* \t..\r become 0..4 */
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_min_epu8(c, _mm_set1_epi8(4)), c));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+    }
+    if (classes & SCAN_QUOTE)
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+    if (classes & SCAN_BRACE)
+    {
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('{')));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('}')));
+    }
+    if (classes & SCAN_PAREN) /* ( and ) differ only in bit 0 */
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_or_si128(v, _mm_set1_epi8(1)), _mm_set1_epi8(')')));
+    if (classes & SCAN_OP)
+    {
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(';')));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('&')));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('|')));
+        /* < = > are consecutive */
+        __m128i c = _mm_sub_epi8(v, _mm_set1_epi8('<'));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_min_epu8(c, _mm_set1_epi8(2)), c));
+    }
+    if (classes & SCAN_DOLLAR)
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('$')));
+    return (uint32_t) _mm_movemask_epi8(m);
+}
+
+static int scanSse2(const char *s, int pos, int maxPos, unsigned int classes, bool want)
+{
+    uint32_t bits;
+    while (pos + 15 <= maxPos)
+    {
+        bits = maskSse2(s + pos, classes);
+        if (!want)
+            bits = ~bits & 0xFFFF;
+        if (bits != 0)
+            return pos + __builtin_ctz(bits);
+        pos += 16;
+    }
+    return scanTail(s, pos, maxPos, classes, want);
+}
+
+/* Bitmask of the 32 bytes at p belonging to any of classes */
+__attribute__((target("avx2")))
+static inline uint32_t maskAvx2(const char *p, unsigned int classes)
+{
+    __m256i v = _mm256_loadu_si256((const __m256i*) p);
+    __m256i m = _mm256_setzero_si256();
+    if (classes & SCAN_SPACE)
+    {
+        __m256i c = _mm256_sub_epi8(v, _mm256_set1_epi8(9));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(_mm256_min_epu8(c, _mm256_set1_epi8(4)), c));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+    }
+    if (classes & SCAN_QUOTE)
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')));
+    if (classes & SCAN_BRACE)
+    {
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('{')));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('}')));
+    }
+    if (classes & SCAN_PAREN)
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(_mm256_or_si256(v, _mm256_set1_epi8(1)), _mm256_set1_epi8(')')));
+    if (classes & SCAN_OP)
+    {
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(';')));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('&')));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('|')));
+        __m256i c = _mm256_sub_epi8(v, _mm256_set1_epi8('<'));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(_mm256_min_epu8(c, _mm256_set1_epi8(2)), c));
+    }
+    if (classes & SCAN_DOLLAR)
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('$')));
+    return (uint32_t) _mm256_movemask_epi8(m);
+}
+
+__attribute__((target("avx2")))
+static int scanAvx2(const char *s, int pos, int maxPos, unsigned int classes, bool want)
+{
+    uint32_t bits;
+    while (pos + 31 <= maxPos)
+    {
+        bits = maskAvx2(s + pos, classes);
+        if (!want)
+            bits = ~bits;
+        if (bits != 0)
+            return pos + __builtin_ctz(bits);
+        pos += 32;
+    }
+    return scanSse2(s, pos, maxPos, classes, want);
+}
+#endif
+
+/* Pick the widest implementation the CPU supports the first time a scan is run */
+static int scanInit(const char *s, int pos, int maxPos, unsigned int classes, bool want);
+static ScanFn scan = scanInit;
+
+static int scanInit(const char *s, int pos, int maxPos, unsigned int classes, bool want)
+{
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    scan = __builtin_cpu_supports("avx2") ? scanAvx2 : scanSse2;
+#else
+    scan = scanTail;
+#endif
+    return scan(s, pos, maxPos, classes, want);
+}
+
+/* Position of the first character in s[pos..maxPos] belonging to one of classes, maxPos + 1 if there is none */
+int scanFind(const char *s, int pos, int maxPos, unsigned int classes)
+{
+    if (pos > maxPos)
+        return pos;
+    if (pos + 16 > maxPos) /* Too short for a block, don't bother dispatching */
+        return scanTail(s, pos, maxPos, classes, true);
+    return scan(s, pos, maxPos, classes, true);
+}
+
+/* Position of the first character in s[pos..maxPos] belonging to none of classes, maxPos + 1 if there is none */
+int scanSkip(const char *s, int pos, int maxPos, unsigned int classes)
+{
+    if (pos > maxPos)
+        return pos;
+    if (pos + 16 > maxPos)
+        return scanTail(s, pos, maxPos, classes, false);
+    return scan(s, pos, maxPos, classes, false);
+}
@@ -0,0 +1,24 @@
+/*
+  Character class scanning for the parser
+
+  Finds the next character belonging (or not belonging) to a set of classes,
+  looking at 32 bytes at a time with AVX2 or 16 with SSE2. Each block is
+  turned into a bitmask of the matching bytes and the first one is located
+  with a count of trailing zeros. Other architectures and the tail of the
+  string use a lookup table
+*/
+#ifndef SCAN_H
+#define SCAN_H
+
+/* Character classes, combine them with | */
+#define SCAN_SPACE 0x01 /* ' ' and \t \n \v \f \r, as isspace in the C locale */
+#define SCAN_QUOTE 0x02 /* " */
+#define SCAN_BRACE 0x04 /* { } */
+#define SCAN_PAREN 0x08 /* ( ) */
+#define SCAN_OP 0x10 /* Characters operators are made of: ; = & | < > */
+#define SCAN_DOLLAR 0x20 /* $ */
+
+int scanFind(const char*, int, int, unsigned int);
+int scanSkip(const char*, int, int, unsigned int);
+
+#endif
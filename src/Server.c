@@ -0,0 +1,205 @@
+/*
+  Unix domain socket server for running command lines in a warm shell
+
+  The server sets everything up once (constants, rc file, PATH trie) and then
+  forks a session for every connection. Sessions inherit the warm state copy
+  on write, so a request costs a fork instead of a full shell startup, and
+  sessions running at the same time can't see each other's changes
+*/
+#include "Parser.h"
+#include "Server.h"
+#include "PathCache.h"
+#include "Jobs.h"
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static int conn = -1; /* Connection of this session */
+static pid_t sessionPid = 0;
+
+/* Read exactly n bytes. Returns false on end of file or error */
+static bool readAll(int fd, void *data, size_t n)
+{
+    char *p = (char*) data;
+    ssize_t r;
+    while (n > 0)
+    {
+        r = read(fd, p, n);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        p += r;
+        n -= r;
+    }
+    return true;
+}
+
+/* Send the exit status of a request back to the client */
+static void reply(int status)
+{
+    int32_t s = status;
+    fflush(stdout);
+    fflush(stderr);
+    if (write(conn, &s, sizeof(s)) != sizeof(s))
+        fprintf(stderr, "serve: failed to send the exit status\n");
+}
+
+/* Report the status when a request makes the session exit (e.g. the exit builtin) */
+static void onExit(int status, void *arg)
+{
+    if (getpid() == sessionPid) /* Not a subshell that inherited the handler */
+        reply(status);
+}
+
+/*
+  Receive the header of a request along with the client's file descriptors
+  and install them as the session's stdio and working directory
+*/
+static bool recvRequest(uint32_t *len)
+{
+    int fds[SERVE_FDS];
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = { len, sizeof(*len) };
+    struct msghdr msg;
+    struct cmsghdr *c = NULL;
+    ssize_t r;
+    bool gotFds = false;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    while ((r = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR)
+        ;
+    if (r <= 0)
+        return false;
+    for (c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c))
+    {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS && c->cmsg_len == CMSG_LEN(sizeof(fds)))
+        {
+            memcpy(fds, CMSG_DATA(c), sizeof(fds));
+            gotFds = true;
+        }
+    }
+    if ((size_t) r < sizeof(*len) && !readAll(conn, (char*) len + r, sizeof(*len) - r))
+        return false;
+    if (!gotFds)
+        return true; /* Keep the stdio of the previous request */
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = 0; i < 3; ++i)
+    {
+        dup2(fds[i], i);
+        close(fds[i]);
+    }
+    if (fchdir(fds[3]) == -1)
+        fprintf(stderr, "serve: failed to change to the client's directory\n");
+    close(fds[3]);
+    return true;
+}
+
+/* Evaluate the requests of one connection until the client hangs up */
+static void session()
+{
+    uint32_t len = 0;
+    char *expr = NULL;
+    signal(SIGCHLD, SIG_DFL); /* The shell waits for its own children */
+    sessionPid = getpid();
+    on_exit(onExit, NULL);
+    while (recvRequest(&len))
+    {
+        if (len > SERVE_MAX_CMD)
+        {
+            fprintf(stderr, "serve: command line longer than %d bytes\n", SERVE_MAX_CMD);
+            break;
+        }
+        expr = (char*) malloc(len + 1);
+        if (expr == NULL || !readAll(conn, expr, len))
+            break;
+        expr[len] = '\0';
+        jobsPoll();
+        reply(evalExpr(expr));
+        free(expr);
+        expr = NULL;
+    }
+    free(expr);
+    sessionPid = 0; /* Hanging up is not a request */
+}
+
+/* Only serve processes running as the same user as the server */
+static bool checkPeer(int fd)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+}
+
+/*
+  Listen on the Unix domain socket at path and serve sessions until killed
+  The shell must already be initialized. Returns only on failure
+*/
+int serve(const char *path)
+{
+    struct sockaddr_un addr;
+    int sock = -1;
+    pid_t child;
+    if (strlen(path) + strlen(".tmp") >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "serve: socket path too long\n");
+        return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    /* Bind under a temporary name so the socket only appears at path once it accepts connections */
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s.tmp", path);
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1)
+    {
+        fprintf(stderr, "serve: failed to create socket\n");
+        return 1;
+    }
+    unlink(addr.sun_path); /* Left over from a previous server */
+    if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) == -1 || chmod(addr.sun_path, 0600) == -1
+        || listen(sock, SERVE_BACKLOG) == -1 || rename(addr.sun_path, path) == -1)
+    {
+        fprintf(stderr, "serve: failed to listen on \'%s\'\n", path);
+        unlink(addr.sun_path);
+        close(sock);
+        return 1;
+    }
+    pathRebuild(); /* Warm the PATH cache so sessions inherit it */
+    jobsReset(); /* Sessions build their own job table rather than sharing the rc file's event loop */
+    signal(SIGCHLD, SIG_IGN); /* Sessions are reaped automatically */
+    while (1)
+    {
+        conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+        if (conn == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            fprintf(stderr, "serve: failed to accept a connection\n");
+            break;
+        }
+        if (!checkPeer(conn))
+        {
+            close(conn);
+            continue;
+        }
+        fflush(stdout);
+        child = fork();
+        if (child == 0)
+        {
+            close(sock);
+            session();
+            close(conn);
+            finish();
+            exit(0);
+        }
+        if (child == -1)
+            fprintf(stderr, "serve: failed to fork a session\n");
+        close(conn);
+    }
+    close(sock);
+    return 1;
+}
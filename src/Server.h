@@ -0,0 +1,24 @@
+/*
+  Server mode: soyshell --serve SOCKET keeps an initialized shell running and
+  evaluates command lines sent by soyclient over a Unix domain socket
+
+  Request: uint32 length followed by the command line. The first byte carries
+  SERVE_FDS file descriptors as SCM_RIGHTS: the client's stdin, stdout, stderr
+  and working directory
+  Reply: int32 exit status of the command line
+  A connection is one session. It gets its own forked copy of the shell state,
+  so constants set by one request are seen by later requests on the same
+  connection but never by other clients
+*/
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdint.h>
+
+#define SERVE_FDS 4 /* stdin, stdout, stderr and the working directory */
+#define SERVE_MAX_CMD (64 * 1024) /* Longest command line accepted in one request */
+#define SERVE_BACKLOG 64 /* Connections allowed to wait for accept */
+
+int serve(const char*);
+
+#endif
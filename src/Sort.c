@@ -0,0 +1,538 @@
+/*
+  In-memory and external merge sort for the sort builtin
+*/
+#include "Parser.h"
+#include "Builtins.h"
+#include "Sort.h"
+#include <stdint.h>
+#include <pthread.h>
+
+typedef struct
+{
+    uint64_t key; /* First 8 bytes, big-endian and zero padded, so integers compare like the text */
+    const char *s;
+    size_t len; /* Without the newline */
+} Line;
+
+/* A sorted sequence being merged: part of the line table or a run file */
+typedef struct
+{
+    Line cur;
+    Line *next; /* Table part, NULL for a run file */
+    Line *end;
+    int fd; /* Run file read through buf */
+    char *buf;
+    size_t cap;
+    size_t len;
+    size_t pos;
+    bool eof;
+    bool ownsBuf; /* buf had to be allocated because a line was longer than the share given */
+} Source;
+
+typedef struct
+{
+    bool reverse; /* -r */
+    const char *tmpDir; /* -T */
+    char *arena; /* Text from the front, line table from the back */
+    size_t cap;
+    size_t textLen;
+    size_t numLines;
+    int *runs; /* Unlinked temporary files holding sorted runs */
+    unsigned int numRuns;
+} Sorter;
+
+typedef struct
+{
+    Line *lines;
+    size_t n;
+    const Sorter *s;
+} SortPart;
+
+/* Integer form of the first 8 bytes of s */
+static uint64_t lineKey(const char *s, size_t len)
+{
+    uint64_t k = 0;
+    for (size_t i = 0; i < len && i < 8; ++i)
+        k |= (uint64_t) (unsigned char) s[i] << (56 - 8 * i);
+    return k;
+}
+
+/* Compare two lines byte by byte, the shorter first if one is a prefix of the other */
+static int compareLines(const void *a, const void *b, void *arg)
+{
+    const Line *x = (const Line*) a;
+    const Line *y = (const Line*) b;
+    int r = 0;
+    if (x->key != y->key)
+        r = x->key < y->key ? -1 : 1;
+    else
+    {
+        if (x->len > 8 && y->len > 8)
+            r = memcmp(x->s + 8, y->s + 8, (x->len < y->len ? x->len : y->len) - 8);
+        if (r == 0)
+            r = (x->len > y->len) - (x->len < y->len);
+    }
+    return ((const Sorter*) arg)->reverse ? -r : r;
+}
+
+/* The line table, which grows down from the end of the arena */
+static Line* table(Sorter *s)
+{ return (Line*) (s->arena + s->cap) - s->numLines; }
+
+/* Byte of the key at shift, flipped for -r so the buckets come out in the requested order */
+static inline unsigned int keyByte(const Line *l, int shift, bool reverse)
+{
+    unsigned int b = (l->key >> shift) & 0xFF;
+    return reverse ? 255 - b : b;
+}
+
+/*
+  MSD radix sort on the key bytes from shift down, moving the lines into their
+  buckets in place. Small buckets and lines whose keys are equal are left to
+  qsort_r with the full comparison
+*/
+static void radixSort(Line *a, size_t n, int shift, const Sorter *s)
+{
+    size_t count[256] = { 0 };
+    size_t next[256];
+    size_t pos = 0;
+    if (n < SORT_RADIX_MIN || shift < 0)
+    {
+        qsort_r(a, n, sizeof(Line), compareLines, (void*) s);
+        return;
+    }
+    for (size_t i = 0; i < n; ++i)
+        ++count[keyByte(&a[i], shift, s->reverse)];
+    for (unsigned int b = 0; b < 256; ++b)
+    {
+        next[b] = pos;
+        pos += count[b];
+    }
+    pos = 0;
+    for (unsigned int b = 0; b < 256; ++b)
+    {
+        size_t end = pos + count[b];
+        while (next[b] < end) /* Follow the cycle of displaced lines until one belongs here */
+        {
+            Line t = a[next[b]];
+            unsigned int d = keyByte(&t, shift, s->reverse);
+            while (d != b)
+            {
+                Line u = a[next[d]];
+                a[next[d]++] = t;
+                t = u;
+                d = keyByte(&t, shift, s->reverse);
+            }
+            a[next[b]++] = t;
+        }
+        pos = end;
+    }
+    pos = 0;
+    for (unsigned int b = 0; b < 256; ++b)
+    {
+        if (count[b] > 1)
+            radixSort(a + pos, count[b], shift - 8, s);
+        pos += count[b];
+    }
+}
+
+/* Sort one part of the table */
+static void* sortPart(void *arg)
+{
+    SortPart *p = (SortPart*) arg;
+    radixSort(p->lines, p->n, 56, p->s);
+    return NULL;
+}
+
+/* Restore the heap property below slot i */
+static void siftDown(Source **heap, unsigned int n, unsigned int i, Sorter *s)
+{
+    while (true)
+    {
+        unsigned int least = i;
+        unsigned int l = 2 * i + 1;
+        unsigned int r = l + 1;
+        Source *t;
+        if (l < n && compareLines(&heap[l]->cur, &heap[least]->cur, s) < 0)
+            least = l;
+        if (r < n && compareLines(&heap[r]->cur, &heap[least]->cur, s) < 0)
+            least = r;
+        if (least == i)
+            return;
+        t = heap[i];
+        heap[i] = heap[least];
+        heap[least] = t;
+        i = least;
+    }
+}
+
+/* Load the next line of src into cur. Returns false once it is exhausted */
+static bool sourceNext(Source *src)
+{
+    char *nl;
+    ssize_t r;
+    if (src->next != NULL)
+    {
+        if (src->next == src->end)
+            return false;
+        src->cur = *src->next++;
+        return true;
+    }
+    while (true)
+    {
+        nl = (char*) memchr(src->buf + src->pos, '\n', src->len - src->pos);
+        if (nl != NULL || (src->eof && src->pos < src->len))
+        {
+            size_t end = nl == NULL ? src->len : (size_t) (nl - src->buf);
+            src->cur.s = src->buf + src->pos;
+            src->cur.len = end - src->pos;
+            src->cur.key = lineKey(src->cur.s, src->cur.len);
+            src->pos = nl == NULL ? src->len : end + 1;
+            return true;
+        }
+        if (src->eof)
+            return false;
+        /* Keep the partial line and fill the rest of the buffer */
+        memmove(src->buf, src->buf + src->pos, src->len - src->pos);
+        src->len -= src->pos;
+        src->pos = 0;
+        if (src->len == src->cap) /* The line is longer than the buffer */
+        {
+            char *bigger = (char*) malloc(src->cap * 2);
+            if (bigger == NULL)
+                return false;
+            memcpy(bigger, src->buf, src->len);
+            if (src->ownsBuf)
+                free(src->buf);
+            src->buf = bigger;
+            src->cap *= 2;
+            src->ownsBuf = true;
+        }
+        r = read(src->fd, src->buf + src->len, src->cap - src->len);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            src->eof = true;
+        else
+            src->len += r;
+    }
+}
+
+/* Write the lines of the sources in order to fd */
+static bool merge(Sorter *s, Source *sources, unsigned int n, int fd)
+{
+    Source **heap = (Source**) malloc(n * sizeof(Source*));
+    unsigned int size = 0;
+    Buffer out;
+    bool ok = true;
+    if (heap == NULL)
+        return false;
+    bufInit(&out);
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        if (sourceNext(&sources[i]))
+            heap[size++] = &sources[i];
+    }
+    for (unsigned int i = size / 2; i-- > 0;)
+        siftDown(heap, size, i, s);
+    while (size > 0 && ok)
+    {
+        Source *top = heap[0];
+        ok = bufAppend(&out, top->cur.s, top->cur.len) && bufAppendChar(&out, '\n');
+        if (out.len >= SORT_FLUSH)
+        {
+            ok = ok && writeOut(fd, out.data, out.len);
+            out.len = 0;
+        }
+        if (!sourceNext(top))
+            heap[0] = heap[--size];
+        siftDown(heap, size, 0, s);
+    }
+    if (ok && out.len > 0)
+        ok = writeOut(fd, out.data, out.len);
+    bufFree(&out);
+    free(heap);
+    return ok;
+}
+
+/* Sort the line table with up to one thread per CPU and write it to fd */
+static bool sortTable(Sorter *s, int fd)
+{
+    SortPart parts[SORT_MAX_THREADS];
+    Source sources[SORT_MAX_THREADS];
+    pthread_t threads[SORT_MAX_THREADS];
+    bool started[SORT_MAX_THREADS];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int n = 1;
+    Line *lines = table(s);
+    size_t first = 0;
+    if (s->numLines >= SORT_PARALLEL_MIN && cpus > 1)
+        n = cpus < SORT_MAX_THREADS ? cpus : SORT_MAX_THREADS;
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        size_t last = s->numLines * (i + 1) / n;
+        parts[i].lines = lines + first;
+        parts[i].n = last - first;
+        parts[i].s = s;
+        started[i] = i > 0 && pthread_create(&threads[i], NULL, sortPart, &parts[i]) == 0;
+        first = last;
+    }
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        else
+            sortPart(&parts[i]);
+        memset(&sources[i], 0, sizeof(Source));
+        sources[i].next = parts[i].lines;
+        sources[i].end = parts[i].lines + parts[i].n;
+    }
+    return merge(s, sources, n, fd);
+}
+
+/* Create an unlinked temporary file for a run */
+static int tempRun(Sorter *s)
+{
+    char path[PATH_MAX];
+    int fd;
+    snprintf(path, sizeof(path), "%s/soyshell-sortXXXXXX", s->tmpDir);
+    fd = mkostemp(path, O_CLOEXEC);
+    if (fd == -1)
+    {
+        fprintf(stderr, "sort: could not create a temporary file in \'%s\'\n", s->tmpDir);
+        return -1;
+    }
+    unlink(path);
+    return fd;
+}
+
+/* Remember fd as a run to merge */
+static bool addRun(Sorter *s, int fd)
+{
+    int *runs = (int*) realloc(s->runs, (s->numRuns + 1) * sizeof(int));
+    if (runs == NULL)
+    {
+        close(fd);
+        return false;
+    }
+    s->runs = runs;
+    s->runs[s->numRuns++] = fd;
+    return true;
+}
+
+/*
+  Merge the runs first..numRuns into fd, reading each through an equal share
+  of the first size bytes of the arena, which must be free. The merged runs
+  are closed
+*/
+static bool mergeRuns(Sorter *s, unsigned int first, int fd, size_t size)
+{
+    unsigned int n = s->numRuns - first;
+    Source *sources = (Source*) calloc(n, sizeof(Source));
+    size_t share = size / n;
+    bool ok;
+    if (sources == NULL)
+        return false;
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        sources[i].fd = s->runs[first + i];
+        sources[i].buf = s->arena + i * share;
+        sources[i].cap = share;
+        lseek(sources[i].fd, 0, SEEK_SET);
+    }
+    ok = merge(s, sources, n, fd);
+    for (unsigned int i = 0; i < n; ++i)
+    {
+        if (sources[i].ownsBuf)
+            free(sources[i].buf);
+        close(sources[i].fd);
+    }
+    free(sources);
+    s->numRuns = first;
+    return ok;
+}
+
+/* Sort the lines in memory into a new run and empty the arena, keeping the partial line at its end */
+static bool spill(Sorter *s, size_t keep)
+{
+    int fd = tempRun(s);
+    if (fd == -1 || !sortTable(s, fd) || !addRun(s, fd))
+        return false;
+    memmove(s->arena, s->arena + s->textLen - keep, keep);
+    s->textLen = keep;
+    s->numLines = 0;
+    if (s->numRuns == SORT_MAX_RUNS) /* Too many files to read at once, combine them */
+    {
+        fd = tempRun(s);
+        if (fd == -1)
+            return false;
+        memmove(s->arena + s->cap - keep, s->arena, keep); /* Out of the way of the read buffers */
+        if (!mergeRuns(s, 0, fd, s->cap - keep) || !addRun(s, fd))
+            return false;
+        memmove(s->arena, s->arena + s->cap - keep, keep);
+    }
+    return true;
+}
+
+/* Add the line s[start..end) to the table. Returns false if it doesn't fit */
+static bool addLine(Sorter *s, size_t start, size_t end)
+{
+    Line *l;
+    if (s->textLen + (s->numLines + 1) * sizeof(Line) > s->cap)
+        return false;
+    ++s->numLines;
+    l = table(s);
+    l->s = s->arena + start;
+    l->len = end - start;
+    l->key = lineKey(l->s, l->len);
+    return true;
+}
+
+/* Read every line of fd into the arena, spilling runs when it fills up */
+static bool readInput(Sorter *s, int fd)
+{
+    size_t lineStart = s->textLen; /* Start of the first line not yet in the table */
+    size_t scanned = s->textLen;
+    size_t room;
+    ssize_t r;
+    char *nl;
+    while (true)
+    {
+        while ((nl = (char*) memchr(s->arena + scanned, '\n', s->textLen - scanned)) != NULL)
+        {
+            if (!addLine(s, lineStart, nl - s->arena))
+                break;
+            lineStart = scanned = nl - s->arena + 1;
+        }
+        if (nl == NULL)
+            scanned = s->textLen;
+        room = s->cap - s->textLen - s->numLines * sizeof(Line);
+        if (nl != NULL || room < sizeof(Line) + 1) /* Full, sort what there is and start over */
+        {
+            if (s->numLines == 0)
+            {
+                fprintf(stderr, "sort: a line is longer than the memory budget\n");
+                return false;
+            }
+            if (!spill(s, s->textLen - lineStart))
+                return false;
+            lineStart = scanned = 0;
+            continue;
+        }
+        r = read(fd, s->arena + s->textLen, room - sizeof(Line)); /* Leave room for the line's entry */
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r == -1)
+        {
+            fprintf(stderr, "sort: read error\n");
+            return false;
+        }
+        if (r == 0)
+            break;
+        s->textLen += r;
+    }
+    if (lineStart < s->textLen && !addLine(s, lineStart, s->textLen)) /* Last line without a newline */
+    {
+        size_t keep = s->textLen - lineStart;
+        if (!spill(s, keep) || !addLine(s, 0, keep))
+            return false;
+    }
+    return true;
+}
+
+/* Parse a size with an optional K, M or G suffix. Returns 0 if it is malformed */
+static size_t parseSize(const char *arg)
+{
+    char *end = NULL;
+    unsigned long long n = strtoull(arg, &end, 10);
+    if (end == arg)
+        return 0;
+    if (*end == 'K' || *end == 'k')
+        n <<= 10;
+    else if (*end == 'M' || *end == 'm')
+        n <<= 20;
+    else if (*end == 'G' || *end == 'g')
+        n <<= 30;
+    else if (*end != '\0')
+        return 0;
+    if (*end != '\0' && end[1] != '\0')
+        return 0;
+    return n;
+}
+
+/*
+  Run sort with its command line arguments, reading in when no file is given
+  Returns 0 on success and 2 on errors
+*/
+int sortRun(int argc, char **argv, int in, int out)
+{
+    Sorter s;
+    size_t mem = SORT_DEFAULT_MEM;
+    bool ok = true;
+    int i = 1;
+    memset(&s, 0, sizeof(s));
+    s.tmpDir = getConst("TMPDIR");
+    if (strlen(s.tmpDir) == 0)
+        s.tmpDir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; ++i)
+    {
+        if (strcmp(argv[i], "--") == 0)
+        {
+            ++i;
+            break;
+        }
+        if (strcmp(argv[i], "-r") == 0)
+            s.reverse = true;
+        else if ((strcmp(argv[i], "-S") == 0 || strcmp(argv[i], "-T") == 0) && i + 1 < argc)
+        {
+            if (argv[i][1] == 'T')
+                s.tmpDir = argv[i + 1];
+            else if ((mem = parseSize(argv[i + 1])) < SORT_MIN_MEM)
+            {
+                fprintf(stderr, "sort: invalid memory size \'%s\'\n", argv[i + 1]);
+                return 2;
+            }
+            ++i;
+        }
+        else
+        {
+            fprintf(stderr, "sort: usage: sort [-r] [-S SIZE] [-T DIR] [FILE]...\n");
+            return 2;
+        }
+    }
+    s.cap = mem & ~(size_t) (sizeof(Line) - 1); /* Keep the line table aligned */
+    s.arena = (char*) malloc(s.cap);
+    if (s.arena == NULL)
+    {
+        fprintf(stderr, "sort: could not allocate %zu bytes\n", s.cap);
+        return 2;
+    }
+    if (i == argc)
+        ok = readInput(&s, in);
+    for (; ok && i < argc; ++i)
+    {
+        int fd = strcmp(argv[i], "-") == 0 ? in : open(argv[i], O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            fprintf(stderr, "sort: could not open \'%s\'\n", argv[i]);
+            ok = false;
+            break;
+        }
+        ok = readInput(&s, fd);
+        if (fd != in)
+            close(fd);
+    }
+    if (ok && s.numRuns == 0)
+        ok = sortTable(&s, out);
+    else if (ok)
+    {
+        if (s.numLines > 0)
+            ok = spill(&s, 0);
+        ok = ok && mergeRuns(&s, 0, out, s.cap);
+    }
+    for (unsigned int r = 0; r < s.numRuns; ++r)
+        close(s.runs[r]);
+    free(s.runs);
+    free(s.arena);
+    return ok ? 0 : 2;
+}
@@ -0,0 +1,32 @@
+/*
+  The sort builtin
+
+  sort [-r] [-S SIZE] [-T DIR] [FILE]...
+  Lines are compared byte by byte (the C locale). Input is read into a
+  memory budget of SIZE bytes (suffix K, M or G, SORT_DEFAULT_MEM by
+  default) counting both the text and the line table. Each line keeps its
+  first 8 bytes as an integer, which an in-place MSD radix sort distributes
+  on byte by byte without touching the text; only small buckets and lines
+  sharing all 8 bytes are compared in full. The table is split between up
+  to one thread per CPU, each sorting its part, and the parts are merged
+  with a heap on the way out
+
+  When the input doesn't fit, every budget's worth of sorted lines is
+  written to an unlinked temporary file in DIR (TMPDIR or /tmp by default)
+  and the files are merged at the end, SORT_MAX_RUNS at a time, reading each
+  through a share of the same budget
+*/
+#ifndef SORT_H
+#define SORT_H
+
+#define SORT_DEFAULT_MEM (256UL << 20) /* Memory budget when -S isn't given */
+#define SORT_MIN_MEM (1UL << 20) /* Smallest budget accepted */
+#define SORT_MAX_RUNS 64 /* Most temporary files merged at once */
+#define SORT_MAX_THREADS 16 /* Most threads sorting at once */
+#define SORT_RADIX_MIN 64 /* Fewer lines than this are sorted by comparison */
+#define SORT_PARALLEL_MIN 65536 /* Fewer lines than this are sorted by one thread */
+#define SORT_FLUSH (1 << 16) /* Output is written once this much is pending */
+
+int sortRun(int, char**, int, int);
+
+#endif
@@ -0,0 +1,307 @@
+/*
+  Startup file evaluation and state snapshots
+
+  snapshot: header, base PATH\0, (key\0 value\0 exported) for every constant, trie
+
+  The base PATH is the value PATH had before the rc file ran, since the rc file
+  usually builds on it and it depends on the directory the shell started in.
+  A snapshot is used when the base PATH matches and the rc file is the same
+  file with the same size and modification time. If only the modification time
+  differs (e.g. the file was touched or checked out again) the contents are
+  hashed and the snapshot is still used, with its timestamp refreshed, if the
+  hash matches. The fast path is therefore two stats and one mmap no matter
+  how large the rc file is
+*/
+#include "Parser.h"
+#include "Startup.h"
+#include "PathCache.h"
+#include <stdint.h>
+#include <sys/mman.h>
+
+typedef struct
+{
+    char magic[8];
+    uint64_t dev; /* Identity of the rc file the snapshot was made from */
+    uint64_t ino;
+    uint64_t size;
+    int64_t sec; /* Modification time of the rc file */
+    int64_t nsec;
+    uint64_t hash; /* FNV-1a hash of the rc file contents */
+    uint32_t numConsts;
+    uint32_t pad;
+} SnapHeader;
+
+static char *rcPath = NULL;
+static char *snapPath = NULL;
+static char *basePath = NULL; /* Value of PATH before the rc file ran */
+static struct stat rcStat; /* The rc file as it was when it was read */
+static uint64_t rcHash = 0;
+static bool loaded = false; /* Has an rc file been read, either directly or through a snapshot */
+
+/* FNV-1a hash of n bytes */
+static uint64_t hashBytes(const char *p, size_t n)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < n; ++i)
+    {
+        h ^= (unsigned char) p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Hash the contents of the file at path. Returns false if it can't be read */
+static bool hashFile(const char *path, size_t size, uint64_t *hash)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    char *map = NULL;
+    if (fd == -1)
+        return false;
+    if (size == 0)
+        *hash = hashBytes("", 0);
+    else
+    {
+        map = (char*) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+        {
+            close(fd);
+            return false;
+        }
+        *hash = hashBytes(map, size);
+        munmap(map, size);
+    }
+    close(fd);
+    return true;
+}
+
+/* Read a null terminated string at p that must end before end. Returns the byte after it, NULL if it doesn't end */
+static const char* skipStr(const char *p, const char *end)
+{
+    const char *z = (const char*) memchr(p, '\0', end - p);
+    return z == NULL ? NULL : z + 1;
+}
+
+/* Restore the constants and PATH cache from the snapshot if it is still valid for the rc file */
+static bool loadSnapshot(const struct stat *st)
+{
+    SnapHeader h;
+    struct stat ss;
+    char *map = NULL;
+    const char *p = NULL;
+    const char *end = NULL;
+    const char *body = NULL;
+    bool ok = false;
+    bool touched = false;
+    int fd = open(snapPath, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    if (fstat(fd, &ss) == -1 || (size_t) ss.st_size < sizeof(SnapHeader))
+    {
+        close(fd);
+        return false;
+    }
+    map = (char*) mmap(NULL, ss.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+    memcpy(&h, map, sizeof(h));
+    end = map + ss.st_size;
+    if (memcmp(h.magic, SNAP_MAGIC, sizeof(h.magic)) != 0 || h.dev != (uint64_t) st->st_dev
+        || h.ino != (uint64_t) st->st_ino || h.size != (uint64_t) st->st_size)
+        goto done;
+    if (h.sec != st->st_mtim.tv_sec || h.nsec != st->st_mtim.tv_nsec)
+    {
+        if (!hashFile(rcPath, st->st_size, &rcHash) || rcHash != h.hash)
+            goto done;
+        touched = true;
+    }
+    /* Check the whole layout before touching the constants */
+    p = map + sizeof(h);
+    if ((body = skipStr(p, end)) == NULL || strcmp(p, basePath) != 0)
+        goto done;
+    p = body;
+    for (uint32_t i = 0; i < 2 * h.numConsts; ++i)
+    {
+        body = p;
+        if ((p = skipStr(p, end)) == NULL || p - body > BUFF_MAX)
+            goto done;
+        if (i % 2 == 1 && p++ == end) /* Export flag after the value */
+            goto done;
+    }
+    if (!pathLoad(p, end - p))
+        goto done;
+    p = skipStr(map + sizeof(h), end);
+    for (uint32_t i = 0; i < h.numConsts; ++i)
+    {
+        const char *val = skipStr(p, end);
+        const char *flag = skipStr(val, end);
+        addConst((char*) p, (char*) val);
+        if (*flag)
+            exportConst((char*) p);
+        p = flag + 1;
+    }
+    rcHash = h.hash;
+    ok = true;
+    if (touched) /* Contents are unchanged, remember the new timestamp so the next start skips the hash */
+    {
+        h.sec = st->st_mtim.tv_sec;
+        h.nsec = st->st_mtim.tv_nsec;
+        fd = open(snapPath, O_WRONLY | O_CLOEXEC);
+        if (fd != -1)
+        {
+            if (pwrite(fd, &h, sizeof(h), 0) != sizeof(h))
+                fprintf(stderr, "warning: failed to update \'%s\'\n", snapPath);
+            close(fd);
+        }
+    }
+done:
+    munmap(map, ss.st_size);
+    return ok;
+}
+
+/* Evaluate every line of the rc file, skipping blank lines and # comments */
+static bool runRc(const struct stat *st)
+{
+    char *text = NULL;
+    char *line = NULL;
+    char *nl = NULL;
+    size_t len = 0;
+    ssize_t r = 0;
+    int fd = open(rcPath, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    text = (char*) malloc(st->st_size + 1);
+    if (text == NULL)
+    {
+        close(fd);
+        return false;
+    }
+    while (len < (size_t) st->st_size && (r = read(fd, text + len, st->st_size - len)) != 0)
+    {
+        if (r == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        len += r;
+    }
+    close(fd);
+    text[len] = '\0';
+    rcHash = hashBytes(text, len);
+    for (line = text; line < text + len; line = nl + 1)
+    {
+        nl = strchr(line, '\n');
+        if (nl == NULL)
+            nl = text + len;
+        *nl = '\0';
+        while (isspace((unsigned char) *line))
+            ++line;
+        if (*line != '\0' && *line != '#')
+            evalExpr(line);
+    }
+    free(text);
+    return true;
+}
+
+/*
+  Set up the shell state from the rc file, through its snapshot when possible
+  SOYSHELLRC names the rc file to use, an empty value disables it
+  Returns false if the rc file exists but could not be read
+*/
+bool startupLoad()
+{
+    const char *path = getenv("SOYSHELLRC");
+    const char *home = NULL;
+    size_t len = 0;
+    if (path == NULL)
+    {
+        home = getenv("HOME");
+        if (home == NULL)
+            return true;
+        len = strlen(home) + strlen(RC_NAME) + 2;
+        rcPath = (char*) malloc(len);
+        snprintf(rcPath, len, "%s/%s", home, RC_NAME);
+    }
+    else if (strlen(path) == 0)
+        return true;
+    else
+        rcPath = strdup(path);
+    len = strlen(rcPath) + strlen(SNAP_SUFFIX) + 1;
+    snapPath = (char*) malloc(len);
+    snprintf(snapPath, len, "%s%s", rcPath, SNAP_SUFFIX);
+    basePath = strdup(consts[0][1]);
+    if (stat(rcPath, &rcStat) == -1) /* No rc file */
+        return true;
+    loaded = true;
+    if (loadSnapshot(&rcStat))
+        return true;
+    if (!runRc(&rcStat))
+    {
+        fprintf(stderr, "warning: could not read \'%s\'\n", rcPath);
+        loaded = false;
+        return false;
+    }
+    return true;
+}
+
+/*
+  Save the current constants and PATH cache as the snapshot of the rc file
+  The snapshot is keyed on the rc file as it was read at startup, so saving
+  from inside the rc file records exactly the state the file produces
+*/
+bool startupSave()
+{
+    SnapHeader h;
+    Buffer buf;
+    char *tmp = NULL;
+    int fd = -1;
+    bool ok = false;
+    if (!loaded)
+    {
+        fprintf(stderr, "snapshot: no rc file was loaded\n");
+        return false;
+    }
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAP_MAGIC, sizeof(h.magic));
+    h.dev = rcStat.st_dev;
+    h.ino = rcStat.st_ino;
+    h.size = rcStat.st_size;
+    h.sec = rcStat.st_mtim.tv_sec;
+    h.nsec = rcStat.st_mtim.tv_nsec;
+    h.hash = rcHash;
+    h.numConsts = numConsts;
+    bufInit(&buf);
+    ok = bufAppend(&buf, (const char*) &h, sizeof(h)) && bufAppend(&buf, basePath, strlen(basePath) + 1);
+    for (unsigned int i = 0; ok && i < numConsts; ++i)
+        ok = bufAppend(&buf, consts[i][0], strlen(consts[i][0]) + 1) && bufAppend(&buf, consts[i][1], strlen(consts[i][1]) + 1)
+            && bufAppendChar(&buf, exported[i] ? 1 : 0);
+    ok = ok && pathSave(&buf);
+    /* Write next to the old snapshot and rename it over, so a starting shell never maps a partial one */
+    if (ok)
+    {
+        tmp = (char*) malloc(strlen(snapPath) + 5);
+        sprintf(tmp, "%s.tmp", snapPath);
+        fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        ok = fd != -1;
+        for (size_t off = 0; ok && off < buf.len;)
+        {
+            ssize_t w = write(fd, buf.data + off, buf.len - off);
+            if (w == -1 && errno == EINTR)
+                continue;
+            ok = w > 0;
+            if (ok)
+                off += w;
+        }
+        if (fd != -1)
+            close(fd);
+        ok = ok && rename(tmp, snapPath) == 0;
+        if (!ok)
+            unlink(tmp);
+        free(tmp);
+    }
+    if (!ok)
+        fprintf(stderr, "snapshot: failed to write \'%s\'\n", snapPath);
+    bufFree(&buf);
+    return ok;
+}
@@ -0,0 +1,22 @@
+/*
+  Startup file support
+
+  The rc file (~/.soyshellrc, or the file named by SOYSHELLRC) is evaluated
+  line by line when the shell starts. The snapshot builtin saves the constants
+  and PATH cache it produced to a binary snapshot next to it, which later
+  sessions map in instead of evaluating the rc file again for as long as the
+  rc file is unchanged
+*/
+#ifndef STARTUP_H
+#define STARTUP_H
+
+#include <stdbool.h>
+
+#define RC_NAME ".soyshellrc" /* Rc file name in $HOME when SOYSHELLRC is not set */
+#define SNAP_SUFFIX ".snap" /* Suffix of the snapshot next to the rc file */
+#define SNAP_MAGIC "SOYSNAP2" /* First 8 bytes of a snapshot, bumped whenever the layout changes */
+
+bool startupLoad();
+bool startupSave();
+
+#endif
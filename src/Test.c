@@ -0,0 +1,232 @@
+/*
+  Conditions evaluated inside the shell
+*/
+#include "Parser.h"
+#include "Test.h"
+
+typedef struct
+{
+    const char *path;
+    bool exists;
+    struct statx st;
+} PathInfo;
+
+typedef struct
+{
+    char **argv;
+    int pos; /* Next argument to read */
+    int end; /* One past the last argument of the expression */
+    PathInfo paths[TEST_MAX_PATHS]; /* Paths already looked up */
+    unsigned int numPaths;
+    bool ok;
+} Test;
+
+static bool parseOr(Test*);
+
+/* Look the path up, or reuse what an earlier primary found */
+static const PathInfo* lookup(Test *t, const char *path)
+{
+    PathInfo *p = NULL;
+    for (unsigned int i = 0; i < t->numPaths; ++i)
+    {
+        if (strcmp(t->paths[i].path, path) == 0)
+            return &t->paths[i];
+    }
+    p = &t->paths[t->numPaths < TEST_MAX_PATHS ? t->numPaths++ : TEST_MAX_PATHS - 1];
+    p->path = path;
+    p->exists = statx(AT_FDCWD, path, AT_STATX_SYNC_AS_STAT, STATX_TYPE | STATX_SIZE | STATX_MTIME, &p->st) == 0;
+    return p;
+}
+
+static bool isUnary(const char *s)
+{
+    return s[0] == '-' && s[1] != '\0' && strchr("efdsnz", s[1]) != NULL && s[2] == '\0';
+}
+
+static bool isBinary(const char *s)
+{
+    static const char *ops[] = { "=", "==", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot" };
+    for (unsigned int i = 0; i < sizeof(ops) / sizeof(ops[0]); ++i)
+    {
+        if (strcmp(s, ops[i]) == 0)
+            return true;
+    }
+    return false;
+}
+
+static bool parseInt(Test *t, const char *s, long long *v)
+{
+    char *end = NULL;
+    errno = 0;
+    *v = strtoll(s, &end, 10);
+    while (isspace((unsigned char) *end))
+        ++end;
+    if (end == s || *end != '\0' || errno == ERANGE)
+    {
+        fprintf(stderr, "%s: integer expected, got '%s'\n", t->argv[0], s);
+        t->ok = false;
+        return false;
+    }
+    return true;
+}
+
+/* Check if the file at a was modified after the one at b. A missing file is older than any other */
+static bool newer(Test *t, const char *a, const char *b)
+{
+    const PathInfo *pa = lookup(t, a);
+    const PathInfo *pb = lookup(t, b);
+    if (!pa->exists)
+        return false;
+    if (!pb->exists)
+        return true;
+    if (pa->st.stx_mtime.tv_sec != pb->st.stx_mtime.tv_sec)
+        return pa->st.stx_mtime.tv_sec > pb->st.stx_mtime.tv_sec;
+    return pa->st.stx_mtime.tv_nsec > pb->st.stx_mtime.tv_nsec;
+}
+
+static bool binary(Test *t, const char *a, const char *op, const char *b)
+{
+    long long x;
+    long long y;
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0)
+        return strcmp(a, b) == 0;
+    if (strcmp(op, "!=") == 0)
+        return strcmp(a, b) != 0;
+    if (strcmp(op, "-nt") == 0)
+        return newer(t, a, b);
+    if (strcmp(op, "-ot") == 0)
+        return newer(t, b, a);
+    if (!parseInt(t, a, &x) || !parseInt(t, b, &y))
+        return false;
+    if (strcmp(op, "-eq") == 0)
+        return x == y;
+    if (strcmp(op, "-ne") == 0)
+        return x != y;
+    if (strcmp(op, "-lt") == 0)
+        return x < y;
+    if (strcmp(op, "-le") == 0)
+        return x <= y;
+    if (strcmp(op, "-gt") == 0)
+        return x > y;
+    return x >= y;
+}
+
+static bool unary(Test *t, char op, const char *s)
+{
+    const PathInfo *p = NULL;
+    if (op == 'n' || op == 'z')
+        return (s[0] != '\0') == (op == 'n');
+    p = lookup(t, s);
+    if (!p->exists)
+        return false;
+    switch (op)
+    {
+    case 'f': return S_ISREG(p->st.stx_mode);
+    case 'd': return S_ISDIR(p->st.stx_mode);
+    case 's': return p->st.stx_size > 0;
+    default: return true;
+    }
+}
+
+/* Parse ( EXPR ), a unary or binary primary or a lone string */
+static bool parsePrimary(Test *t)
+{
+    int n = t->end - t->pos;
+    char **a = t->argv + t->pos;
+    bool v;
+    if (n <= 0)
+    {
+        fprintf(stderr, "%s: argument expected\n", t->argv[0]);
+        t->ok = false;
+        return false;
+    }
+    if (n >= 3 && isBinary(a[1]))
+    {
+        t->pos += 3;
+        return binary(t, a[0], a[1], a[2]);
+    }
+    if (n >= 2 && strcmp(a[0], "(") == 0)
+    {
+        ++t->pos;
+        v = parseOr(t);
+        if (t->ok && (t->pos >= t->end || strcmp(t->argv[t->pos], ")") != 0))
+        {
+            fprintf(stderr, "%s: expected ')'\n", t->argv[0]);
+            t->ok = false;
+        }
+        ++t->pos;
+        return v;
+    }
+    if (n >= 2 && isUnary(a[0]))
+    {
+        t->pos += 2;
+        return unary(t, a[0][1], a[1]);
+    }
+    ++t->pos;
+    return a[0][0] != '\0';
+}
+
+/* Parse ! EXPR, unless the ! is the left operand of a binary primary */
+static bool parseNot(Test *t)
+{
+    int n = t->end - t->pos;
+    char **a = t->argv + t->pos;
+    if (n >= 2 && strcmp(a[0], "!") == 0 && !(n >= 3 && isBinary(a[1])))
+    {
+        ++t->pos;
+        return !parseNot(t);
+    }
+    return parsePrimary(t);
+}
+
+static bool parseAnd(Test *t)
+{
+    bool v = parseNot(t);
+    while (t->ok && t->pos < t->end && strcmp(t->argv[t->pos], "-a") == 0)
+    {
+        ++t->pos;
+        v = parseNot(t) && v;
+    }
+    return v;
+}
+
+static bool parseOr(Test *t)
+{
+    bool v = parseAnd(t);
+    while (t->ok && t->pos < t->end && strcmp(t->argv[t->pos], "-o") == 0)
+    {
+        ++t->pos;
+        v = parseAnd(t) || v;
+    }
+    return v;
+}
+
+/* Evaluate the expression in argv, which ends with ] when argv[0] is [ */
+int testRun(int argc, char **argv, int in, int out)
+{
+    Test t;
+    bool v;
+    t.argv = argv;
+    t.pos = 1;
+    t.end = argc;
+    t.numPaths = 0;
+    t.ok = true;
+    if (strcmp(argv[0], "[") == 0)
+    {
+        if (argc < 2 || strcmp(argv[argc - 1], "]") != 0)
+        {
+            fprintf(stderr, "[: missing ']'\n");
+            return 2;
+        }
+        --t.end;
+    }
+    if (t.end == 1) /* No expression is false */
+        return 1;
+    v = parseOr(&t);
+    if (t.ok && t.pos != t.end)
+    {
+        fprintf(stderr, "%s: unexpected '%s'\n", argv[0], argv[t.pos]);
+        return 2;
+    }
+    return t.ok ? !v : 2;
+}
@@ -0,0 +1,23 @@
+/*
+  The test and [ builtins
+
+  test EXPR or [ EXPR ]
+  Primaries:
+    -e FILE, -f FILE, -d FILE, -s FILE (exists, is a regular file, is a
+    directory, is not empty), FILE1 -nt FILE2, FILE1 -ot FILE2 (modification
+    times, a missing file is older than any other),
+    -n STRING, -z STRING, STRING, S1 = S2, S1 != S2,
+    N1 -eq N2, -ne, -lt, -le, -gt, -ge
+  combined with ! EXPR, EXPR -a EXPR, EXPR -o EXPR (-a binds tighter) and
+  ( EXPR ). Each path is looked up with one statx however many primaries
+  name it, so the builtin makes one system call per path and forks nothing
+  Returns 0 if the expression is true, 1 if it is false and 2 on errors
+*/
+#ifndef TEST_H
+#define TEST_H
+
+#define TEST_MAX_PATHS 16 /* Most distinct paths remembered in one expression */
+
+int testRun(int, char**, int, int);
+
+#endif
@@ -0,0 +1,138 @@
+/*
+  Parsing the timeout prefix and the TIMEOUT constant. The deadlines are
+  enforced by the job table
+*/
+#include "Parser.h"
+#include "Timeout.h"
+#include <signal.h>
+
+#define MAX_SECONDS 9000000000.0 /* Longest duration that fits in a long long of nanoseconds */
+
+/* Parse a duration such as 10, 0.5 or 2m into ns. Returns false if it is malformed */
+static bool parseDuration(const char *s, long long *ns)
+{
+    char *end = NULL;
+    double v = strtod(s, &end);
+    if (end == s || !(v >= 0)) /* Also rejects NaN */
+        return false;
+    if (*end != '\0' && end[1] == '\0')
+    {
+        switch (*end++)
+        {
+        case 's': break;
+        case 'm': v *= 60; break;
+        case 'h': v *= 3600; break;
+        case 'd': v *= 86400; break;
+        default: return false;
+        }
+    }
+    if (*end != '\0' || v > MAX_SECONDS)
+        return false;
+    *ns = (long long) (v * 1e9);
+    if (*ns == 0 && v > 0) /* Too short to count, but still a deadline */
+        *ns = 1;
+    return true;
+}
+
+/* Parse a signal written as a number or a name with or without SIG. Returns 0 if it is unknown */
+static int parseSignal(const char *s)
+{
+    static const struct { const char *name; int signal; } signals[] = {
+        { "HUP", SIGHUP },
+        { "INT", SIGINT },
+        { "QUIT", SIGQUIT },
+        { "KILL", SIGKILL },
+        { "USR1", SIGUSR1 },
+        { "USR2", SIGUSR2 },
+        { "PIPE", SIGPIPE },
+        { "ALRM", SIGALRM },
+        { "TERM", SIGTERM },
+        { "CONT", SIGCONT },
+        { "STOP", SIGSTOP },
+    };
+    char *end = NULL;
+    long n = strtol(s, &end, 10);
+    if (end != s && *end == '\0')
+        return n > 0 && n < NSIG ? (int) n : 0;
+    if (strncmp(s, "SIG", 3) == 0)
+        s += 3;
+    for (unsigned int i = 0; i < sizeof(signals) / sizeof(signals[0]); ++i)
+    {
+        if (strcmp(s, signals[i].name) == 0)
+            return signals[i].signal;
+    }
+    return 0;
+}
+
+/*
+  Parse the options and duration of a timeout prefix. argv[0] is "timeout"
+  used: Set to the index of the first word of the command being timed
+  Returns false (after printing why) if the options are invalid or there is no command
+*/
+bool timeoutParse(char **argv, unsigned int numArgs, Deadline *d, unsigned int *used)
+{
+    unsigned int i = 1;
+    d->signal = SIGTERM;
+    d->graceNs = TIMEOUT_GRACE * 1000000000LL;
+    while (i < numArgs && argv[i][0] == '-')
+    {
+        char opt = argv[i][1];
+        if (strcmp(argv[i], "--") == 0)
+        {
+            ++i;
+            break;
+        }
+        if ((opt != 's' && opt != 'k') || argv[i][2] != '\0')
+        {
+            fprintf(stderr, "timeout: invalid option \'%s\'\n", argv[i]);
+            return false;
+        }
+        if (i + 1 >= numArgs)
+        {
+            fprintf(stderr, "timeout: option \'%s\' needs a value\n", argv[i]);
+            return false;
+        }
+        if (opt == 's' && (d->signal = parseSignal(argv[i + 1])) == 0)
+        {
+            fprintf(stderr, "timeout: invalid signal \'%s\'\n", argv[i + 1]);
+            return false;
+        }
+        if (opt == 'k' && !parseDuration(argv[i + 1], &d->graceNs))
+        {
+            fprintf(stderr, "timeout: invalid duration \'%s\'\n", argv[i + 1]);
+            return false;
+        }
+        i += 2;
+    }
+    if (i >= numArgs)
+    {
+        fprintf(stderr, "timeout: no duration given\n");
+        return false;
+    }
+    if (!parseDuration(argv[i], &d->ns))
+    {
+        fprintf(stderr, "timeout: invalid duration \'%s\'\n", argv[i]);
+        return false;
+    }
+    if (++i >= numArgs)
+    {
+        fprintf(stderr, "timeout: no command given\n");
+        return false;
+    }
+    *used = i;
+    return true;
+}
+
+/* Get the deadline of commands without a timeout prefix from the TIMEOUT constant, 0 ns if it isn't set */
+void timeoutDefault(Deadline *d)
+{
+    const char *val = getConst("TIMEOUT");
+    d->ns = 0;
+    d->signal = SIGTERM;
+    d->graceNs = TIMEOUT_GRACE * 1000000000LL;
+    if (val[0] != '\0' && !parseDuration(val, &d->ns))
+    {
+        fprintf(stderr, "timeout: invalid duration \'%s\' in TIMEOUT\n", val);
+        d->ns = 0;
+    }
+}
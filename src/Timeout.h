@@ -0,0 +1,26 @@
+/*
+  Deadlines of commands
+
+  A command line can start with the timeout prefix to limit how long the
+  command runs:
+    timeout [-s SIGNAL] [-k GRACE] [--] DURATION COMMAND...
+  Durations are numbers of seconds, possibly fractional, with an optional s,
+  m, h or d suffix. Once DURATION has passed the job gets SIGNAL (TERM by
+  default), and SIGKILL if it is still running GRACE later (TIMEOUT_GRACE
+  seconds by default, -k 0 never sends it). The job's status is then
+  JOBS_TIMED_OUT. On the first stage of a pipeline the deadline covers every
+  stage. Commands without the prefix get the deadline in the TIMEOUT
+  constant, if it is set
+*/
+#ifndef TIMEOUT_H
+#define TIMEOUT_H
+
+#include "Jobs.h"
+#include <stdbool.h>
+
+#define TIMEOUT_GRACE 5 /* Seconds between the signal and SIGKILL unless -k is given */
+
+bool timeoutParse(char**, unsigned int, Deadline*, unsigned int*);
+void timeoutDefault(Deadline*);
+
+#endif
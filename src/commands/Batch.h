@@ -0,0 +1,311 @@
+/*
+  Batched path operations for the commands, using io_uring when it is available
+
+  batchRun creates or removes every path with as few system calls as
+  possible: the operations are queued on an io_uring and submitted together,
+  so on filesystems where every call waits on the network the latencies
+  overlap instead of adding up. Paths that depend on each other (a directory
+  and something inside it) are never in flight at the same time, so the
+  result is the same as doing the operations one by one in order. Paths are
+  compared after dropping . components and repeated or trailing slashes, and
+  paths with .. or an absolute path next to a relative one are always kept
+  in order. Without
+  io_uring (old kernel, disabled by sysctl, missing opcode) the plain system
+  calls are used instead
+
+  The commands are each built from a single file, so the helpers are defined
+  here rather than in a separate translation unit
+*/
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define BATCH_ENTRIES 256 /* Size of the submission queue, the most operations in flight at once */
+#define BATCH_MIN 8 /* Fewer paths than this are cheaper to handle with plain system calls */
+#define BATCH_NO_RETRY (~0u) /* batchRun retry argument for operations that are not tried again */
+
+typedef struct
+{
+    int fd;
+    unsigned int sqEntries;
+    unsigned int *sqTail;
+    unsigned int *sqMask;
+    unsigned int *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned int *cqHead;
+    unsigned int *cqTail;
+    unsigned int *cqMask;
+    struct io_uring_cqe *cqes;
+    void *sqRing;
+    size_t sqSize;
+    void *cqRing; /* Same as sqRing if the kernel maps both rings at once */
+    size_t cqSize;
+    size_t sqesSize;
+} Batch;
+
+/* Check if the kernel of the ring supports op */
+static bool batchProbe(int fd, int op)
+{
+    struct io_uring_probe *probe = NULL;
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    bool ok;
+    probe = (struct io_uring_probe*) calloc(1, size);
+    if (probe == NULL)
+        return false;
+    ok = syscall(SYS_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0
+        && op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return ok;
+}
+
+/* Release the ring */
+static void batchClose(Batch *b)
+{
+    if (b->sqes != NULL && b->sqes != MAP_FAILED)
+        munmap(b->sqes, b->sqesSize);
+    if (b->cqRing != NULL && b->cqRing != MAP_FAILED && b->cqRing != b->sqRing)
+        munmap(b->cqRing, b->cqSize);
+    if (b->sqRing != NULL && b->sqRing != MAP_FAILED)
+        munmap(b->sqRing, b->sqSize);
+    if (b->fd != -1)
+        close(b->fd);
+}
+
+/* Set up a ring able to run op. Returns false if io_uring can't be used */
+static bool batchOpen(Batch *b, unsigned int entries, int op)
+{
+    struct io_uring_params p;
+    memset(b, 0, sizeof(*b));
+    memset(&p, 0, sizeof(p));
+    b->fd = syscall(SYS_io_uring_setup, entries, &p);
+    if (b->fd == -1)
+        return false;
+    if (!batchProbe(b->fd, op))
+    {
+        batchClose(b);
+        return false;
+    }
+    b->sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    b->cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (b->cqSize > b->sqSize)
+            b->sqSize = b->cqSize;
+        b->cqSize = b->sqSize;
+    }
+    b->sqRing = mmap(NULL, b->sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, b->fd, IORING_OFF_SQ_RING);
+    if (b->sqRing == MAP_FAILED)
+    {
+        batchClose(b);
+        return false;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        b->cqRing = b->sqRing;
+    else
+        b->cqRing = mmap(NULL, b->cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, b->fd, IORING_OFF_CQ_RING);
+    b->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    b->sqes = (struct io_uring_sqe*) mmap(NULL, b->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, b->fd, IORING_OFF_SQES);
+    if (b->cqRing == MAP_FAILED || b->sqes == MAP_FAILED)
+    {
+        batchClose(b);
+        return false;
+    }
+    b->sqEntries = p.sq_entries;
+    b->sqTail = (unsigned int*) ((char*) b->sqRing + p.sq_off.tail);
+    b->sqMask = (unsigned int*) ((char*) b->sqRing + p.sq_off.ring_mask);
+    b->sqArray = (unsigned int*) ((char*) b->sqRing + p.sq_off.array);
+    b->cqHead = (unsigned int*) ((char*) b->cqRing + p.cq_off.head);
+    b->cqTail = (unsigned int*) ((char*) b->cqRing + p.cq_off.tail);
+    b->cqMask = (unsigned int*) ((char*) b->cqRing + p.cq_off.ring_mask);
+    b->cqes = (struct io_uring_cqe*) ((char*) b->cqRing + p.cq_off.cqes);
+    return true;
+}
+
+/*
+  Copy path into out (PATH_MAX bytes) without . components, repeated slashes
+  or a trailing slash, so ./x/ becomes x and . becomes the empty string
+  Returns false if the path has a .. component or is too long to compare
+*/
+static bool batchNormal(const char *path, char *out)
+{
+    size_t n = 0;
+    size_t len;
+    if (*path == '/')
+        out[n++] = '/';
+    while (*path != '\0')
+    {
+        while (*path == '/')
+            ++path;
+        len = strcspn(path, "/");
+        if (len == 2 && path[0] == '.' && path[1] == '.')
+            return false;
+        if (len > 0 && !(len == 1 && path[0] == '.'))
+        {
+            if (n + len + 2 > PATH_MAX)
+                return false;
+            if (n > 0 && out[n - 1] != '/')
+                out[n++] = '/';
+            memcpy(out + n, path, len);
+            n += len;
+        }
+        path += len;
+    }
+    out[n] = '\0';
+    return true;
+}
+
+/* Check if the paths name the same file or one is inside the other, in which case their order matters */
+static bool batchRelated(const char *a, const char *b)
+{
+    char na[PATH_MAX];
+    char nb[PATH_MAX];
+    size_t la;
+    size_t lb;
+    if (!batchNormal(a, na) || !batchNormal(b, nb) || (na[0] == '/') != (nb[0] == '/'))
+        return true; /* Can't tell by looking at the names */
+    la = strlen(na);
+    lb = strlen(nb);
+    if (la > lb)
+        return strncmp(na, nb, lb) == 0 && (lb == 0 || na[lb] == '/' || nb[lb - 1] == '/');
+    return strncmp(na, nb, la) == 0 && (la == 0 || la == lb || nb[la] == '/' || na[la - 1] == '/');
+}
+
+/*
+  Submit the operations on paths[first..last) and wait for all of them
+  Returns false if the kernel refused the submission
+*/
+static bool batchSubmit(Batch *b, int op, char **paths, unsigned int first, unsigned int last, unsigned int arg, int *res)
+{
+    unsigned int tail = *b->sqTail;
+    unsigned int count = last - first;
+    unsigned int done = 0;
+    unsigned int head;
+    int r;
+    for (unsigned int i = first; i < last; ++i)
+    {
+        unsigned int idx = tail & *b->sqMask;
+        struct io_uring_sqe *sqe = &b->sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = op;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (unsigned long) paths[i];
+        if (op == IORING_OP_MKDIRAT)
+            sqe->len = arg; /* Mode */
+        else
+            sqe->unlink_flags = arg;
+        sqe->user_data = i;
+        b->sqArray[idx] = idx;
+        ++tail;
+    }
+    __atomic_store_n(b->sqTail, tail, __ATOMIC_RELEASE);
+    while ((r = syscall(SYS_io_uring_enter, b->fd, count, count, IORING_ENTER_GETEVENTS, NULL, 0)) == -1 && errno == EINTR)
+        ;
+    if (r == -1)
+        return false;
+    while (done < count)
+    {
+        head = *b->cqHead;
+        if (head == __atomic_load_n(b->cqTail, __ATOMIC_ACQUIRE)) /* Wait for the rest */
+        {
+            if (syscall(SYS_io_uring_enter, b->fd, 0, count - done, IORING_ENTER_GETEVENTS, NULL, 0) == -1 && errno != EINTR)
+                return false;
+            continue;
+        }
+        res[b->cqes[head & *b->cqMask].user_data] = b->cqes[head & *b->cqMask].res;
+        __atomic_store_n(b->cqHead, head + 1, __ATOMIC_RELEASE);
+        ++done;
+    }
+    return true;
+}
+
+/* Run the operation on one path with a plain system call, then with retry as the flags if it wasn't a directory */
+static int batchSync(int op, const char *path, unsigned int arg, unsigned int retry)
+{
+    int r = op == IORING_OP_MKDIRAT ? mkdirat(AT_FDCWD, path, arg) : unlinkat(AT_FDCWD, path, arg);
+    if (r == -1 && errno == ENOTDIR && retry != BATCH_NO_RETRY)
+        r = unlinkat(AT_FDCWD, path, retry);
+    return r == -1 ? -errno : 0;
+}
+
+/*
+  Try the operations on paths[first..last) that failed with ENOTDIR again
+  with retry as the flags, before any later path is started
+*/
+static void batchRetry(Batch *b, int op, char **paths, unsigned int first, unsigned int last, unsigned int retry, int *res)
+{
+    char *again[BATCH_ENTRIES];
+    unsigned int index[BATCH_ENTRIES];
+    int againRes[BATCH_ENTRIES];
+    unsigned int n = 0;
+    for (unsigned int i = first; i < last; ++i)
+    {
+        if (res[i] == -ENOTDIR)
+        {
+            index[n] = i;
+            again[n++] = paths[i];
+        }
+    }
+    if (n == 0)
+        return;
+    if (!batchSubmit(b, op, again, 0, n, retry, againRes))
+    {
+        for (unsigned int k = 0; k < n; ++k)
+            againRes[k] = batchSync(op, again[k], retry, BATCH_NO_RETRY);
+    }
+    for (unsigned int k = 0; k < n; ++k)
+        res[index[k]] = againRes[k];
+}
+
+/*
+  Apply op (IORING_OP_MKDIRAT with arg as the mode, or IORING_OP_UNLINKAT
+  with arg as the flags) to each of the n paths, storing 0 or -errno for
+  each one in res
+  retry: Flags to unlink a path with when arg failed because it isn't a
+  directory (rm tries AT_REMOVEDIR, then a plain unlink), or BATCH_NO_RETRY.
+  The retry finishes before any path depending on it starts
+*/
+static void batchRun(int op, char **paths, unsigned int n, unsigned int arg, unsigned int retry, int *res)
+{
+    Batch b;
+    unsigned int first = 0;
+    unsigned int last = 0;
+    if (n < BATCH_MIN || !batchOpen(&b, n < BATCH_ENTRIES ? n : BATCH_ENTRIES, op))
+    {
+        for (unsigned int i = 0; i < n; ++i)
+            res[i] = batchSync(op, paths[i], arg, retry);
+        return;
+    }
+    while (first < n)
+    {
+        /* Extend the batch up to the queue size or a path depending on one already in it */
+        for (last = first + 1; last < n && last - first < b.sqEntries; ++last)
+        {
+            unsigned int k = first;
+            while (k < last && !batchRelated(paths[k], paths[last]))
+                ++k;
+            if (k < last)
+                break;
+        }
+        if (!batchSubmit(&b, op, paths, first, last, arg, res))
+            break;
+        if (retry != BATCH_NO_RETRY)
+            batchRetry(&b, op, paths, first, last, retry, res);
+        first = last;
+    }
+    batchClose(&b);
+    for (; first < n; ++first) /* The ring stopped working, finish the rest one by one */
+        res[first] = batchSync(op, paths[first], arg, retry);
+}
+
+#endif
@@ -1,25 +1,30 @@
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <stdio.h>
-#include <errno.h>
-int main(int argc, char **argv)
-{
-    int status;
-    int r = 0;
-    if (argc < 2)
-    {
-	    puts("No arguments given");
-	    return 1;
-    }
-    for (int i = 1; i < argc; i++) {
-        status = mkdir(argv[i],0700);
-        if (status == -1)
-        {
-            if (errno == EEXIST) {
-                printf("Error: directory %s already exists\n",argv[i]);
-            }
-            r = 1;
-        }
-    }
-    return r;
-}
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <errno.h>
+#include "Batch.h"
+int main(int argc, char **argv)
+{
+    int *res;
+    int r = 0;
+    if (argc < 2)
+    {
+	    puts("No arguments given");
+	    return 1;
+    }
+    res = (int*) malloc((argc - 1) * sizeof(int));
+    if (res == NULL)
+        return 1;
+    batchRun(IORING_OP_MKDIRAT, argv + 1, argc - 1, 0700, BATCH_NO_RETRY, res);
+    for (int i = 1; i < argc; i++) {
+        if (res[i - 1] < 0)
+        {
+            if (res[i - 1] == -EEXIST) {
+                printf("Error: directory %s already exists\n",argv[i]);
+            }
+            r = 1;
+        }
+    }
+    free(res);
+    return r;
+}
@@ -1,22 +1,27 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include "Batch.h"
 
 int main (int argc, char **argv)
 {
+    int *res;
+    int r = 0;
     if (argc < 2) {
         puts("No directory/directories given");
         return 1;
     }
+    res = (int*) malloc((argc - 1) * sizeof(int));
+    if (res == NULL)
+        return 1;
+    /* Each path is removed as a directory, or as a file if it isn't one, before any later path inside it */
+    batchRun(IORING_OP_UNLINKAT, argv + 1, argc - 1, AT_REMOVEDIR, 0, res);
     for (int i = 1; i < argc; i++) {
-        int r = rmdir(argv[i]);
-        if (r == -1) {
-            int r = remove(argv[i]);
-            if (r == -1) {
-                printf("%s could not be removed: either not empty or nonexistent\n", argv[i]);
-                return 1;
-            }
+        if (res[i - 1] < 0) {
+            printf("%s could not be removed: either not empty or nonexistent\n", argv[i]);
+            r = 1;
         }
     }
-    return 0;
+    free(res);
+    return r;
 }
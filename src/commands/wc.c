@@ -0,0 +1,223 @@
+/*
+  wc [-l] [-w] [-c] [FILE]...
+
+  Counts 32 bytes at a time with AVX2 (16 with SSE2): each block becomes a
+  bitmask of newlines and one of whitespace, lines are the popcount of the
+  first and words the popcount of the non-space bytes that follow a space.
+  Regular files are mmapped, anything else is read in large blocks
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#define WC_X86
+#endif
+
+#define BLOCK (1 << 20) /* Bytes read at once from pipes and terminals */
+
+typedef struct
+{
+    size_t lines;
+    size_t words;
+    size_t bytes;
+    bool inSpace; /* The last byte counted was whitespace, a word starts at the next non-space byte */
+} Counts;
+
+typedef void (*CountFn)(const unsigned char*, size_t, Counts*);
+
+/* Count the bytes one at a time */
+static void countTail(const unsigned char *s, size_t n, Counts *c)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        bool space = s[i] == ' ' || (s[i] >= '\t' && s[i] <= '\r');
+        c->lines += s[i] == '\n';
+        c->words += c->inSpace && !space;
+        c->inSpace = space;
+    }
+    c->bytes += n;
+}
+
+#ifdef WC_X86
+static void countSse2(const unsigned char *s, size_t n, Counts *c)
+{
+    __m128i nl = _mm_set1_epi8('\n');
+    uint32_t carry = c->inSpace;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*) (s + i));
+        __m128i t = _mm_sub_epi8(v, _mm_set1_epi8('\t')); /* \t..\r become 0..4 */
+        __m128i sp = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(4)), t), _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+        uint32_t space = (uint32_t) _mm_movemask_epi8(sp);
+        c->lines += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)));
+        c->words += __builtin_popcount(~space & ((space << 1) | carry) & 0xFFFF);
+        carry = space >> 15;
+    }
+    c->inSpace = carry;
+    c->bytes += i;
+    countTail(s + i, n - i, c);
+}
+
+__attribute__((target("avx2")))
+static void countAvx2(const unsigned char *s, size_t n, Counts *c)
+{
+    __m256i nl = _mm256_set1_epi8('\n');
+    uint32_t carry = c->inSpace;
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (s + i));
+        __m256i t = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+        __m256i sp = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8(4)), t), _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+        uint32_t space = (uint32_t) _mm256_movemask_epi8(sp);
+        c->lines += __builtin_popcount((uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl)));
+        c->words += __builtin_popcount(~space & ((space << 1) | carry));
+        carry = space >> 31;
+    }
+    c->inSpace = carry;
+    c->bytes += i;
+    countSse2(s + i, n - i, c);
+}
+#endif
+
+/* Pick the widest implementation the CPU supports */
+static CountFn pickCount()
+{
+#ifdef WC_X86
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? countAvx2 : countSse2;
+#else
+    return countTail;
+#endif
+}
+
+/* Count everything that can be read from fd. Returns 0 on success */
+static int countFd(int fd, CountFn count, Counts *c)
+{
+    static unsigned char buf[BLOCK];
+    struct stat st;
+    ssize_t n;
+    c->inSpace = true;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            count((const unsigned char*) map, st.st_size, c);
+            munmap(map, st.st_size);
+            return 0;
+        }
+    }
+    while ((n = read(fd, buf, sizeof(buf))) != 0)
+    {
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+        count(buf, n, c);
+    }
+    return 0;
+}
+
+/* Print the selected counts followed by the name, if any */
+static void printCounts(const Counts *c, bool lines, bool words, bool bytes, const char *name)
+{
+    const char *sep = "";
+    if (lines)
+    {
+        printf("%7zu", c->lines);
+        sep = " ";
+    }
+    if (words)
+    {
+        printf("%s%7zu", sep, c->words);
+        sep = " ";
+    }
+    if (bytes)
+        printf("%s%7zu", sep, c->bytes);
+    if (name != NULL)
+        printf(" %s", name);
+    putchar('\n');
+}
+
+int main(int argc, char **argv)
+{
+    CountFn count = pickCount();
+    Counts total = { 0, 0, 0, true };
+    Counts c;
+    bool lines = false;
+    bool words = false;
+    bool bytes = false;
+    int first = 1;
+    int fd;
+    int r = 0;
+    for (; first < argc && argv[first][0] == '-' && argv[first][1] != '\0'; ++first)
+    {
+        for (const char *o = argv[first] + 1; *o != '\0'; ++o)
+        {
+            if (*o == 'l')
+                lines = true;
+            else if (*o == 'w')
+                words = true;
+            else if (*o == 'c')
+                bytes = true;
+            else
+            {
+                fprintf(stderr, "wc: invalid option -%c\n", *o);
+                return 1;
+            }
+        }
+    }
+    if (!lines && !words && !bytes)
+        lines = words = bytes = true;
+    if (first == argc) /* No files, count stdin */
+    {
+        memset(&c, 0, sizeof(c));
+        if (countFd(0, count, &c) != 0)
+        {
+            perror("wc");
+            return 1;
+        }
+        printCounts(&c, lines, words, bytes, NULL);
+        return 0;
+    }
+    for (int i = first; i < argc; ++i)
+    {
+        memset(&c, 0, sizeof(c));
+        fd = strcmp(argv[i], "-") == 0 ? 0 : open(argv[i], O_RDONLY);
+        if (fd == -1)
+        {
+            fprintf(stderr, "wc: could not open %s\n", argv[i]);
+            r = 1;
+            continue;
+        }
+        if (countFd(fd, count, &c) != 0)
+        {
+            fprintf(stderr, "wc: error reading %s: %s\n", argv[i], strerror(errno));
+            r = 1;
+        }
+        else
+            printCounts(&c, lines, words, bytes, argv[i]);
+        if (fd != 0)
+            close(fd);
+        total.lines += c.lines;
+        total.words += c.words;
+        total.bytes += c.bytes;
+    }
+    if (argc - first > 1)
+        printCounts(&total, lines, words, bytes, "total");
+    return r;
+}
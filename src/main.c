@@ -1,11 +1,27 @@
 #include "Parser.h"
+#include "History.h"
+#include "Editor.h"
+#include "Startup.h"
+#include "Server.h"
+#include "Jobs.h"
 
-int main() {
+int main(int argc, char **argv) {
    init();
+    if (argc == 3 && strcmp(argv[1], "--serve") == 0) { /* Serve command lines over a socket instead of reading them */
+        startupLoad();
+        int r = serve(argv[2]);
+        finish();
+        return r;
+    }
+    if (argc > 1) {
+        fprintf(stderr, "usage: soyshell [--serve SOCKET]\n");
+        finish();
+        return 2;
+    }
+    jobsInit(isatty(0));
+    startupLoad();
     char d[PATH_MAX] = "";
     char user[BUFF_MAX] = "";
-    int nread = 0;
-    size_t n = 0;
     int len = 0;
 
     unsigned int i = 0;
@@ -19,30 +35,37 @@ int main() {
         strncpy(user,"anonymous",10);
     }
     
+    /* Only record interactive sessions unless a history file is asked for */
+    if (isatty(0) || getenv("HISTFILE") != NULL)
+        histOpen(NULL);
+
     char *expr = NULL;
+    char prompt[BUFF_MAX + PATH_MAX];
     puts("Welcome to soyshell!");
     while (1) {
         if (getcwd(d, sizeof(d)) == NULL) {
             return 0;
         }
+        jobsPoll(); /* Report background jobs that finished */
         i = strlen(d);
         while (i > 0 && d[i-1] != '/')
             i--;
-        printf("%s@soyshell %s > ", user, d +i);
-        if ((nread = getline(&expr,&n, stdin)) == -1) {
-            printf("%s\n","Failed to read stdin");
-            continue;
-        }
+        snprintf(prompt, sizeof(prompt), "%s@soyshell %s > ", user, d +i);
+        if ((expr = editorReadLine(prompt)) == NULL) /* End of input */
+            break;
         len = strlen(expr);
-        if (expr[len-1] == '\n')
-            expr[len-1] = 0;        
-        if (len == 0) /* Empty expression */
+        if (len == 0) { /* Empty expression */
+            free(expr);
             continue;
+        }
+        if (histIsOpen())
+            histAdd(expr);
         lastResult = evalExpr(expr);
         free(expr);
         expr = NULL;
     }
     free(expr);
+    histClose();
     finish();
-    return 0;  
+    return lastResult;  
 }
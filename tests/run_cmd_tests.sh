@@ -49,6 +49,10 @@ $BIN/mkdir temp/"test dir" >> log.txt
 [[ $? == 0 ]] && [ -d temp/"test dir" ] && echo "PASSED" || echo "FAILED"
 $BIN/mkdir >> log.txt
 [[ $? == 1 ]] && echo "PASSED" || echo "FAILED"
+$BIN/mkdir temp/batch temp/batch/a temp/batch/a/b temp/batch/1 temp/batch/2 temp/batch/3 temp/batch/4 temp/batch/5 temp/batch/6 >> log.txt
+[[ $? == 0 ]] && [ -d temp/batch/a/b ] && [ -d temp/batch/6 ] && echo "PASSED" || echo "FAILED"
+$BIN/mkdir temp/batch/1 temp/batch/7 temp/batch/8 temp/batch/9 temp/batch/10 temp/batch/11 temp/batch/12 temp/batch/13 >> log.txt
+[[ $? == 1 ]] && [ -d temp/batch/13 ] && echo "PASSED" || echo "FAILED"
 
 # Test rmdir
 echo "Testing rmdir..."
@@ -66,6 +70,15 @@ $BIN/rmdir temp/"test dir" >> log.txt
 [[ $? == 0 ]] && ! [ -d temp/"test dir" ] && echo "PASSED" || echo "FAILED"
 $BIN/rmdir ../fake_dir2 >> log.txt
 [[ $? == 1 ]] && ! [ -d ../"fake_dir2" ] && echo "PASSED" || echo "FAILED"
+touch temp/batch/file
+$BIN/rmdir temp/batch/a/b temp/batch/a temp/batch/file temp/batch/1 temp/batch/2 temp/batch/3 temp/batch/4 temp/batch/5 temp/batch/fake >> log.txt
+[[ $? == 1 ]] && ! [ -e temp/batch/a ] && ! [ -e temp/batch/file ] && ! [ -d temp/batch/5 ] && [ -d temp/batch/6 ] && echo "PASSED" || echo "FAILED"
+mkdir temp/rm_dir && touch temp/rm_dir/file
+$BIN/rm temp/rm_dir/file temp/rm_dir >> log.txt
+[[ $? == 0 ]] && ! [ -e temp/rm_dir ] && echo "PASSED" || echo "FAILED"
+mkdir temp/rm_dir temp/rm_dir/sub temp/rm_x && touch temp/rm_dir/sub/file temp/rm_dir/file
+$BIN/rm ./temp/rm_dir/sub/file temp/rm_dir/sub/ temp/rm_dir//file ./temp/rm_dir/ temp/batch/6 temp/batch/7 temp/batch/8 ./temp/rm_x temp/rm_x >> log.txt
+[[ $? == 1 ]] && ! [ -e temp/rm_dir ] && ! [ -e temp/rm_x ] && ! [ -d temp/batch/8 ] && echo "PASSED" || echo "FAILED"
 
 # Test pwd
 echo "Testing pwd..."
@@ -73,6 +86,18 @@ echo "Testing pwd..."
 $BIN/pwd three extra arguments >> log.txt
 [[ $? == 1 ]] && echo "PASSED" || echo "FAILED"
 
+# Test wc
+echo "Testing wc..."
+seq 1 100000 | sed 's/$/ word\tand  more/' > temp/wc.txt
+printf 'last line  without newline' >> temp/wc.txt
+read L W C N <<< "$($BIN/wc temp/wc.txt)"
+read l w c n <<< "$(wc temp/wc.txt)"
+[[ $? == 0 ]] && [[ $L == $l ]] && [[ $W == $w ]] && [[ $C == $c ]] && [[ $N == "temp/wc.txt" ]] && echo "PASSED" || echo "FAILED"
+[[ $(cat temp/wc.txt | $BIN/wc -l) -eq $l ]] && [[ $($BIN/wc -w < temp/wc.txt) -eq $w ]] && echo "PASSED" || echo "FAILED"
+[[ $($BIN/wc -c temp/foo.txt temp/wc.txt | tail -1) == "$(printf '%7d total' $((c + $(wc -c < temp/foo.txt))))" ]] && echo "PASSED" || echo "FAILED"
+$BIN/wc temp/notRealFile.txt >> log.txt 2>&1
+[[ $? == 1 ]] && echo "PASSED" || echo "FAILED"
+
 # Clean up
 rm -r temp
 rm foo.txt
@@ -1,6 +1,10 @@
 #!/bin/bash
 # Run the shell test input
 mkdir temp
+export HISTFILE=$(pwd)/temp_history # Keep the test history away from the real one
+export SOYSHELLRC=$(pwd)/temp_rc # Same for the rc file, which does not exist until the rc test
+rm -f temp_history temp_history.idx
+head -c 1000000 /dev/urandom > temp/random.bin # Input for tee, large enough to fill several pipe buffers
 ../soyshell < shell_test.txt 1> log.txt 2>> log.txt
 # Verify the results
 echo "Testing user defined constants..."
@@ -13,5 +17,62 @@ echo "Testing braces..."
 [ -d temp/brace_test1 ] && [ -d temp/brace_test2 ] && ! [ -d temp/brace_test3 ] && [ -d temp/brace_test4 ] && echo "PASSED" || echo "FAILED"
 echo "Testing quotes..."
 [ -d temp/dir\ with\ space ] && echo "PASSED" || echo "FAILED"
+echo "Testing command substitution..."
+[ -d "temp/builtin subst" ] && [ -d temp/inner_outer ] && [ -d temp/forked ] && ! [ -d temp/temp ] && echo "PASSED" || echo "FAILED"
+echo "Testing export..."
+grep -qx "EXPORTED=visible/updated" temp/env.txt && grep -qx "PATH=../bin" temp/env.txt && ! grep -q "HIDDEN" temp/env.txt && echo "PASSED" || echo "FAILED"
+echo "Testing glob expansion..."
+[ -d temp/glob/a1 ] && ! [ -d temp/glob/a2 ] && ! [ -d temp/glob/b1 ] && ! [ -d temp/glob/b2 ] && [ -d temp/glob/.hidden2 ] && [ -d "temp/glob/z?" ] && echo "PASSED" || echo "FAILED"
+echo "Testing jobs..."
+[ -d temp/wait_all ] && [ -d temp/wait_status ] && [ -d temp/wait_none ] && echo "PASSED" || echo "FAILED"
+echo "Testing place prefix..."
+grep -qP "^Cpus_allowed_list:\t0$" temp/place.txt && [[ $(cut -d' ' -f19 temp/place_stage.txt) == 6 ]] && [ -d temp/place_invalid ] && [ -d temp/place_builtin ] && echo "PASSED" || echo "FAILED"
+echo "Testing long lines..."
+[ -d temp/long_line ] && [ -d temp/long_name ] && [ -d temp/long_quoted ] && echo "PASSED" || echo "FAILED"
+echo "Testing parameter expansion..."
+[ -d temp/archive ] && [ -d temp/xtar.gz ] && [ -d temp/len14 ] && [ -d temp/default ] && [ -d temp/status1 ] && echo "PASSED" || echo "FAILED"
+echo "Testing redirections..."
+[[ $(cat temp/trunc.txt) == "short" ]] && grep -q missing temp/both.txt && grep -q a1 temp/both.txt && grep -q missing temp/err.txt && grep -q missing temp/amp.txt \
+    && [[ $(cat temp/dup.txt) == "short" ]] && [[ $(cat temp/log.old) == $'one\ntwo' ]] && [[ $(cat temp/log.txt) == "three" ]] && echo "PASSED" || echo "FAILED"
+echo "Testing grep..."
+[[ $(cat temp/grep.txt) == "glob" ]] && grep -qx "temp/trunc.txt:1" temp/grep_count.txt && grep -qx "temp/listing.txt:$(($(wc -l < temp/listing.txt) - 1))" temp/grep_count.txt \
+    && [[ $(cat temp/grep_list.txt) == "temp/trunc.txt" ]] && [[ $(cat temp/grep_re.txt) == "1:short" ]] && [ -d temp/grep_none ] && echo "PASSED" || echo "FAILED"
+echo "Testing sort..."
+cmp -s temp/sorted.txt <(LC_ALL=C sort temp/listing.txt) && cmp -s temp/sorted_rev.txt <(LC_ALL=C sort -r temp/listing.txt temp/trunc.txt) && echo "PASSED" || echo "FAILED"
+echo "Testing cache prefix..."
+[[ $(cat temp/cached.txt) == "built" ]] && [ -d temp/cache_out ] && [ -d temp/cache2_out ] && [[ $(wc -l < temp/cache_runs.txt) == 1 ]] && [[ $(wc -l < temp/cache_in_runs.txt) == 2 ]] \
+    && [[ $(wc -l < temp/cache_fail_runs.txt) == 1 ]] && [ -d temp/cache_status3 ] && [[ $(wc -l < temp/cache_redir_runs.txt) == 2 ]] \
+    && [[ $(cat temp/cache_redir_hit.txt) == "a" ]] && [[ $(cat temp/cache_redir_out.txt) == "bb" ]] && [[ $(cat temp/cache_append.txt) == $'x\nx\nmanual\nx' ]] && echo "PASSED" || echo "FAILED"
+echo "Testing arithmetic..."
+[ -d temp/arith_8 ] && [ -d temp/arith_-14 ] && [ -d temp/let_zero ] && echo "PASSED" || echo "FAILED"
+echo "Testing test builtin..."
+[ -d temp/test_files ] && [ -d temp/test_compare ] && ! [ -d temp/test_guard ] && [ -d temp/test_status2 ] && echo "PASSED" || echo "FAILED"
+echo "Testing timeout prefix..."
+[ -d temp/timeout_status124 ] && [ -d temp/timeout_pipe124 ] && [ -d temp/timeout_fast ] && ! [ -d temp/timeout_survived ] && echo "PASSED" || echo "FAILED"
+echo "Testing redirecting the shell's descriptors..."
+printf 'PATH = ../bin\n/bin/true &\nwait 3> /dev/null 4> /dev/null 5> /dev/null 6> /dev/null 7> /dev/null 8> /dev/null\nmkdir temp/wait_redirected\n' | HISTFILE=temp/wait_history timeout 5 ../soyshell > /dev/null && [ -d temp/wait_redirected ] && echo "PASSED" || echo "FAILED"
+echo "Testing cat..."
+cmp -s temp/cat_out.txt <(cat temp/trunc.txt temp/listing.txt) && [[ $(cat temp/cat_pipe.txt) == $'short\nshort' ]] && [ -d temp/cat_short ] && [ -d temp/cat_missing ] && echo "PASSED" || echo "FAILED"
+echo "Testing tee..."
+cmp -s temp/random.bin temp/tee1.bin && cmp -s temp/random.bin temp/tee2.bin && cmp -s temp/random.bin temp/tee3.bin && [[ $(cat temp/tee4.txt) == $'short\nshort' ]] \
+    && [[ $(cat temp/tee5.txt) == "short" ]] && [ -d temp/tee_short ] && [ -d temp/tee_missing ] && echo "PASSED" || echo "FAILED"
+echo "Testing history..."
+[[ $(wc -l < temp_history) == $(wc -l < shell_test.txt) ]] && printf 'history -s EDITOR\nhistory -p PATH\nexit\n' | ../soyshell | grep -q "4  mkdir temp/\$EDITOR" && printf 'history -p PATH\nexit\n' | ../soyshell | grep -q "1  PATH = ../bin" && echo "PASSED" || echo "FAILED"
+echo "Testing server mode..."
+../soyshell --serve temp/sock > /dev/null 2>&1 &
+SERVER=$!
+for i in $(seq 50); do [ -S temp/sock ] && break; sleep 0.1; done
+../soyclient temp/sock exit 3
+STATUS=$?
+../soyclient temp/sock /bin/mkdir temp/served && [ -d temp/served ] && [[ $(echo stdio | ../soyclient temp/sock /bin/cat) == "stdio" ]] && [ $STATUS == 3 ] && echo "PASSED" || echo "FAILED"
+kill $SERVER
+echo "Testing end of input..."
+printf 'PATH = ../bin\nmkdir temp/eof_test' | timeout 5 ../soyshell > /dev/null && [ -d temp/eof_test ] && echo "PASSED" || echo "FAILED"
+echo "Testing rc file and snapshot..."
+printf 'PATH = ../bin\nRCDIR = rc_test\nmkdir temp/rc_side\nsnapshot\n' > temp_rc
+printf 'mkdir temp/$RCDIR\n' | ../soyshell > /dev/null && [ -d temp/rc_test ] && [ -d temp/rc_side ] && [ -f temp_rc.snap ] && rmdir temp/rc_test temp/rc_side \
+    && printf 'mkdir temp/$RCDIR\n' | ../soyshell > /dev/null && [ -d temp/rc_test ] && ! [ -d temp/rc_side ] \
+    && printf 'PATH = ../bin\nRCDIR = rc_changed\n' > temp_rc && printf 'mkdir temp/$RCDIR\n' | ../soyshell > /dev/null && [ -d temp/rc_changed ] && echo "PASSED" || echo "FAILED"
 # Cleanup
+rm -f temp_history temp_history.idx temp_rc temp_rc.snap
 rm -r temp
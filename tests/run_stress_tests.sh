@@ -0,0 +1,105 @@
+#!/bin/bash
+# Drive one long-running shell through many batches of pipelines, background
+# jobs, failed redirections and error paths, checking after each checkpoint
+# that it isn't leaking descriptors, memory or zombies and isn't slowing down.
+# Background jobs are only waited for at checkpoints, so the finished jobs the
+# shell keeps for wait pile up in between
+#   ROUNDS: Number of batches of 24 statements (default 200, 10000 for a soak run)
+#   CHECK_EVERY: Batches between checkpoints (default 20)
+#   SOYSHELL: Shell to test (default ../soyshell), e.g. an -fsanitize=address build
+ROUNDS=${ROUNDS:-200}
+CHECK_EVERY=${CHECK_EVERY:-20}
+SOYSHELL=${SOYSHELL:-../soyshell}
+MAX_RSS_GROWTH=4096 # kB the shell may grow by after the first checkpoint
+MAX_SLOWDOWN=3 # Most a batch may slow down by compared to the first checkpoint
+mkdir temp
+export HISTFILE= # Don't record the stress statements
+export SOYSHELLRC=
+echo "stress input" > temp/in.txt
+printf 'c\nb\na\n' > temp/lines.txt
+
+# Statements of one batch, each line on its own exercising a different path
+batch()
+{
+    cat <<'EOF'
+/bin/echo pipe | /bin/cat | /bin/cat > /dev/null
+echo builtin | grep builtin | /bin/cat > /dev/null
+/bin/cat < temp/in.txt | sort > /dev/null
+/bin/true &
+/bin/sh -c "exit 3" &
+/bin/cat < temp/missing.txt
+echo lost > temp/missing_dir/out.txt
+/bin/true 2> temp/missing_dir/err.txt
+/bin/true >
+echo "unmatched
+no_such_command arg
+cd temp/missing_dir
+place -x /bin/true
+cache -x /bin/true
+timeout 0.01 /bin/sleep 1 | /bin/cat
+/bin/echo $(echo inner) $(/bin/echo forked) > /dev/null
+echo appended >> temp/append.txt
+/bin/ls temp/missing temp > /dev/null 2>&1
+{ /bin/false || /bin/true } && /bin/true
+grep -c stress temp/in.txt temp/lines.txt > /dev/null
+sort -r temp/lines.txt | grep -v z > /dev/null
+FILE = ${UNSET:-temp/in.txt}
+/bin/cat 3< $FILE <&3 > /dev/null
+echo ${FILE%.txt} > /dev/null
+EOF
+}
+BATCH_LINES=$(batch | wc -l)
+
+# Number of zombie children of the process
+zombies()
+{
+    local n=0
+    for stat in /proc/[0-9]*/stat; do
+        read -r _ _ state ppid _ < "$stat" 2> /dev/null || continue
+        [[ $ppid == "$1" && $state == Z ]] && ((++n))
+    done
+    echo $n
+}
+
+coproc SH { exec "$SOYSHELL" 2> /dev/null; }
+PID=$SH_PID
+echo "PATH = ../bin" >&${SH[1]}
+echo "FDCACHE = 1" >&${SH[1]}
+FAILED=0
+BASE_FDS=""
+for ((round = 1; round <= ROUNDS; ++round)); do
+    start=$EPOCHREALTIME
+    { batch; ((round % CHECK_EVERY == 0)) && echo "wait"; echo "echo MARK$round"; } >&${SH[1]}
+    while read -r line <&${SH[0]}; do
+        [[ $line == *MARK$round ]] && break
+    done
+    if [[ -z $line ]]; then
+        echo "Shell stopped responding in round $round"
+        FAILED=1
+        break
+    fi
+    end=$EPOCHREALTIME
+    usPerLine=$(( (${end/./} - ${start/./}) / (BATCH_LINES + 1) ))
+    if ((round % CHECK_EVERY == 0)); then
+        fds=$(ls /proc/$PID/fd | wc -l)
+        rss=$(awk '/^VmRSS/ { print $2 }' /proc/$PID/status)
+        zombie=$(zombies $PID)
+        echo "round $round: $fds fds, $rss kB, $zombie zombies, ${usPerLine}us per statement"
+        if [[ -z $BASE_FDS ]]; then
+            BASE_FDS=$fds
+            BASE_RSS=$rss
+            BASE_US=$usPerLine
+        fi
+        ((fds != BASE_FDS)) && echo "Descriptors went from $BASE_FDS to $fds" && FAILED=1
+        ((rss - BASE_RSS > MAX_RSS_GROWTH)) && echo "RSS grew from $BASE_RSS kB to $rss kB" && FAILED=1
+        ((zombie > 0)) && echo "$zombie zombies left after wait" && FAILED=1
+        ((usPerLine > BASE_US * MAX_SLOWDOWN)) && echo "Statements slowed down from ${BASE_US}us to ${usPerLine}us" && FAILED=1
+        ((FAILED)) && break
+    fi
+done
+echo "exit" >&${SH[1]}
+wait $PID 2> /dev/null
+echo "Testing stress..."
+((FAILED == 0)) && echo "PASSED" || echo "FAILED"
+# Cleanup
+rm -r temp